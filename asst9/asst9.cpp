@@ -21,16 +21,20 @@
 #include "asstcommon.h"
 #include "cvec.h"
 #include "drawer.h"
+#include "fursim.h"
 #include "geometry.h"
 #include "geometrymaker.h"
 #include "glsupport.h"
 #include "keyframes.h"
+#include "levelcache.h"
 #include "matrix4.h"
 #include "mesh.h"
 #include "picker.h"
 #include "ppm.h"
 #include "rigtform.h"
 #include "scenegraph.h"
+#include "simplify.h"
+#include "vertexcache.h"
 
 using namespace std;
 
@@ -80,6 +84,7 @@ static const string SCENE_FILE = "./scene.csv";
 static shared_ptr<Material> g_bunnyMat; // for the bunny
 
 static vector<shared_ptr<Material>> g_bunnyShellMats; // for bunny shells
+static shared_ptr<Material> g_bunnyShellsInstancedMat; // for all of them
 
 // New Geometry
 static const int g_numShells =
@@ -87,8 +92,37 @@ static const int g_numShells =
 static double g_furHeight = 0.21;
 static double g_hairyness = 0.7;
 
-static shared_ptr<SimpleGeometryPN> g_bunnyGeometry;
+static shared_ptr<Geometry> g_bunnyGeometry;
+// Levels of detail of the bunny, finest (g_bunnyGeometry) first
+static const vector<int> g_bunnyLodBudgets = {2000, 1000, 500, 250};
+static vector<shared_ptr<Geometry>> g_bunnyLodGeometries;
+static vector<int> g_bunnyLodTriangles;
+// Catmull-Clark levels of the bunny, switched between with '[' and ']'. The
+// geometry of each level is kept with the revision of the level it was made
+// from, so that going back to a level only points the shape node at it
+static shared_ptr<SubdivisionLevelCache> g_bunnyLevels;
+struct BunnyLevelGeometry {
+  unsigned revision;
+  shared_ptr<Geometry> geometry;
+  int numTriangles;
+};
+static vector<BunnyLevelGeometry> g_bunnyLevelGeometries;
+static const int g_bunnyMaxLevel = 4;
+static int g_bunnyLevel = 0;
+static shared_ptr<SgGeometryShapeNode> g_bunnyShape;
+static double g_bunnyRadius;
 static vector<shared_ptr<SimpleGeometryPNX>> g_bunnyShellGeometries;
+// All shells in one instanced draw, extruded by the vertex shader from the
+// corners of the bunny's faces, uploaded once, and the hair tip at each
+// corner, streamed every frame
+static shared_ptr<FormattedVbo> g_bunnyShellCorners;
+static shared_ptr<StreamingVbo> g_bunnyShellTips;
+static shared_ptr<BufferObjectGeometry> g_bunnyShellsInstanced;
+static vector<int> g_bunnyShellCornerVertices; // vertex of each triangle corner
+static bool g_instancedShells = true; // or the shells extruded on the CPU
+// CPU time and bytes uploaded for the shells since the mode last changed
+static double g_shellSeconds = 0, g_shellBytes = 0;
+static int g_shellFrames = 0;
 static Mesh g_bunnyMesh;
 
 // New Scene node
@@ -130,10 +164,12 @@ static double g_numStepsPerFrame = 10;
 static double g_damping = 0.96;
 static double g_stiffness = 4;
 static int g_simulationsPerSecond = 60;
+// At most this many simulations per frame catch up with the clock; the fur
+// slows down rather than fall further behind
+static const int g_maxSimulationsPerFrame = 4;
+static FurClock g_simulationClock;
 
-static std::vector<Cvec3>
-    g_tipPos,      // should be hair tip pos in world-space coordinates
-    g_tipVelocity; // should be hair tip velocity in world-space coordinates
+static FurSim g_fur; // hair tips and their velocities, in world coordinates
 
 ///////////////// END OF G L O B A L S
 /////////////////////////////////////////////////////
@@ -181,46 +217,120 @@ static void initRobots() {
 }
 */
 
+// Makes an indexed geometry with one vertex per mesh vertex, and triangles
+// ordered for the post-transform vertex cache. The normals of m must be set.
+// m is moved to float storage, whose positions and normals are uploaded as
+// they are. With meshlets, the optimized triangles are also cut into
+// meshlets, so that the parts out of view or facing away are not drawn.
+static shared_ptr<Geometry> makeMeshGeometry(Mesh &m,
+                                             const bool meshlets = false) {
+  m.setFloatStorage();
+  const int numVertices = m.getNumVertices();
+  vector<unsigned> indexVec;
+  getMeshTriangles(m, indexVec);
+  const double acmr = computeAcmr(indexVec, numVertices);
+  optimizeVertexCache(indexVec, numVertices);
+  cerr << "mesh: " << numVertices << " vertices, " << indexVec.size() / 3
+       << " triangles, ACMR " << acmr << " -> "
+       << computeAcmr(indexVec, numVertices) << endl;
+  return makeSplitIndexedGeometryPN(m.getFloatPositions(),
+                                    m.getFloatNormals(), numVertices,
+                                    indexVec, meshlets);
+}
+
 // New function that loads the bunny mesh and initializes the bunny shell meshes
 static void initBunnyMeshes() {
+  g_bunnyMesh.cacheOneRings();
+  g_bunnyMesh.setFloatStorage();
   g_bunnyMesh.load("bunny.mesh");
 
-  // Compute normals
-  for (int vInd = 0; vInd < g_bunnyMesh.getNumVertices(); vInd++) {
-    Mesh::Vertex vtx = g_bunnyMesh.getVertex(vInd);
-
-    Cvec3 normal = Cvec3();
-    int sampleCt = 0;
-    Mesh::VertexIterator it(vtx.getIterator()), it0(it);
-
-    do {
-      normal += it.getFace().getNormal();
-      sampleCt++;
-    } while (++it != it0);
-
-    assert(sampleCt > 0);
-    normal = (normal / sampleCt);
-    vtx.setNormal(normal);
+  // Unit, area-weighted vertex normals. They used to be the plain mean of
+  // the unit normals of the faces around, which is shorter than 1 where the
+  // surface bends: shading leans toward the larger faces now, and the
+  // shells step out the full g_furHeight everywhere.
+  g_bunnyMesh.computeNormals();
+  g_bunnyGeometry = makeMeshGeometry(g_bunnyMesh, true);
+
+  // Coarser versions of the bunny for when it is small on screen
+  vector<Mesh> lods = makeLodChain(g_bunnyMesh, g_bunnyLodBudgets);
+  g_bunnyLodGeometries.assign(1, g_bunnyGeometry);
+  g_bunnyLodTriangles.assign(1, getNumMeshTriangles(lods[0]));
+  for (size_t i = 1; i < lods.size(); ++i) {
+    lods[i].computeNormals();
+    g_bunnyLodGeometries.push_back(makeMeshGeometry(lods[i]));
+    g_bunnyLodTriangles.push_back(getNumMeshTriangles(lods[i]));
   }
-
-  // Assemble vertices
-  vector<VertexPN> vertexVec;
-  for (int fInd = 0; fInd < g_bunnyMesh.getNumFaces(); fInd++) {
-    Mesh::Face face = g_bunnyMesh.getFace(fInd);
-    for (int fvInd = 0; fvInd < face.getNumVertices(); fvInd++) {
-      Mesh::Vertex faceVertex = face.getVertex(fvInd);
-      vertexVec.push_back(
-          VertexPN(faceVertex.getPosition(), faceVertex.getNormal()));
-    }
+  // level 0 is the bunny as loaded, whose geometry is made already
+  g_bunnyLevels.reset(new SubdivisionLevelCache(g_bunnyMesh));
+  const BunnyLevelGeometry level0 = {g_bunnyLevels->getRevision(0),
+                                     g_bunnyGeometry, g_bunnyLodTriangles[0]};
+  g_bunnyLevelGeometries.assign(1, level0);
+  g_bunnyRadius = 0;
+  for (int vInd = 0; vInd < g_bunnyMesh.getNumVertices(); vInd++) {
+    g_bunnyRadius =
+        max(g_bunnyRadius, norm(g_bunnyMesh.getVertex(vInd).getPosition()));
   }
 
-  g_bunnyGeometry.reset(new SimpleGeometryPN(&vertexVec[0], vertexVec.size()));
-
   // Now allocate array of SimpleGeometryPNX to for shells, one per layer
   g_bunnyShellGeometries.resize(g_numShells);
   for (int i = 0; i < g_numShells; ++i) {
     g_bunnyShellGeometries[i].reset(new SimpleGeometryPNX());
   }
+
+  // The corners of the triangles of the shells, quads and larger faces
+  // split into fans, for the instanced shells with the position and unit
+  // normal of their vertex, and texture coordinates by triangle corner,
+  // which the shader scales by g_hairyness
+  const Cvec2f triTex[] = {Cvec2f(0, 0), Cvec2f(1, 0), Cvec2f(0, 1)};
+  const Cvec3f *positions = g_bunnyMesh.getFloatPositions();
+  const Cvec3f *normals = g_bunnyMesh.getFloatNormals();
+  vector<unsigned> triangles;
+  getMeshTriangles(g_bunnyMesh, triangles);
+  g_bunnyShellCornerVertices.assign(triangles.begin(), triangles.end());
+  vector<VertexPNX> corners;
+  for (size_t i = 0; i < triangles.size(); i++) {
+    const int vInd = triangles[i];
+    corners.push_back(
+        VertexPNX(positions[vInd], normals[vInd], triTex[i % 3]));
+  }
+  g_bunnyShellCorners.reset(new FormattedVbo(VertexPNX::FORMAT));
+  g_bunnyShellCorners->upload(&corners[0], corners.size());
+  g_bunnyShellTips.reset(new StreamingVbo(VertexP::FORMAT));
+  cerr << "fur tips stream through "
+       << (g_bunnyShellTips->isPersistent() ? "a persistently mapped ring"
+                                            : "orphaned buffers")
+       << endl;
+  g_bunnyShellsInstanced.reset(new BufferObjectGeometry());
+  g_bunnyShellsInstanced->wire(g_bunnyShellCorners)
+      .wire("aTip", g_bunnyShellTips, "aPosition")
+      .instances(g_numShells);
+}
+
+// Draws the bunny at the given subdivision level, making the geometry of
+// the level only if it has none of its current revision. The fur stays on
+// level 0. Far away, the levels of detail of level 0 take over as before.
+static void setBunnyLevel(const int level) {
+  Mesh &m = g_bunnyLevels->getLevel(level);
+  if (level >= (int)g_bunnyLevelGeometries.size())
+    g_bunnyLevelGeometries.resize(level + 1);
+  BunnyLevelGeometry &g = g_bunnyLevelGeometries[level];
+  if (!g.geometry || g.revision != g_bunnyLevels->getRevision(level)) {
+    g.geometry = makeMeshGeometry(m, true);
+    g.numTriangles = getNumMeshTriangles(m);
+    g.revision = g_bunnyLevels->getRevision(level);
+  }
+  vector<shared_ptr<Geometry>> geometries(1, g.geometry);
+  vector<int> numTriangles(1, g.numTriangles);
+  geometries.insert(geometries.end(), g_bunnyLodGeometries.begin() + 1,
+                    g_bunnyLodGeometries.end());
+  numTriangles.insert(numTriangles.end(), g_bunnyLodTriangles.begin() + 1,
+                      g_bunnyLodTriangles.end());
+  g_bunnyShape->setLevelsOfDetail(geometries, numTriangles, Cvec3(),
+                                  g_bunnyRadius);
+  g_bunnyLevel = level;
+  cerr << "bunny subdivision level " << level << ": " << g.numTriangles
+       << " triangles, " << g_bunnyLevels->getMemoryUsage() / 1048576
+       << " MB of levels cached" << endl;
 }
 
 // takes a projection matrix and send to the the shaders
@@ -242,89 +352,123 @@ static void updateFrustFovY() {
   }
 }
 
-// Specifying shell geometries based on g_tipPos, g_furHeight, and g_numShells.
-// You need to call this function whenver the shell needs to be updated
-static void updateShellGeometry() {
+// Specifying shell geometries based on g_fur, g_furHeight, and g_numShells,
+// with the hair tips simAlpha of the way from the last simulation but one to
+// the last. You need to call this function whenver the shell needs to be
+// updated. Returns the number of bytes uploaded
+static size_t updateShellGeometry(const float simAlpha) {
   // TASK 1 and 3 TODO: finish this function as part of Task 1 and Task 3
-  Cvec2 triTex[] = {Cvec2(0., 0.), Cvec2(g_hairyness, 0.),
-                    Cvec2(0, g_hairyness)};
+  Cvec2f triTex[] = {Cvec2f(0., 0.), Cvec2f(g_hairyness, 0.),
+                     Cvec2f(0, g_hairyness)};
   Matrix4 worldToBunny =
       rigTFormToMatrix(getPathAccumRbt(g_world, g_bunnyNode));
 
+  // Per vertex, read straight from the float attributes of the mesh: the
+  // step n from shell to shell along the normal, and d, which bends the
+  // shells over to the tip of the hair
+  const int numVertices = g_bunnyMesh.getNumVertices();
+  const Cvec3f *positions = g_bunnyMesh.getFloatPositions();
+  const Cvec3f *normals = g_bunnyMesh.getFloatNormals();
+  vector<Cvec3f> steps(numVertices), bends(numVertices);
+  for (int vInd = 0; vInd < numVertices; vInd++) {
+    Cvec3 pos(positions[vInd][0], positions[vInd][1], positions[vInd][2]);
+    Cvec3f tip = g_fur.getTip(vInd, simAlpha);
+    Cvec3 tipInBunny =
+        Cvec3(worldToBunny * Cvec4(Cvec3(tip[0], tip[1], tip[2]), 1.));
+    Cvec3 n = Cvec3(normals[vInd][0], normals[vInd][1], normals[vInd][2]) *
+              ((double)g_furHeight / (double)g_numShells);
+    Cvec3 d = (tipInBunny - n * g_numShells - pos) *
+              (2 / (pow(g_numShells, 2) - g_numShells));
+    steps[vInd] = Cvec3f(n[0], n[1], n[2]);
+    bends[vInd] = Cvec3f(d[0], d[1], d[2]);
+  }
+  // corners come in triangles (see initBunnyMeshes())
+  const vector<int> &corners = g_bunnyShellCornerVertices;
+  vector<VertexPNX> shellVertices(corners.size());
   for (size_t shellNum = 0; shellNum < g_numShells; shellNum++) {
-    vector<VertexPNX> shellVertices;
-    shellVertices.reserve(g_bunnyMesh.getNumVertices());
-
-    for (size_t fInd = 0; fInd < g_bunnyMesh.getNumFaces(); fInd++) {
-      Mesh::Face face = g_bunnyMesh.getFace(fInd);
-      for (size_t fvInd = 0; fvInd < face.getNumVertices(); fvInd++) {
-        Mesh::Vertex vtx = face.getVertex(fvInd);
-        Cvec3 tipInBunny =
-            Cvec3(worldToBunny * Cvec4(g_tipPos[vtx.getIndex()], 1.));
-        Cvec3 normal = (tipInBunny - vtx.getPosition()) / g_numShells;
-        Cvec3 shellVtxPos = vtx.getPosition() + normal * (shellNum + 1);
-
-        Cvec3 n = vtx.getNormal() * ((double)g_furHeight / (double)g_numShells);
-        Cvec3 d = (tipInBunny - n * g_numShells - vtx.getPosition()) *
-                  (2 / (pow(g_numShells, 2) - g_numShells));
-
-        Cvec3 newPos = n * (shellNum + 1) +
-                       d * ((pow(shellNum, 2) + shellNum) / 2) +
-                       vtx.getPosition();
-        shellVertices.push_back(VertexPNX(newPos, n, triTex[fvInd]));
-      }
+    const float a = shellNum + 1, b = (shellNum * shellNum + shellNum) / 2;
+    for (size_t i = 0; i < corners.size(); i++) {
+      const int vInd = corners[i];
+      shellVertices[i] =
+          VertexPNX(steps[vInd] * a + bends[vInd] * b + positions[vInd],
+                    steps[vInd], triTex[i % 3]);
     }
     g_bunnyShellGeometries[shellNum]->upload(&shellVertices[0],
                                              shellVertices.size());
   }
+  return sizeof(VertexPNX) * shellVertices.size() * g_numShells;
 }
 
-// New function to initialize the dynamics simulation
-static void initSimulation() {
-  g_tipPos.resize(g_bunnyMesh.getNumVertices(), Cvec3(0));
-  g_tipVelocity = g_tipPos;
-
-  // TASK 1
-  // TODO: initialize g_tipPos to "at-rest" hair tips in world
-  // coordinates
-  for (size_t vInd = 0; vInd < g_bunnyMesh.getNumVertices(); vInd++) {
-    Mesh::Vertex vtx = g_bunnyMesh.getVertex(vInd);
-    assert(vInd == vtx.getIndex());
-    Cvec3 pos = vtx.getPosition();
-    Cvec3 norm = vtx.getNormal();
-    g_tipPos[vInd] = pos + (norm * g_furHeight);
+// The instanced counterpart of updateShellGeometry(): uploads only the hair
+// tips, at every corner, and the uniforms the vertex shader extrudes and
+// bends the shells with. Returns the number of bytes uploaded
+static size_t updateShellTips(const float simAlpha) {
+  const vector<int> &corners = g_bunnyShellCornerVertices;
+  VertexP *tips = g_bunnyShellTips->map<VertexP>(corners.size());
+  for (size_t i = 0; i < corners.size(); i++)
+    tips[i].p = g_fur.getTip(corners[i], simAlpha);
+  g_bunnyShellTips->unmap();
+  g_bunnyShellsInstancedMat->getUniforms()
+      .put("uWorldToBunny",
+           rigTFormToMatrix(getPathAccumRbt(g_world, g_bunnyNode)))
+      .put("uFurHeight", float(g_furHeight))
+      .put("uHairyness", float(g_hairyness));
+  return sizeof(VertexP) * corners.size();
+}
+
+// Switches between the instanced shells and the shells extruded on the CPU,
+// reporting what the shells cost per frame in the mode left
+static void toggleInstancedShells() {
+  if (g_shellFrames > 0) {
+    cerr << (g_instancedShells ? "instanced" : "CPU") << " shells: "
+         << g_shellSeconds * 1e3 / g_shellFrames << " ms and "
+         << g_shellBytes / g_shellFrames / 1024 << " KB uploaded per frame"
+         << endl;
   }
+  g_shellSeconds = g_shellBytes = 0;
+  g_shellFrames = 0;
+  g_instancedShells = !g_instancedShells;
+  g_bunnyShellsInstanced->instances(g_instancedShells ? g_numShells : 0);
+  if (g_instancedShells) {
+    for (int i = 0; i < g_numShells; ++i)
+      g_bunnyShellGeometries[i]->upload((const VertexPNX *)NULL, 0);
+  }
+  cerr << "Shells are "
+       << (g_instancedShells ? "instanced" : "extruded on the CPU") << endl;
+}
+
+// The bunny's frame as the hair simulation sees it
+static Matrix4 getBunnyInWorld() {
+  return rigTFormToMatrix(inv(getPathAccumRbt(g_world, g_bunnyNode)));
+}
+
+// New function to initialize the dynamics simulation: the hair tips at rest
+static void initSimulation() {
+  g_fur.reset(g_bunnyMesh, getBunnyInWorld(), g_furHeight);
 }
 
-// New function to update the simulation every frame
+// New function to run one simulation, 1 / g_simulationsPerSecond of time
 static void hairsSimulationUpdate() {
-  Matrix4 bunnyInWorld =
-      rigTFormToMatrix(inv(getPathAccumRbt(g_world, g_bunnyNode)));
-  // TASK 2
-  // TODO: write dynamics simulation code here
-  for (size_t step = 1; step <= g_numStepsPerFrame; step++) {
-    for (size_t vInd = 0; vInd < g_bunnyMesh.getNumVertices(); vInd++) {
-      Mesh::Vertex bunnyVtx = g_bunnyMesh.getVertex(vInd);
-
-      Cvec3 pos = Cvec3(bunnyInWorld * Cvec4(bunnyVtx.getPosition(), 1.));
-      Cvec3 norm =
-          Cvec3(bunnyInWorld * Cvec4(bunnyVtx.getNormal()), 1.).normalize();
-
-      // (1)
-      Cvec3 straight = pos + (norm * g_furHeight);
-      Cvec3 force = g_gravity + (straight - g_tipPos[vInd]) * g_stiffness;
-
-      // (2)
-      g_tipPos[vInd] += g_tipVelocity[vInd] * g_timeStep;
-
-      // (3)
-      g_tipPos[vInd] = pos + (g_tipPos[vInd] - pos).normalize() * g_furHeight;
-
-      // (4)
-      g_tipVelocity[vInd] =
-          ((force * g_timeStep + g_tipVelocity[vInd]) * g_damping);
-    }
-  }
+  // g_timeStep is tuned for 60 simulations per second; fewer take longer
+  // steps so that the fur moves as fast
+  const FurSim::Params params = {g_furHeight,
+                                 g_stiffness,
+                                 g_damping,
+                                 g_timeStep * 60 / g_simulationsPerSecond,
+                                 g_gravity,
+                                 int(g_numStepsPerFrame)};
+  g_fur.step(getBunnyInWorld(), params);
+}
+
+// Runs as many simulations as the time since the last call asks for,
+// whatever the frame rate, and returns how far now is past the last one,
+// as a fraction of a simulation, for the shells to interpolate the tips by
+static float advanceSimulation(const double now) {
+  const double period = 1. / g_simulationsPerSecond;
+  for (int n = g_simulationClock.advance(now, period, g_maxSimulationsPerFrame);
+       n > 0; --n)
+    hairsSimulationUpdate();
+  return g_simulationClock.alpha(now, period);
 }
 
 static Matrix4 makeProjectionMatrix() {
@@ -414,7 +558,10 @@ static void drawStuff(bool picking) {
   uniforms.put("uLight2", eyeLight2);
 
   if (!picking) {
-    Drawer drawer(invEyeRbt, uniforms);
+    // pixels per unit length at unit depth, for the levels of detail
+    const double pixelsPerUnit =
+        1 / getScreenToEyeScale(-1, g_frustFovY, g_windowHeight);
+    Drawer drawer(invEyeRbt, uniforms, pixelsPerUnit, &projmat);
     g_world->accept(drawer);
 
     if (g_displayArcball && shouldUseArcball()) {
@@ -660,6 +807,8 @@ static void keyboard(GLFWwindow *window, int key, int scancode, int action,
            << "s\t\tsave screenshot\n"
            << "f\t\tToggle flat shading on/off.\n"
            << "v\t\tCycle view\n"
+           << "b\t\tToggle instanced/CPU fur shells\n"
+           << "[ ]\t\tBunny subdivision level down/up\n"
            << "drag left mouse to rotate\n"
            << endl;
       break;
@@ -763,6 +912,17 @@ static void keyboard(GLFWwindow *window, int key, int scancode, int action,
     case GLFW_KEY_SPACE:
       g_spaceDown = true;
       break;
+    case GLFW_KEY_B:
+      toggleInstancedShells();
+      break;
+    case GLFW_KEY_LEFT_BRACKET:
+      if (g_bunnyLevel > 0)
+        setBunnyLevel(g_bunnyLevel - 1);
+      break;
+    case GLFW_KEY_RIGHT_BRACKET:
+      if (g_bunnyLevel < g_bunnyMaxLevel)
+        setBunnyLevel(g_bunnyLevel + 1);
+      break;
     case GLFW_KEY_RIGHT:
       g_furHeight *= 1.05;
       cerr << "fur height = " << g_furHeight << std::endl;
@@ -902,7 +1062,7 @@ static void initMaterials() {
   // each layer of the shell uses a different material, though the materials
   // will share the same shader files and some common uniforms. hence we
   // create a prototype here, and will copy from the prototype later
-  Material bunnyShellMatPrototype("./shaders/bunny-shell-gl3.vshader",
+  Material bunnyShellMatPrototype("./shaders/bunny-shell-layer-gl3.vshader",
                                   "./shaders/bunny-shell-gl3.fshader");
   bunnyShellMatPrototype.getUniforms().put("uTexShell", shellTexture);
   bunnyShellMatPrototype.getRenderStates()
@@ -919,6 +1079,18 @@ static void initMaterials() {
     g_bunnyShellMats[i]->getUniforms().put(
         "uAlphaExponent", 2.f + 5.f * float(i + 1) / g_numShells);
   }
+
+  // the instanced shells need one material only, whose vertex shader
+  // extrudes the shells and derives the exponent from the shell index
+  g_bunnyShellsInstancedMat.reset(new Material(
+      "./shaders/bunny-shell-gl3.vshader", "./shaders/bunny-shell-gl3.fshader"));
+  g_bunnyShellsInstancedMat->getUniforms()
+      .put("uTexShell", shellTexture)
+      .put("uNumShells", g_numShells);
+  g_bunnyShellsInstancedMat->getRenderStates()
+      .blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA)
+      .enable(GL_BLEND)
+      .disable(GL_CULL_FACE);
 };
 
 static void initGeometry() {
@@ -1033,14 +1205,18 @@ static void initScene() {
   g_bunnyNode.reset(new SgRbtNode());
 
   // add bunny as a shape nodes
-  g_bunnyNode->addChild(
-      shared_ptr<MyShapeNode>(new MyShapeNode(g_bunnyGeometry, g_bunnyMat)));
+  g_bunnyShape.reset(new MyShapeNode(g_bunnyGeometry, g_bunnyMat));
+  setBunnyLevel(g_bunnyLevel);
+  g_bunnyNode->addChild(g_bunnyShape);
 
-  // add each shell as shape node
+  // add each shell as shape node, and all of them as one instanced node;
+  // only the nodes of the current mode draw anything
   for (int i = 0; i < g_numShells; ++i) {
     g_bunnyNode->addChild(shared_ptr<MyShapeNode>(
         new MyShapeNode(g_bunnyShellGeometries[i], g_bunnyShellMats[i])));
   }
+  g_bunnyNode->addChild(shared_ptr<MyShapeNode>(
+      new MyShapeNode(g_bunnyShellsInstanced, g_bunnyShellsInstancedMat)));
 
   g_world->addChild(g_skyNode);
   g_world->addChild(g_groundNode);
@@ -1063,12 +1239,17 @@ static void initScene() {
 
 void glfwLoop() {
   g_lastFrameClock = glfwGetTime();
+  g_simulationClock.reset(g_lastFrameClock);
   while (!glfwWindowShouldClose(g_window)) {
     double now = glfwGetTime();
     if (now - g_lastFrameClock >= 1. / g_framesPerSecond) {
       handleAnimation();
-      updateShellGeometry();
-      hairsSimulationUpdate();
+      const float simAlpha = advanceSimulation(now);
+      const double shellStart = glfwGetTime();
+      g_shellBytes += g_instancedShells ? updateShellTips(simAlpha)
+                                        : updateShellGeometry(simAlpha);
+      g_shellSeconds += glfwGetTime() - shellStart;
+      ++g_shellFrames;
       display();
       g_lastFrameClock = now;
     }
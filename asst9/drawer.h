@@ -11,10 +11,15 @@ class Drawer : public SgNodeVisitor {
   protected:
     std::vector<RigTForm> rbtStack_;
     Uniforms &uniforms_;
+    double pixelsPerUnit_; // for picking levels of detail, 0 if disabled
+    const Matrix4 *projection_; // for culling, NULL if disabled
 
   public:
-    Drawer(const RigTForm &initialRbt, Uniforms &uniforms)
-        : rbtStack_(1, initialRbt), uniforms_(uniforms) {}
+    Drawer(const RigTForm &initialRbt, Uniforms &uniforms,
+           const double pixelsPerUnit = 0,
+           const Matrix4 *projection = NULL)
+        : rbtStack_(1, initialRbt), uniforms_(uniforms),
+          pixelsPerUnit_(pixelsPerUnit), projection_(projection) {}
 
     virtual bool visit(SgTransformNode &node) {
         rbtStack_.push_back(rbtStack_.back() * node.getRbt());
@@ -30,6 +35,10 @@ class Drawer : public SgNodeVisitor {
         const Matrix4 MVM =
             rigTFormToMatrix(rbtStack_.back()) * shapeNode.getAffineMatrix();
         sendModelViewNormalMatrix(uniforms_, MVM, normalMatrix(MVM));
+        if (pixelsPerUnit_ > 0)
+            shapeNode.selectLevelOfDetail(MVM, pixelsPerUnit_);
+        if (projection_)
+            shapeNode.cull(MVM, *projection_);
         shapeNode.draw(uniforms_);
         return true;
     }
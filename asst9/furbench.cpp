@@ -0,0 +1,129 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   Headless benchmark of the hair simulation of asst9 (fursim.h), with
+//   no window. Build and run with "make OPT=1 bench-fur", which runs it on
+//   the subdivision levels in LEVELS, or by hand from this directory so
+//   that bunny.mesh is found:
+//
+//     ./furbench [level ...]
+//
+//   At every level the bunny node goes through the same scripted motion
+//   for ten seconds, drawn at 45 frames per second with a few stalls,
+//   while the fur is simulated 60 times per second as in asst9.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+#include "cvec.h"
+#include "fursim.h"
+#include "matrix4.h"
+#include "mesh.h"
+#include "quat.h"
+#include "rigtform.h"
+#include "threadpool.h"
+
+using namespace std;
+
+// The simulation settings of asst9
+static const FurSim::Params g_params = {0.21, 4, 0.96, 0.02,
+                                        Cvec3(0, -0.5, 0), 10};
+static const double g_simulationsPerSecond = 60;
+static const int g_maxSimulationsPerFrame = 4;
+
+static const double g_seconds = 10;
+static const double g_framesPerSecond = 45;
+static const int g_stallEvery = 100;      // frames
+static const double g_stallSeconds = 0.2; // more than the catch-up allows
+
+static double nowSeconds() {
+  return chrono::duration<double>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// The bunny node at time t: bobbing, swaying and nodding
+static RigTForm bunnyAt(const double t) {
+  return RigTForm(Cvec3(0.5 * sin(2 * t), 0.25 * sin(5 * t), 0),
+                  Quat::makeYRotation(90 * sin(1.3 * t)) *
+                      Quat::makeXRotation(30 * sin(3 * t)));
+}
+
+// What asst9 passes FurSim for the bunny node at rbt
+static Matrix4 bunnyInWorld(const RigTForm &rbt) {
+  return rigTFormToMatrix(inv(rbt));
+}
+
+static void benchLevel(const int level) {
+  Mesh m;
+  m.load("bunny.mesh");
+  for (int i = 0; i < level; ++i) {
+    m.computeCatmullClarkPoints();
+    m.subdivide();
+  }
+  m.computeNormals();
+
+  FurSim fur;
+  fur.reset(m, bunnyInWorld(bunnyAt(0)), g_params.furHeight);
+  FurClock clock(0);
+  const double period = 1 / g_simulationsPerSecond;
+  int frames = 0, simulations = 0;
+  double simSeconds = 0, maxFrameSeconds = 0, t = 0;
+  while (t < g_seconds) {
+    ++frames;
+    t += 1 / g_framesPerSecond;
+    if (frames % g_stallEvery == 0)
+      t += g_stallSeconds;
+    const Matrix4 meshToWorld = bunnyInWorld(bunnyAt(t));
+    const double t0 = nowSeconds();
+    for (int n = clock.advance(t, period, g_maxSimulationsPerFrame); n > 0;
+         --n) {
+      fur.step(meshToWorld, g_params);
+      ++simulations;
+    }
+    const double frameSeconds = nowSeconds() - t0;
+    simSeconds += frameSeconds;
+    maxFrameSeconds = max(maxFrameSeconds, frameSeconds);
+  }
+
+  // weighted so that mixed up coordinates show too
+  double checksum = 0;
+  for (int v = 0; v < fur.getNumTips(); ++v) {
+    const Cvec3f tip = fur.getTip(v);
+    checksum += tip[0] + 2.0 * tip[1] + 3.0 * tip[2];
+  }
+  const double tipSubsteps =
+      double(fur.getNumTips()) * g_params.numSteps * simulations;
+  printf("%5d %8d %6d %11d %14.2f %9.3f %9.3f %14.6f\n", level,
+         fur.getNumTips(), frames, simulations,
+         simSeconds / tipSubsteps * 1e9, simSeconds / frames * 1e3,
+         maxFrameSeconds * 1e3, checksum);
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    vector<int> levels;
+    for (int i = 1; i < argc; ++i)
+      levels.push_back(atoi(argv[i]));
+    if (levels.empty())
+      levels = {0, 1, 2};
+    printf("threads: %d, %g simulations of %d substeps per second\n",
+           ThreadPool::shared().getNumThreads(), g_simulationsPerSecond,
+           g_params.numSteps);
+    printf("%5s %8s %6s %11s %14s %9s %9s %14s\n", "level", "tips", "frames",
+           "simulations", "ns/tip-substep", "frame ms", "max ms",
+           "checksum");
+    for (size_t i = 0; i < levels.size(); ++i)
+      benchLevel(levels[i]);
+    return 0;
+  } catch (const runtime_error &e) {
+    fprintf(stderr, "Exception caught: %s\n", e.what());
+    return -1;
+  }
+}
@@ -0,0 +1,235 @@
+#ifndef FURSIM_H
+#define FURSIM_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "mesh.h"
+#include "threadpool.h"
+
+// The hair tips of the fur, one per mesh vertex. Each tip hangs on a damped
+// spring pulling it toward the end of a straight hair along the vertex
+// normal, and is held at the length of the hair from its vertex.
+//
+// The tips are kept in float as a structure of arrays, in blocks of LANES
+// tips: a block holds the x coordinates of its tips, then the y, then the z,
+// for the rest positions and normals (in the frame of the mesh), the tips
+// and their velocities (in world coordinates). step() transforms the rest
+// positions and normals of a block to the world once, then takes its tips
+// through every substep doing each operation on all LANES tips at once,
+// which compilers turn into SIMD instructions: one AVX register, two SSE or
+// NEON registers. The square roots only vectorize with -fno-math-errno, as
+// the Makefile builds. Blocks are spread across ThreadPool::shared().
+//
+//   FurSim fur;
+//   fur.reset(mesh, meshToWorld, furHeight);
+//   fur.step(meshToWorld, params);  // every frame
+//   fur.getTip(v);                  // where the hair of vertex v ends
+//
+// The tips before the last step() are kept as well, so that a renderer
+// running at its own rate can draw the tips in between (see getTip()).
+class FurSim {
+  public:
+    enum { LANES = 8 };
+
+    struct Params {
+        double furHeight, stiffness, damping, timeStep;
+        Cvec3 gravity;
+        int numSteps; // substeps per step()
+    };
+
+  private:
+    struct Block {
+        float restPosition_[3][LANES], restNormal_[3][LANES];
+        float tip_[3][LANES], velocity_[3][LANES];
+        float previousTip_[3][LANES]; // before the last step()
+    };
+    std::vector<Block> blocks_;
+    int numTips_;
+
+    // The top three rows of m, in float
+    static void affine__(const Matrix4 &m, float a[12]) {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j)
+                a[4 * i + j] = float(m(i, j));
+        }
+    }
+    // World positions and unit normals of the rest frames of b
+    static void world_frames__(const Block &b, const float a[12],
+                               float p[3][LANES], float n[3][LANES]) {
+        const float(*r)[LANES] = b.restPosition_;
+        const float(*q)[LANES] = b.restNormal_;
+        for (int i = 0; i < 3; ++i) {
+            for (int k = 0; k < LANES; ++k) {
+                p[i][k] = a[4 * i] * r[0][k] + a[4 * i + 1] * r[1][k] +
+                          a[4 * i + 2] * r[2][k] + a[4 * i + 3];
+                n[i][k] = a[4 * i] * q[0][k] + a[4 * i + 1] * q[1][k] +
+                          a[4 * i + 2] * q[2][k];
+            }
+        }
+        for (int k = 0; k < LANES; ++k) {
+            const float s = 1 / std::sqrt(n[0][k] * n[0][k] +
+                                          n[1][k] * n[1][k] +
+                                          n[2][k] * n[2][k]);
+            n[0][k] *= s, n[1][k] *= s, n[2][k] *= s;
+        }
+    }
+    static void step_block__(Block &b, const float a[12], const Params &p) {
+        float pos[3][LANES], nrm[3][LANES];
+        world_frames__(b, a, pos, nrm);
+        const float h = p.furHeight, stiffness = p.stiffness,
+                    damping = p.damping, dt = p.timeStep;
+        const float g[3] = {float(p.gravity[0]), float(p.gravity[1]),
+                            float(p.gravity[2])};
+        float(*t)[LANES] = b.tip_;
+        float(*v)[LANES] = b.velocity_;
+        std::memcpy(b.previousTip_, b.tip_, sizeof(b.tip_));
+        for (int step = 0; step < p.numSteps; ++step) {
+            float force[3][LANES], scale[LANES];
+            for (int i = 0; i < 3; ++i) {
+                for (int k = 0; k < LANES; ++k) {
+                    // the spring toward the straight hair
+                    force[i][k] =
+                        g[i] +
+                        (pos[i][k] + nrm[i][k] * h - t[i][k]) * stiffness;
+                    t[i][k] += v[i][k] * dt;
+                }
+            }
+            for (int k = 0; k < LANES; ++k) {
+                float len2 = 0;
+                for (int i = 0; i < 3; ++i)
+                    len2 += (t[i][k] - pos[i][k]) * (t[i][k] - pos[i][k]);
+                scale[k] = h / std::sqrt(len2);
+            }
+            for (int i = 0; i < 3; ++i) {
+                for (int k = 0; k < LANES; ++k) {
+                    // back to the length of the hair
+                    t[i][k] = pos[i][k] + (t[i][k] - pos[i][k]) * scale[k];
+                    v[i][k] = (force[i][k] * dt + v[i][k]) * damping;
+                }
+            }
+        }
+    }
+
+  public:
+    FurSim() : numTips_(0) {}
+
+    // One tip per vertex of m, whose normals must be set, at rest at the end
+    // of a straight hair of length furHeight
+    void reset(Mesh &m, const Matrix4 &meshToWorld, const double furHeight) {
+        numTips_ = m.getNumVertices();
+        blocks_.assign((numTips_ + LANES - 1) / LANES, Block());
+        for (std::size_t j = 0; j < blocks_.size(); ++j) {
+            Block &b = blocks_[j];
+            for (int k = 0; k < LANES; ++k) {
+                const int v = LANES * int(j) + k;
+                // padding is a hair along z at the origin
+                const Cvec3 p =
+                    v < numTips_ ? m.getVertex(v).getPosition() : Cvec3();
+                const Cvec3 n = v < numTips_ ? m.getVertex(v).getNormal()
+                                             : Cvec3(0, 0, 1);
+                for (int i = 0; i < 3; ++i) {
+                    b.restPosition_[i][k] = p[i];
+                    b.restNormal_[i][k] = n[i];
+                    b.velocity_[i][k] = 0;
+                }
+            }
+            float a[12], pos[3][LANES], nrm[3][LANES];
+            affine__(meshToWorld, a);
+            world_frames__(b, a, pos, nrm);
+            for (int i = 0; i < 3; ++i) {
+                for (int k = 0; k < LANES; ++k)
+                    b.tip_[i][k] = pos[i][k] + nrm[i][k] * float(furHeight);
+            }
+            std::memcpy(b.previousTip_, b.tip_, sizeof(b.tip_));
+        }
+    }
+
+    int getNumTips() const { return numTips_; }
+
+    Cvec3f getTip(const int v) const {
+        const Block &b = blocks_[v / LANES];
+        const int k = v % LANES;
+        return Cvec3f(b.tip_[0][k], b.tip_[1][k], b.tip_[2][k]);
+    }
+    // The tip alpha of the way from before the last step() to now; exactly
+    // the one before for alpha 0, and the one now for 1
+    Cvec3f getTip(const int v, const float alpha) const {
+        const Block &b = blocks_[v / LANES];
+        const int k = v % LANES;
+        Cvec3f t;
+        for (int i = 0; i < 3; ++i) {
+            t[i] = b.previousTip_[i][k] * (1 - alpha) + b.tip_[i][k] * alpha;
+        }
+        return t;
+    }
+    Cvec3f getVelocity(const int v) const {
+        const Block &b = blocks_[v / LANES];
+        const int k = v % LANES;
+        return Cvec3f(b.velocity_[0][k], b.velocity_[1][k],
+                      b.velocity_[2][k]);
+    }
+
+    // Takes every tip through p.numSteps substeps, the mesh being at
+    // meshToWorld throughout
+    void step(const Matrix4 &meshToWorld, const Params &p) {
+        float a[12];
+        affine__(meshToWorld, a);
+        ThreadPool::shared().parallelFor(
+            0, blocks_.size(),
+            [&](const int lo, const int hi) {
+                for (int j = lo; j < hi; ++j)
+                    step_block__(blocks_[j], a, p);
+            },
+            32);
+    }
+
+    std::size_t getMemoryUsage() const {
+        return blocks_.capacity() * sizeof(Block);
+    }
+};
+
+// Runs a simulation at a fixed rate against a clock that keeps its own pace,
+// e.g. one read per rendered frame. advance() tells how many simulations to
+// run to catch up, and alpha() how far the clock is past the last of them,
+// to interpolate by (see FurSim::getTip()):
+//
+//   FurClock clock(now);
+//   ...  // every frame
+//   for (int n = clock.advance(now, period, 4); n > 0; --n)
+//       fur.step(meshToWorld, params);
+//   fur.getTip(v, clock.alpha(now, period));
+class FurClock {
+    double time_; // simulated up to
+
+  public:
+    explicit FurClock(const double now = 0) : time_(now) {}
+
+    void reset(const double now) { time_ = now; }
+
+    // Number of simulations of period seconds due by now. At most maxSteps
+    // catch up at once; beyond that the backlog is dropped, so that the
+    // simulation slows down rather than fall further and further behind.
+    int advance(const double now, const double period, const int maxSteps) {
+        int n = 0;
+        for (; now - time_ >= period; time_ += period) {
+            if (n == maxSteps) {
+                time_ = now - std::fmod(now - time_, period);
+                break;
+            }
+            ++n;
+        }
+        return n;
+    }
+
+    // How far now is past the last simulation, in [0, 1) periods
+    float alpha(const double now, const double period) const {
+        return (now - time_) / period;
+    }
+};
+
+#endif
@@ -11,6 +11,14 @@ const VertexFormat VertexPN::FORMAT =
         .put("aPosition", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPN, p))
         .put("aNormal", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPN, n));
 
+const VertexFormat VertexP::FORMAT =
+    VertexFormat(sizeof(VertexP))
+        .put("aPosition", 3, GL_FLOAT, GL_FALSE, offsetof(VertexP, p));
+
+const VertexFormat VertexN::FORMAT =
+    VertexFormat(sizeof(VertexN))
+        .put("aNormal", 3, GL_FLOAT, GL_FALSE, offsetof(VertexN, n));
+
 const VertexFormat VertexPNX::FORMAT =
     VertexFormat(sizeof(VertexPNX))
         .put("aPosition", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPNX, p))
@@ -25,12 +33,100 @@ const VertexFormat VertexPNTBX::FORMAT =
         .put("aBinormal", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPNTBX, b))
         .put("aTexCoord", 2, GL_FLOAT, GL_FALSE, offsetof(VertexPNX, x));
 
+StreamingVbo::StreamingVbo(const VertexFormat &formatDesc)
+    : VertexBufferObject(formatDesc),
+      persistent_(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage), regionSize_(0),
+      region_(-1), ring_(NULL), mapLength_(0) {
+  for (int i = 0; i < REGIONS; ++i)
+    fences_[i] = NULL;
+}
+
+StreamingVbo::~StreamingVbo() {
+  for (int i = 0; i < REGIONS; ++i) {
+    if (fences_[i])
+      glDeleteSync(fences_[i]);
+  }
+}
+
+void StreamingVbo::allocate(const size_t regionSize) {
+  // GL keeps the old buffer object around for the draws still reading it
+  for (int i = 0; i < REGIONS; ++i) {
+    if (fences_[i])
+      glDeleteSync(fences_[i]);
+    fences_[i] = NULL;
+  }
+  glDeleteBuffers(1, &handle_);
+  glGenBuffers(1, &handle_);
+
+  const GLbitfield flags =
+      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  glBindBuffer(GL_ARRAY_BUFFER, handle_);
+  glBufferStorage(GL_ARRAY_BUFFER, REGIONS * regionSize, NULL, flags);
+  ring_ = static_cast<char *>(
+      glMapBufferRange(GL_ARRAY_BUFFER, 0, REGIONS * regionSize, flags));
+  if (!ring_)
+    throw runtime_error("Cannot map a streaming vertex buffer");
+  regionSize_ = regionSize;
+  region_ = -1;
+}
+
+void *StreamingVbo::mapBytes(const int length) {
+  const size_t size = size_t(getVertexFormat().getVertexSize()) * length;
+  mapLength_ = length;
+  if (!persistent_) {
+    staging_.resize(max<size_t>(size, 1));
+    return &staging_[0];
+  }
+
+  if (size > regionSize_) {
+    // grow by half at least, in 256 byte steps
+    allocate((max(size, regionSize_ + regionSize_ / 2) + 255) & ~size_t(255));
+  }
+  region_ = (region_ + 1) % REGIONS;
+  if (fences_[region_]) {
+    // the GPU is still behind on the frame that used this region last
+    while (glClientWaitSync(fences_[region_], GL_SYNC_FLUSH_COMMANDS_BIT,
+                            1000000000) == GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(fences_[region_]);
+    fences_[region_] = NULL;
+  }
+  return ring_ + region_ * regionSize_;
+}
+
+void StreamingVbo::unmap() {
+  length_ = mapLength_;
+  if (persistent_) {
+    assert(region_ >= 0);
+    // the coherent mapping makes the writes visible to the draws to come
+    offset_ = region_ * regionSize_;
+    return;
+  }
+  const int size = getVertexFormat().getVertexSize() * length_;
+  glBindBuffer(GL_ARRAY_BUFFER, *this);
+  glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, size, &staging_[0]);
+#ifndef NDEBUG
+  checkGlErrors();
+#endif
+}
+
+void StreamingVbo::fence() {
+  if (!persistent_ || region_ < 0)
+    return;
+  // a later draw from the same region replaces the fence of the earlier one
+  if (fences_[region_])
+    glDeleteSync(fences_[region_]);
+  fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
 BufferObjectGeometry::BufferObjectGeometry()
-    : wiringChanged_(true), primitiveType_(GL_TRIANGLES) {}
+    : wiringChanged_(true), primitiveType_(GL_TRIANGLES), ranged_(false),
+      instances_(1) {}
 
 BufferObjectGeometry &
 BufferObjectGeometry::wire(const string &targetAttribName,
-                           shared_ptr<FormattedVbo> source,
+                           shared_ptr<VertexBufferObject> source,
                            const string &sourceAttribName) {
   wiringChanged_ = true;
   wiring_[targetAttribName] = make_pair(source, sourceAttribName);
@@ -38,13 +134,13 @@ BufferObjectGeometry::wire(const string &targetAttribName,
 }
 
 BufferObjectGeometry &
-BufferObjectGeometry::wire(shared_ptr<FormattedVbo> source,
+BufferObjectGeometry::wire(shared_ptr<VertexBufferObject> source,
                            const string &sourceAttribName) {
   return wire(sourceAttribName, source, sourceAttribName);
 }
 
 BufferObjectGeometry &
-BufferObjectGeometry::wire(shared_ptr<FormattedVbo> source) {
+BufferObjectGeometry::wire(shared_ptr<VertexBufferObject> source) {
   const VertexFormat &vfd = source->getVertexFormat();
   for (int i = 0, n = vfd.getNumAttribs(); i < n; ++i) {
     wire(source, vfd.getAttrib(i).name);
@@ -79,6 +175,27 @@ BufferObjectGeometry::primitiveType(GLenum primitiveType) {
   return *this;
 }
 
+BufferObjectGeometry &
+BufferObjectGeometry::indexRanges(const vector<GLsizei> &counts,
+                                  const vector<const GLvoid *> &offsets) {
+  assert(counts.size() == offsets.size());
+  ranged_ = true;
+  rangeCounts_ = counts;
+  rangeOffsets_ = offsets;
+  return *this;
+}
+
+BufferObjectGeometry &BufferObjectGeometry::allIndices() {
+  ranged_ = false;
+  return *this;
+}
+
+BufferObjectGeometry &BufferObjectGeometry::instances(int count) {
+  assert(count >= 0);
+  instances_ = count;
+  return *this;
+}
+
 const vector<string> &BufferObjectGeometry::getVertexAttribNames() {
   if (wiringChanged_)
     processWiring();
@@ -88,6 +205,8 @@ const vector<string> &BufferObjectGeometry::getVertexAttribNames() {
 void BufferObjectGeometry::draw(int attribIndices[]) {
   if (wiringChanged_)
     processWiring();
+  if (instances_ == 0)
+    return;
 
   const unsigned int UNDEFINED_VB_LEN = 0xFFFFFFFF;
   unsigned int vboLen = UNDEFINED_VB_LEN;
@@ -104,16 +223,39 @@ void BufferObjectGeometry::draw(int attribIndices[]) {
     for (size_t j = 0; j < pvw.vb2GeoIdx.size(); ++j) {
       int loc = attribIndices[pvw.vb2GeoIdx[j].second];
       if (loc >= 0)
-        vfd.setGlVertexAttribPointer(pvw.vb2GeoIdx[j].first, loc);
+        vfd.setGlVertexAttribPointer(pvw.vb2GeoIdx[j].first, loc,
+                                     pvw.vb->getOffset());
     }
   }
 
   if (isIndexed()) {
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *ib_);
-    glDrawElements(primitiveType_, ib_->length(), ib_->getIndexFormat(), 0);
+    if (!ranged_ && instances_ == 1)
+      glDrawElements(primitiveType_, ib_->length(), ib_->getIndexFormat(), 0);
+    else if (!ranged_)
+      glDrawElementsInstanced(primitiveType_, ib_->length(),
+                              ib_->getIndexFormat(), 0, instances_);
+    else if (instances_ == 1 && !rangeCounts_.empty())
+      glMultiDrawElements(primitiveType_, &rangeCounts_[0],
+                          ib_->getIndexFormat(), &rangeOffsets_[0],
+                          rangeCounts_.size());
+    else {
+      // there is no instanced glMultiDrawElements, so one call per range
+      for (size_t i = 0; i < rangeCounts_.size(); ++i)
+        glDrawElementsInstanced(primitiveType_, rangeCounts_[i],
+                                ib_->getIndexFormat(), rangeOffsets_[i],
+                                instances_);
+    }
   } else if (vboLen != UNDEFINED_VB_LEN) {
-    glDrawArrays(primitiveType_, 0, vboLen);
+    if (instances_ == 1)
+      glDrawArrays(primitiveType_, 0, vboLen);
+    else
+      glDrawArraysInstanced(primitiveType_, 0, vboLen, instances_);
   }
+
+  // the draws are issued, so streamed vertices may fence them
+  for (int i = 0, n = perVbWirings_.size(); i < n; ++i)
+    perVbWirings_[i].vb->fence();
 }
 
 void BufferObjectGeometry::processWiring() {
@@ -121,16 +263,16 @@ void BufferObjectGeometry::processWiring() {
   vertexAttribNames_.clear();
 
   // maps from target vbo to index within perVbWiring_
-  map<shared_ptr<FormattedVbo>, int> vbIdx;
+  map<shared_ptr<VertexBufferObject>, int> vbIdx;
 
   // go through all wiring definitions
   for (Wiring::const_iterator i = wiring_.begin(), e = wiring_.end(); i != e;
        ++i) {
-    shared_ptr<FormattedVbo> vb = i->second.first;   // target vbo
+    shared_ptr<VertexBufferObject> vb = i->second.first;   // target vbo
     const VertexFormat &vfd = vb->getVertexFormat(); // target vbo's format
 
     // see if this vbo is already in our vbIdx map
-    map<shared_ptr<FormattedVbo>, int>::iterator j = vbIdx.find(vb);
+    map<shared_ptr<VertexBufferObject>, int>::iterator j = vbIdx.find(vb);
     int idx = 0; // idx of vbo in perVbWiring_, to be set
     if (j == vbIdx.end()) {
       idx = perVbWirings_.size();
@@ -149,3 +291,40 @@ void BufferObjectGeometry::processWiring() {
   }
   wiringChanged_ = false;
 }
+
+template <typename Index>
+static shared_ptr<Geometry>
+makeSplitGeometry(const Cvec3f *positions, const Cvec3f *normals,
+                  const int numVertices, const vector<Index> &indices,
+                  const vector<Meshlet> *meshlets) {
+  if (meshlets)
+    return shared_ptr<Geometry>(
+        new MeshletGeometry<SplitIndexedGeometryPN<Index>>(
+            *meshlets, positions, normals, &indices[0], numVertices,
+            indices.size()));
+  return shared_ptr<Geometry>(new SplitIndexedGeometryPN<Index>(
+      positions, normals, &indices[0], numVertices, indices.size()));
+}
+
+shared_ptr<Geometry> makeSplitIndexedGeometryPN(const Cvec3f *positions,
+                                                const Cvec3f *normals,
+                                                const int numVertices,
+                                                vector<unsigned> indices,
+                                                const bool meshlets) {
+  if (numVertices == 0 || indices.empty())
+    return shared_ptr<Geometry>(new SplitIndexedGeometryPN<unsigned>());
+  vector<Meshlet> clusters;
+  if (meshlets) {
+    vector<Cvec3> p(numVertices);
+    for (int i = 0; i < numVertices; ++i)
+      p[i] = Cvec3(positions[i][0], positions[i][1], positions[i][2]);
+    buildMeshlets(indices, p, clusters);
+  }
+  if (numVertices <= 0x10000) {
+    const vector<unsigned short> shortIndices(indices.begin(), indices.end());
+    return makeSplitGeometry(positions, normals, numVertices, shortIndices,
+                             meshlets ? &clusters : NULL);
+  }
+  return makeSplitGeometry(positions, normals, numVertices, indices,
+                           meshlets ? &clusters : NULL);
+}
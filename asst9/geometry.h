@@ -1,6 +1,7 @@
 #ifndef GEOMETRY_H
 #define GEOMETRY_H
 
+#include <cstddef>
 #include <vector>
 #include <cassert>
 #include <map>
@@ -8,10 +9,13 @@
 #include <string>
 #include <stdexcept>
 #include <memory>
+#include <utility>
 
 #include "cvec.h"
 #include "glsupport.h"
 #include "geometrymaker.h"
+#include "matrix4.h"
+#include "meshlets.h"
 
 // An abstract class that encapsulates geometry data that provides vertex attributes and
 // know how to draw itself.
@@ -26,6 +30,11 @@ public:
   // not used. The caller is responsible for enable/disable vertex attribute arrays.
   virtual void draw(int attribIndices[]) = 0;
 
+  // Called before draw() with the model view and projection matrices, so that
+  // geometries that know the bounds of their parts can skip the parts out of
+  // view in the draws that follow. The default draws everything.
+  virtual void cull(const Matrix4& MVM, const Matrix4& projection) {}
+
   virtual ~Geometry() {}
 };
 
@@ -98,11 +107,12 @@ public:
 
   // Calls glVertexAttribPointer with appropirate arguments to bind the attribute
   // indexed by 'attribIndex' within this VertexFormat to vertex attribute location
-  // specified by 'glAttribLocation'
-  void setGlVertexAttribPointer(int attribIndex, int glAttribLocation) const {
+  // specified by 'glAttribLocation', for vertices starting 'baseOffset' bytes into
+  // the buffer object
+  void setGlVertexAttribPointer(int attribIndex, int glAttribLocation, std::size_t baseOffset = 0) const {
     assert(glAttribLocation >= 0);
     const AttribDesc &ad = attribDescs_[attribIndex];
-    glVertexAttribPointer(glAttribLocation, ad.size, ad.type, ad.normalized, vertexSize_, reinterpret_cast<const GLvoid*>(ad.offset));
+    glVertexAttribPointer(glAttribLocation, ad.size, ad.type, ad.normalized, vertexSize_, reinterpret_cast<const GLvoid*>(baseOffset + ad.offset));
   }
 
 private:
@@ -111,17 +121,22 @@ private:
   std::map<std::string, int> name2Idx_;
 };
 
-// Light wrapper for a GL buffer object storing vertices, together with format for its vertices.
-class FormattedVbo : public GlBufferObject {
+// A GL buffer object storing vertices, together with format for its vertices,
+// as the draws of BufferObjectGeometry see it. FormattedVbo and StreamingVbo
+// below fill it in.
+class VertexBufferObject : public GlBufferObject {
   const VertexFormat& format_;
+
+protected:
   int length_;
+  std::size_t offset_;
+
+  // formatDesc is stored by reference, see FormattedVbo
+  VertexBufferObject(const VertexFormat& formatDesc)
+    : format_(formatDesc), length_(0), offset_(0) {}
 
 public:
-  // The passed in formatDesc_ is stored by reference. Hence the caller
-  // should either pass in a static global variable, or ensure its lifespan
-  // encompasses the lifespan of the FormmatedVbo
-  FormattedVbo(const VertexFormat& formatDesc)
-    : format_(formatDesc), length_(0) {}
+  virtual ~VertexBufferObject() {}
 
   const VertexFormat& getVertexFormat() const {
     return format_;
@@ -132,11 +147,30 @@ public:
     return length_;
   }
 
+  // Byte offset of the vertices within the buffer object. Always 0, but for
+  // a StreamingVbo, whose vertices move around its ring
+  std::size_t getOffset() const {
+    return offset_;
+  }
+
+  // Called right after issuing the draws that read the vertices
+  virtual void fence() {}
+};
+
+// Light wrapper for a GL buffer object storing vertices, together with format for its vertices.
+class FormattedVbo : public VertexBufferObject {
+public:
+  // The passed in formatDesc_ is stored by reference. Hence the caller
+  // should either pass in a static global variable, or ensure its lifespan
+  // encompasses the lifespan of the FormmatedVbo
+  FormattedVbo(const VertexFormat& formatDesc)
+    : VertexBufferObject(formatDesc) {}
+
   // Upload vertex data to the vbo. Specify dynamicUsage = true if you intend
   // to upload different data multiple times
   template<typename Vertex>
   void upload(const Vertex* vertices, int length, bool dynamicUsage = false) {
-    assert(sizeof(Vertex) == format_.getVertexSize());
+    assert(sizeof(Vertex) == getVertexFormat().getVertexSize());
     glBindBuffer(GL_ARRAY_BUFFER, *this);
     length_ = length;
 
@@ -153,10 +187,90 @@ public:
     }
 #ifndef NDEBUG
     checkGlErrors();
+#endif
+  }
+
+  // Uploads again only the vertices in the ranges [first, last) of spans,
+  // one glBufferSubData each, e.g. the spans of Mesh::updateNormals().
+  // vertices holds all the vertices, as passed to upload().
+  template<typename Vertex>
+  void update(const Vertex* vertices, const std::vector<std::pair<int, int> >& spans) {
+    assert(sizeof(Vertex) == getVertexFormat().getVertexSize());
+    glBindBuffer(GL_ARRAY_BUFFER, *this);
+    for (std::size_t i = 0; i < spans.size(); ++i) {
+      assert(spans[i].first < spans[i].second && spans[i].second <= length_);
+      glBufferSubData(GL_ARRAY_BUFFER, sizeof(Vertex) * spans[i].first,
+                      sizeof(Vertex) * (spans[i].second - spans[i].first),
+                      vertices + spans[i].first);
+    }
+#ifndef NDEBUG
+    checkGlErrors();
 #endif
   }
 };
 
+// A vertex buffer for vertices written anew every frame, straight into
+// memory the GPU reads from. The buffer object is a ring of REGIONS regions,
+// mapped once for good (glBufferStorage with GL_MAP_PERSISTENT_BIT and
+// GL_MAP_COHERENT_BIT). Every map() hands out the next region, which the
+// draws after unmap() read while the following frames write the others.
+// fence() fences the draws from the region, which BufferObjectGeometry calls
+// right after them, and map() waits on the fence before handing the region
+// out again, should the GPU be REGIONS frames behind.
+//
+// Without ARB_buffer_storage (e.g. the OpenGL 4.1 of the Mac) map() returns
+// memory of its own instead, which unmap() uploads the way
+// FormattedVbo::upload() does with dynamicUsage.
+//
+// It is no FormattedVbo: the buffer object is an immutable ring of regions
+// (glBufferStorage), which upload() and update() would break or write under
+// the draws in flight.
+//
+//   VertexP* v = vbo->map<VertexP>(n);
+//   ...  // fill in v[0] to v[n - 1]
+//   vbo->unmap();
+//   ...  // draw
+class StreamingVbo : public VertexBufferObject {
+public:
+  enum { REGIONS = 3 };
+
+  StreamingVbo(const VertexFormat& formatDesc);
+  ~StreamingVbo();
+
+  // Whether the vertices are written straight into the buffer object
+  bool isPersistent() const {
+    return persistent_;
+  }
+
+  // Space for length vertices, to be filled in before unmap(). The
+  // vertices drawn stay those of the previous unmap() till then
+  template<typename Vertex>
+  Vertex* map(int length) {
+    assert(sizeof(Vertex) == getVertexFormat().getVertexSize());
+    return static_cast<Vertex*>(mapBytes(length));
+  }
+
+  // Makes the vertices filled in since map() the ones drawn
+  void unmap();
+
+  // Fences the draws issued so far from the region handed out last
+  virtual void fence();
+
+private:
+  const bool persistent_;
+  std::size_t regionSize_; // bytes
+  int region_;             // handed out last, -1 for none
+  char* ring_;             // all regions, when persistent_
+  GLsync fences_[REGIONS]; // after the draws from each region
+  std::vector<char> staging_; // the vertices filled in, when not persistent_
+  int mapLength_;
+
+  void* mapBytes(int length);
+
+  // Replaces the buffer object by a ring of regionSize byte regions
+  void allocate(std::size_t regionSize);
+};
+
 // Light wrapper for a GL buffer object storing indices, together with format for its
 // indices, one of GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT, or GL_UNSIGNED_INT
 class FormattedIbo : public GlBufferObject {
@@ -203,11 +317,12 @@ public:
 // with or without an index buffer, and as different primitives (e.g., triangles, quads, points...).
 //
 // This essentially maintains a map of
-//   vertex attribute names --> (FormattedVbo, attribute name)
+//   vertex attribute names --> (VertexBufferObject, attribute name)
 //
 // To draw its self, it binds all the vertex attributes that it is wired to, and calls
 // the suitable OpenGL calls to draw either indexed or non-index geometry. There are optimizations
-// to call glBindBuffer only once for each distince FormattedVbo it wires to.
+// to call glBindBuffer only once for each distince VertexBufferObject it wires to. After the
+// draw calls it calls fence() of each of them.
 
 class BufferObjectGeometry : public Geometry {
 public:
@@ -215,19 +330,19 @@ public:
   BufferObjectGeometry();
 
   // Declares and maps a vertex attribute named 'targetAttribName' to the
-  // vertex attribute named 'sourceAttribName' of the 'source' FormattedVbo
+  // vertex attribute named 'sourceAttribName' of the 'source' VertexBufferObject
   BufferObjectGeometry& wire(const std::string& targetAttribName,
-                             std::shared_ptr<FormattedVbo> source,
+                             std::shared_ptr<VertexBufferObject> source,
                              const std::string& sourceAttribName);
 
   // Declares and maps a vertex attribute to the vertex attribute
-  // named 'sourceAttribName' of the 'source' FormattedVbo. The declared
+  // named 'sourceAttribName' of the 'source' VertexBufferObject. The declared
   // vertex attribute also holds the name 'sourceAttribName'
-  BufferObjectGeometry& wire(std::shared_ptr<FormattedVbo> source, const std::string& sourceAttribName);
+  BufferObjectGeometry& wire(std::shared_ptr<VertexBufferObject> source, const std::string& sourceAttribName);
 
-  // Declares and maps all vertex attributes contained in the 'source' FormattedVbo.
+  // Declares and maps all vertex attributes contained in the 'source' VertexBufferObject.
   // Same names are used for each attribute.
-  BufferObjectGeometry& wire(std::shared_ptr<FormattedVbo> source);
+  BufferObjectGeometry& wire(std::shared_ptr<VertexBufferObject> source);
 
   // Set the index buffer to be used. Pass in a null shared_ptr to mean non-indexed. Default is non-indexed
   BufferObjectGeometry& indexedBy(std::shared_ptr<FormattedIbo> ib);
@@ -239,6 +354,24 @@ public:
   // Anything you can pass to glDrawArrays is fair game
   BufferObjectGeometry& primitiveType(GLenum primitiveType);
 
+  // Restricts indexed drawing to ranges of the index buffer, given as index
+  // counts and byte offsets, drawn with a single glMultiDrawElements. No
+  // ranges draw nothing.
+  BufferObjectGeometry& indexRanges(const std::vector<GLsizei>& counts,
+                                    const std::vector<const GLvoid*>& offsets);
+
+  // Draws the whole index buffer again. This is the default
+  BufferObjectGeometry& allIndices();
+
+  // Draws count instances with one instanced draw call, the shaders telling
+  // them apart by gl_InstanceID. Default is 1, a plain draw; 0 draws nothing
+  BufferObjectGeometry& instances(int count);
+
+  // Return the number of instances drawn. Default is 1
+  int getInstances() const {
+    return instances_;
+  }
+
   // Return if we are in indexed mode
   bool isIndexed() const {
     return (bool)ib_;
@@ -254,24 +387,32 @@ public:
   virtual void draw(int attribIndices[]);
 
 private:
-  typedef std::map<std::string, std::pair<std::shared_ptr<FormattedVbo>, std::string> > Wiring;
+  typedef std::map<std::string, std::pair<std::shared_ptr<VertexBufferObject>, std::string> > Wiring;
 
   GLenum primitiveType_;
   bool wiringChanged_;
   Wiring wiring_;
   std::shared_ptr<FormattedIbo> ib_;
 
+  // Set by indexRanges()
+  bool ranged_;
+  std::vector<GLsizei> rangeCounts_;
+  std::vector<const GLvoid*> rangeOffsets_;
+
+  // Set by instances()
+  int instances_;
+
   // Internal struct for optimized vb binding order
   struct PerVbWiring {
     // Use bare pointers since shared_ptrs are maintained by wiring_, hence
     // we do not need to worry about keeping it getting freed
-    const FormattedVbo* vb;
+    VertexBufferObject* vb;
 
     // A map from (attribute index in vb) --> relative index within BufferObjectGeometry's
     // exposed vertex attributes
     std::vector<std::pair<int, int> > vb2GeoIdx;
 
-    PerVbWiring(const FormattedVbo* _vb) : vb(_vb) {}
+    PerVbWiring(VertexBufferObject* _vb) : vb(_vb) {}
   };
 
   std::vector<PerVbWiring> perVbWirings_;
@@ -329,6 +470,20 @@ struct VertexPN {
 
 };
 
+// A vertex buffer holding only floating point Positions, or only Normals, for
+// geometries that keep their attributes in separate vbos
+struct VertexP {
+  Cvec3f p;
+
+  static const VertexFormat FORMAT;
+};
+
+struct VertexN {
+  Cvec3f n;
+
+  static const VertexFormat FORMAT;
+};
+
 // A vertex with floating point Position, Normal, and one set of teXture Coordinates;
 struct VertexPNX {
   Cvec3f p, n;
@@ -430,12 +585,26 @@ public:
 };
 
 
+// The FormattedIbo format of indices of the given size in bytes
+inline GLenum size2IboFmt(int size) {
+  if (size == 1)
+    return GL_UNSIGNED_BYTE;
+  if (size == 2)
+    return GL_UNSIGNED_SHORT;
+  if (size == 4)
+    return GL_UNSIGNED_INT;
+  assert(0);
+  throw std::runtime_error("Invalid index buffer format supplied");
+}
+
 // Simple Index geometry implementation based on BufferObjectGeometry
 template<typename Vertex, typename Index>
 class SimpleIndexedGeometry : public BufferObjectGeometry {
   std::shared_ptr<FormattedVbo> vbo;
   std::shared_ptr<FormattedIbo> ibo;
 public:
+  typedef Index IndexType;
+
   SimpleIndexedGeometry()
     : vbo(new FormattedVbo(Vertex::FORMAT)), ibo(new FormattedIbo(size2IboFmt(sizeof(Index)))) {
     wire(vbo);
@@ -456,16 +625,10 @@ public:
     ibo->upload(indices, numIndices, true);
   }
 
-private:
-  GLenum size2IboFmt(int size) {
-    if (size == 1)
-      return GL_UNSIGNED_BYTE;
-    if (size == 2)
-      return GL_UNSIGNED_SHORT;
-    if (size == 4)
-      return GL_UNSIGNED_INT;
-    assert(0);
-    throw std::runtime_error("Invalid index buffer format supplied");
+  // Uploads again the vertices in spans only (see FormattedVbo::update()).
+  // The bounds of a MeshletGeometry stay those of the first upload.
+  void updateVertices(const Vertex* vertices, const std::vector<std::pair<int, int> >& spans) {
+    vbo->update(vertices, spans);
   }
 };
 
@@ -479,4 +642,142 @@ typedef SimpleIndexedGeometry<VertexPN, unsigned short> SimpleIndexedGeometryPN;
 typedef SimpleIndexedGeometry<VertexPNX, unsigned short> SimpleIndexedGeometryPNX;
 typedef SimpleIndexedGeometry<VertexPNTBX, unsigned short> SimpleIndexedGeometryPNTBX;
 
+// Indexed geometry with positions and normals in two vbos of packed floats,
+// the way a Mesh with float storage keeps them (Mesh::getFloatPositions()),
+// so that each goes up with a single copy instead of a VertexPN at a time
+template<typename Index>
+class SplitIndexedGeometryPN : public BufferObjectGeometry {
+  std::shared_ptr<FormattedVbo> pvbo, nvbo;
+  std::shared_ptr<FormattedIbo> ibo;
+public:
+  typedef Index IndexType;
+
+  SplitIndexedGeometryPN()
+    : pvbo(new FormattedVbo(VertexP::FORMAT)), nvbo(new FormattedVbo(VertexN::FORMAT)),
+      ibo(new FormattedIbo(size2IboFmt(sizeof(Index)))) {
+    wire(pvbo).wire(nvbo).indexedBy(ibo);
+    primitiveType(GL_TRIANGLES);
+  }
+
+  SplitIndexedGeometryPN(const Cvec3f* positions, const Cvec3f* normals, const Index* indices,
+                         int numVertices, int numIndices)
+    : pvbo(new FormattedVbo(VertexP::FORMAT)), nvbo(new FormattedVbo(VertexN::FORMAT)),
+      ibo(new FormattedIbo(size2IboFmt(sizeof(Index)))) {
+    wire(pvbo).wire(nvbo).indexedBy(ibo);
+    primitiveType(GL_TRIANGLES);
+    upload(positions, normals, indices, numVertices, numIndices);
+  }
+
+  void upload(const Cvec3f* positions, const Cvec3f* normals, const Index* indices,
+              int numVertices, int numIndices) {
+    pvbo->upload(positions, numVertices, true);
+    nvbo->upload(normals, numVertices, true);
+    ibo->upload(indices, numIndices, true);
+  }
+
+  // Uploads again the positions and normals in spans only (see
+  // FormattedVbo::update())
+  void updateVertices(const Cvec3f* positions, const Cvec3f* normals,
+                      const std::vector<std::pair<int, int> >& spans) {
+    pvbo->update(positions, spans);
+    nvbo->update(normals, spans);
+  }
+};
+
+
+// Makes an indexed geometry, storing the indices as unsigned shorts when
+// there are few enough vertices and as unsigned ints otherwise
+template<typename Vertex>
+std::shared_ptr<Geometry> makeIndexedGeometry(const std::vector<Vertex>& vertices,
+                                              const std::vector<unsigned>& indices) {
+  if (vertices.empty() || indices.empty())
+    return std::shared_ptr<Geometry>(new SimpleIndexedGeometry<Vertex, unsigned>());
+  if (vertices.size() <= 0x10000) {
+    std::vector<unsigned short> shortIndices(indices.begin(), indices.end());
+    return std::shared_ptr<Geometry>(new SimpleIndexedGeometry<Vertex, unsigned short>(
+        &vertices[0], &shortIndices[0], vertices.size(), shortIndices.size()));
+  }
+  return std::shared_ptr<Geometry>(new SimpleIndexedGeometry<Vertex, unsigned>(
+      &vertices[0], &indices[0], vertices.size(), indices.size()));
+}
+
+// Indexed triangles in meshlets (see meshlets.h), drawn by the indexed
+// geometry Base, e.g. SimpleIndexedGeometry. cull() keeps the meshlets that
+// may be in view and face the eye, and the next draws submit only those,
+// with runs of consecutive visible meshlets merged into one range.
+template<typename Base>
+class MeshletGeometry : public Base {
+  typedef typename Base::IndexType Index;
+
+  std::vector<Meshlet> meshlets_;
+  std::vector<int> visible_;
+  std::vector<GLsizei> counts_;
+  std::vector<const GLvoid*> offsets_;
+
+public:
+  // The indices given to Base, along with the rest of its arguments, must
+  // be in the order of buildMeshlets()
+  template<typename... Args>
+  MeshletGeometry(const std::vector<Meshlet>& meshlets, const Args&... args)
+    : Base(args...), meshlets_(meshlets) {}
+
+  const std::vector<Meshlet>& getMeshlets() const {
+    return meshlets_;
+  }
+
+  // Meshlets kept by the last cull()
+  int getNumVisibleMeshlets() const {
+    return visible_.size();
+  }
+
+  virtual void cull(const Matrix4& MVM, const Matrix4& projection) {
+    visible_.clear();
+    cullMeshlets(meshlets_, MVM, projection, visible_);
+    counts_.clear();
+    offsets_.clear();
+    for (std::size_t i = 0; i < visible_.size(); ++i) {
+      const Meshlet& m = meshlets_[visible_[i]];
+      if (i > 0 && visible_[i - 1] + 1 == visible_[i]) {
+        counts_.back() += m.numIndices;
+      } else {
+        counts_.push_back(m.numIndices);
+        offsets_.push_back(reinterpret_cast<const GLvoid*>(sizeof(Index) * m.firstIndex));
+      }
+    }
+    this->indexRanges(counts_, offsets_);
+  }
+};
+
+// Makes a MeshletGeometry out of a triangle list, best cache-optimized,
+// which is split into meshlets in its order, with the index type picked as
+// in makeIndexedGeometry()
+template<typename Vertex>
+std::shared_ptr<Geometry> makeMeshletGeometry(const std::vector<Vertex>& vertices,
+                                              std::vector<unsigned> indices) {
+  if (vertices.empty() || indices.empty())
+    return std::shared_ptr<Geometry>(new SimpleIndexedGeometry<Vertex, unsigned>());
+  std::vector<Cvec3> positions(vertices.size());
+  for (std::size_t i = 0; i < vertices.size(); ++i)
+    positions[i] = Cvec3(vertices[i].p[0], vertices[i].p[1], vertices[i].p[2]);
+  std::vector<Meshlet> meshlets;
+  buildMeshlets(indices, positions, meshlets);
+  if (vertices.size() <= 0x10000) {
+    std::vector<unsigned short> shortIndices(indices.begin(), indices.end());
+    return std::shared_ptr<Geometry>(
+        new MeshletGeometry<SimpleIndexedGeometry<Vertex, unsigned short> >(
+            meshlets, &vertices[0], &shortIndices[0], vertices.size(), shortIndices.size()));
+  }
+  return std::shared_ptr<Geometry>(new MeshletGeometry<SimpleIndexedGeometry<Vertex, unsigned> >(
+      meshlets, &vertices[0], &indices[0], vertices.size(), indices.size()));
+}
+
+// Makes a SplitIndexedGeometryPN out of numVertices positions and normals,
+// with the index type picked as in makeIndexedGeometry(), and with the
+// triangles in meshlets as in makeMeshletGeometry() when asked to
+std::shared_ptr<Geometry> makeSplitIndexedGeometryPN(const Cvec3f* positions,
+                                                     const Cvec3f* normals,
+                                                     int numVertices,
+                                                     std::vector<unsigned> indices,
+                                                     bool meshlets = false);
+
 #endif
@@ -0,0 +1,175 @@
+#ifndef LEVELCACHE_H
+#define LEVELCACHE_H
+
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "mesh.h"
+
+// Catmull-Clark levels of a control mesh, kept once computed so that going
+// back to a level is a lookup instead of subdivide() from level 0. The
+// levels live within a memory budget: when they exceed it, the least
+// recently used ones are dropped and computed again on demand.
+//
+//   SubdivisionLevelCache levels(control, 256 << 20);
+//   Mesh &m = levels.getLevel(3);
+//   if (levels.getRevision(3) != bufferRevision[3]) ... // upload m again
+//
+// When only the control positions change, setControlPositions() keeps the
+// topology of every level and marks their positions stale. A stale level
+// gets its positions from the nearest up-to-date coarser level with
+// computeCatmullClarkPoints() and subdividePositions(), which skips the
+// edge matching of subdivide(), and only once it is asked for.
+//
+// Levels come with the normals of computeNormals(). The revision of a level
+// changes whenever its positions do, and is never reused, so a client can
+// keep GPU buffers per level and rebuild them only when they are stale. The
+// control mesh itself is level 0 and is never dropped.
+class SubdivisionLevelCache {
+    struct level_t {
+        Mesh mesh_;
+        bool present_;            // mesh_ holds the topology of the level
+        bool fresh_;              // and positions from the current control
+        bool normals_;            // and normals for them
+        unsigned long long used_; // getLevel() clock of the last use
+        unsigned revision_;
+
+        level_t()
+            : present_(false), fresh_(false), normals_(false), used_(0),
+              revision_(0) {}
+    };
+
+    std::vector<level_t> levels_;
+    std::size_t budget_;
+    unsigned long long clock_;
+    unsigned revisions_; // the last revision handed out
+
+    level_t &level__(const int level) {
+        if (level < 0)
+            throw std::runtime_error("Negative subdivision level.");
+        if (level >= (int)levels_.size())
+            levels_.resize(level + 1);
+        return levels_[level];
+    }
+    // Makes level k + 1 up to date from level k, which must be up to date
+    void refine__(const int k) {
+        Mesh &coarse = levels_[k].mesh_;
+        level_t &fine = level__(k + 1);
+        coarse.computeCatmullClarkPoints();
+        if (fine.present_) {
+            coarse.subdividePositions(fine.mesh_);
+        } else {
+            Mesh next(coarse);
+            next.subdivide();
+            fine.mesh_ = std::move(next);
+            fine.present_ = true;
+        }
+        coarse.compact();
+        fine.mesh_.compact();
+        fine.fresh_ = true;
+        fine.normals_ = false;
+        fine.revision_ = ++revisions_;
+    }
+    // Drops least recently used levels, but not level 0 or keep, until the
+    // rest fits in the budget
+    void evict__(const int keep) {
+        while (getMemoryUsage() > budget_) {
+            int lru = -1;
+            for (int i = 1; i < (int)levels_.size(); ++i) {
+                if (i != keep && levels_[i].present_ &&
+                    (lru < 0 || levels_[i].used_ < levels_[lru].used_))
+                    lru = i;
+            }
+            if (lru < 0)
+                return;
+            levels_[lru].mesh_ = Mesh();
+            levels_[lru].present_ = levels_[lru].fresh_ = false;
+            levels_[lru].normals_ = false;
+        }
+    }
+
+  public:
+    // Caches the levels of control, which must be closed and manifold for
+    // any level above 0. The levels take the parallel mode and the one-ring
+    // cache setting of control.
+    explicit SubdivisionLevelCache(const Mesh &control,
+                                   const std::size_t budget = 256 << 20)
+        : levels_(1), budget_(budget), clock_(0), revisions_(0) {
+        setControl(control);
+    }
+
+    // Starts over with a new control mesh, e.g. after an edit of the faces
+    void setControl(const Mesh &control) {
+        levels_.assign(1, level_t());
+        levels_[0].mesh_ = control;
+        levels_[0].mesh_.compact();
+        levels_[0].present_ = levels_[0].fresh_ = true;
+        levels_[0].revision_ = ++revisions_;
+    }
+    // New positions for the same control mesh, which must share its
+    // topology with the one the cache holds (i.e. be a copy of it). Every
+    // level keeps its topology; the positions are redone on demand.
+    void setControlPositions(Mesh &control) {
+        Mesh &m = levels_[0].mesh_;
+        if (!control.sharesTopology(m))
+            throw std::runtime_error(
+                "setControlPositions() needs the topology of the control.");
+        for (int i = 0; i < control.getNumVertices(); ++i)
+            m.getVertex(i).setPosition(control.getVertex(i).getPosition());
+        levels_[0].normals_ = false;
+        levels_[0].revision_ = ++revisions_;
+        for (std::size_t i = 1; i < levels_.size(); ++i)
+            levels_[i].fresh_ = false;
+    }
+
+    // The mesh of the given level, computed from the nearest up-to-date
+    // coarser level if need be. The reference stays valid until the next
+    // call that changes the cache.
+    Mesh &getLevel(const int level) {
+        level__(level);
+        int k = level;
+        while (!levels_[k].fresh_)
+            --k;
+        for (; k < level; ++k) {
+            levels_[k].used_ = ++clock_;
+            refine__(k);
+        }
+        level_t &l = levels_[level];
+        if (!l.normals_) {
+            l.mesh_.computeNormals();
+            l.mesh_.compact();
+            l.normals_ = true;
+        }
+        l.used_ = ++clock_;
+        evict__(level);
+        return l.mesh_;
+    }
+
+    // True when getLevel(level) is a lookup
+    bool isCached(const int level) const {
+        return level >= 0 && level < (int)levels_.size() &&
+               levels_[level].fresh_;
+    }
+    // Changes whenever the positions of the level change
+    unsigned getRevision(const int level) const {
+        return level >= 0 && level < (int)levels_.size()
+                   ? levels_[level].revision_
+                   : 0;
+    }
+
+    std::size_t getMemoryUsage() const {
+        std::size_t bytes = 0;
+        for (std::size_t i = 0; i < levels_.size(); ++i)
+            bytes += levels_[i].mesh_.getMemoryUsage();
+        return bytes;
+    }
+    std::size_t getBudget() const { return budget_; }
+    void setBudget(const std::size_t budget) {
+        budget_ = budget;
+        evict__(-1);
+    }
+};
+
+#endif
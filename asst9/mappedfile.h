@@ -0,0 +1,82 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of the whole content of a file. On POSIX systems the file
+// is memory mapped; elsewhere it is read into memory in one go. Throws
+// runtime_error if the file cannot be opened.
+class MappedFile {
+    const char *data_;
+    std::size_t size_;
+    std::vector<char> buffer_; // fallback storage when not memory mapped
+    bool mapped_;
+
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    void read__(const char filename[]) {
+        std::ifstream f(filename, std::ios::binary);
+        if (!f)
+            throw std::runtime_error(std::string("Cannot open file ") +
+                                     filename);
+        f.seekg(0, std::ios::end);
+        buffer_.resize(f.tellg());
+        f.seekg(0, std::ios::beg);
+        if (!buffer_.empty())
+            f.read(&buffer_[0], buffer_.size());
+        if (!f)
+            throw std::runtime_error(std::string("Cannot read file ") +
+                                     filename);
+        data_ = buffer_.empty() ? NULL : &buffer_[0];
+        size_ = buffer_.size();
+    }
+
+  public:
+    explicit MappedFile(const char filename[])
+        : data_(NULL), size_(0), mapped_(false) {
+#ifndef _WIN32
+        const int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Cannot open file ") +
+                                     filename);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data_ = static_cast<const char *>(p);
+                size_ = st.st_size;
+                mapped_ = true;
+            }
+        }
+        close(fd);
+        if (!mapped_)
+            read__(filename);
+#else
+        read__(filename);
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (mapped_)
+            munmap(const_cast<char *>(data_), size_);
+#endif
+    }
+
+    const char *data() const { return data_; }
+    std::size_t size() const { return size_; }
+};
+
+#endif
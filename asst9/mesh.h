@@ -1,14 +1,44 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
-#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include "cvec.h"
+#include "mappedfile.h"
+#include "threadpool.h"
 
 class Mesh {
+  public:
+    // Halfedges are packed as face | (corner << CODE_SHIFT), and the edges of
+    // a face as edge | (slot << CODE_SHIFT). By default the codes are ints,
+    // which limits faces and edges to 2^28. Defining MESH_WIDE_HALFEDGES
+    // (make WIDE_MESH=1) packs them in 64 bits instead, at 16 more bytes per
+    // face and 8 per edge and vertex, which leaves only the int range of the
+    // element indices as a limit.
+#ifdef MESH_WIDE_HALFEDGES
+    typedef long long halfedge_code;
+    enum { CODE_SHIFT = 32 };
+    static constexpr long long MAX_ELEMENTS = 0x7fffffff;
+#else
+    typedef int halfedge_code;
+    enum { CODE_SHIFT = 28 };
+    static constexpr long long MAX_ELEMENTS = 1 << CODE_SHIFT;
+#endif
+
+  private:
     typedef int vertex_index;
     typedef int edge_index;
     typedef int face_index;
@@ -16,230 +46,1415 @@ class Mesh {
     struct face_t {
         Cvec<int, 4> vertex_; // this will be either a tri or a quad
                               // (face_t::vertex[3] == -1  => this is a tri)
-        Cvec<int, 4> edge_;
-    };
-    struct vertex_t {
-        Cvec3 position_;
-        Cvec3 normal_;
-        int halfedge_;
+        Cvec<halfedge_code, 4> edge_;
     };
     struct edge_t {
-        Cvec<int, 2> halfedge_;
+        Cvec<halfedge_code, 2> halfedge_;
+    };
+
+    static halfedge_code pack__(const int i, const int j) {
+        return i | (halfedge_code(j) << CODE_SHIFT);
+    }
+    static int index__(const halfedge_code h) {
+        return h & ((halfedge_code(1) << CODE_SHIFT) - 1);
+    }
+    static int slot__(const halfedge_code h) { return h >> CODE_SHIFT; }
+    // Throws when a count of n elements exceeds limit, which is either
+    // MAX_ELEMENTS for what goes into halfedge codes, or INT_MAX
+    static void check_size__(const long long n, const long long limit,
+                             const char what[]) {
+        if (n > limit)
+            throw std::runtime_error(
+                std::string("Mesh has too many ") + what +
+                (limit < INT_MAX ? " for 32-bit halfedges; build with "
+                                   "MESH_WIDE_HALFEDGES"
+                                 : " for int indices"));
+    }
+
+    // The connectivity of a mesh. Copies of a mesh share one block through
+    // topology_, so nothing in it may change once it is published there:
+    // load(), build() and subdivide() always fill in a new block. The derived
+    // lists below are built on first use, at most once per block.
+    struct topology_t {
+        std::vector<face_t> face_;
+        std::vector<edge_t> edge_;
+        std::vector<halfedge_code> halfedge_; // one leaving each vertex
+
+        bool not_manifold_;
+        bool with_boundary_;
+
+        // Flat one-ring cache in compressed-sparse-row layout. The ring of
+        // vertex v lives in [ring_offset_[v], ring_offset_[v + 1]) of
+        // ring_vertex_ and ring_face_, in the same cyclic order VertexIterator
+        // visits it.
+        mutable std::once_flag rings_once_;
+        mutable std::vector<int> ring_offset_;
+        mutable std::vector<int> ring_vertex_;
+        mutable std::vector<int> ring_face_;
+
+        // Every face corner grouped by vertex, in the same layout and in face
+        // order. Unlike the one-ring cache this sees every incident face, also
+        // around boundary vertices.
+        mutable std::once_flag corners_once_;
+        mutable std::vector<int> corner_offset_;
+        mutable std::vector<int> corner_face_;
+
+        topology_t() : not_manifold_(false), with_boundary_(false) {}
+
+        int fn__(const int i) const {
+            return face_[i].vertex_[3] == -1 ? 3 : 4;
+        }
+        void init_rings__() const {
+            std::call_once(rings_once_, [this] { build_rings__(); });
+        }
+        void init_corners__() const {
+            std::call_once(corners_once_, [this] { build_corners__(); });
+        }
+
+      private:
+        void build_rings__() const {
+            // every halfedge starts exactly one ring entry, so the total size
+            // is the number of face corners
+            const int nv = halfedge_.size();
+            std::size_t corners = 0;
+            for (std::size_t i = 0; i < face_.size(); ++i)
+                corners += fn__(i);
+            ring_offset_.resize(nv + 1);
+            ring_vertex_.reserve(corners);
+            ring_face_.reserve(corners);
+            for (int i = 0; i < nv; ++i) {
+                ring_offset_[i] = ring_vertex_.size();
+                const halfedge_code h0 = halfedge_[i];
+                halfedge_code h = h0;
+                do {
+                    const int f = index__(h), v = slot__(h), n = fn__(f);
+                    ring_vertex_.push_back(face_[f].vertex_[(v + 1) % n]);
+                    ring_face_.push_back(f);
+                    const int vj = (v + n - 1) % n;
+                    const int e = index__(face_[f].edge_[vj]);
+                    const int ei = slot__(face_[f].edge_[vj]);
+                    h = edge_[e].halfedge_[ei ^ 1];
+                } while (h != h0 && h != -1); // -1: walked off a boundary
+            }
+            ring_offset_[nv] = ring_vertex_.size();
+        }
+        // Counting sort of all face corners by vertex
+        void build_corners__() const {
+            const int nv = halfedge_.size();
+            corner_offset_.assign(nv + 1, 0);
+            for (std::size_t i = 0; i < face_.size(); ++i) {
+                for (int j = 0, n = fn__(i); j < n; ++j)
+                    ++corner_offset_[face_[i].vertex_[j] + 1];
+            }
+            for (int v = 0; v < nv; ++v)
+                corner_offset_[v + 1] += corner_offset_[v];
+            corner_face_.resize(corner_offset_[nv]);
+            std::vector<int> next(corner_offset_.begin(),
+                                  corner_offset_.end() - 1);
+            for (std::size_t i = 0; i < face_.size(); ++i) {
+                for (int j = 0, n = fn__(i); j < n; ++j)
+                    corner_face_[next[face_[i].vertex_[j]]++] = i;
+            }
+        }
     };
 
-    std::vector<face_t> face_;
-    std::vector<vertex_t> vertex_;
-    std::vector<edge_t> edge_;
+    // Shared, immutable connectivity; never null (an empty mesh points to a
+    // shared empty block)
+    std::shared_ptr<topology_t> topology_;
+
+    // Per-mesh vertex attributes, indexed like topology_->halfedge_. With
+    // float storage they live in position32_ and normal32_ instead, and
+    // position_ and normal_ stay empty between calls.
+    std::vector<Cvec3> position_;
+    std::vector<Cvec3> normal_;
+    std::vector<Cvec3f> position32_;
+    std::vector<Cvec3f> normal32_;
+    bool float_storage_;
 
     std::vector<Cvec3> f_;
     std::vector<Cvec3> e_;
     std::vector<Cvec3> v_;
 
-    bool not_manifold_;
-    bool with_boundary_;
-
-    int fn__(const int i) const { return face_[i].vertex_[3] == -1 ? 3 : 4; }
-    void init_topology__() {
-        std::map<std::pair<int, int>, Cvec<int, 2>> E;
-        for (std::size_t i = 0; i < face_.size(); ++i) {
-            const int n = fn__(i);
-            for (int j = 0; j < n; ++j) {
-                const int vj = i | (j << 28);
-                const int k = (j + 1) % n;
-                std::pair<int, int> e(face_[i].vertex_[j], face_[i].vertex_[k]);
-                if (e.first < e.second) {
-                    const int t = e.first;
-                    e.first = e.second;
-                    e.second = t;
-                }
-                if (E.find(e) == E.end()) {
-                    E[e] = Cvec<int, 2>(vj, -1);
-                } else {
-                    Cvec<int, 2> &v = E[e];
-                    if (v[1] != -1)
-                        not_manifold_ = true;
+    // Walk rings through the one-ring cache of the topology when set
+    bool cache_rings_;
+
+    // Split load() and subdivide() over ThreadPool::shared() when set
+    bool parallel_;
+
+    // Scratch level buffers for subdivide(), kept to avoid reallocating them
+    // on every call. Never copied between meshes.
+    std::vector<face_t> next_face_;
+    std::vector<edge_t> next_edge_;
+    std::vector<halfedge_code> next_halfedge_;
+    std::vector<Cvec3> next_position_;
+    std::vector<int> findex_;
+
+    // Scratch for computeNormals(): per-face area-weighted normals. Fresh
+    // when they match position_, so that updateNormals() redoes only the
+    // faces around the dirty vertices.
+    std::vector<Cvec3> face_normal_;
+    bool face_normals_fresh_;
+
+    // Vertices moved by Vertex::setPosition() since the last normal update,
+    // each listed once thanks to its flag, when trackDirtyVertices() is on
+    bool track_dirty_;
+    std::vector<int> dirty_;
+    std::vector<char> dirty_flag_;
 
-                    v[1] = vj;
+    static const std::shared_ptr<topology_t> &empty_topology__() {
+        static const std::shared_ptr<topology_t> empty =
+            std::make_shared<topology_t>();
+        return empty;
+    }
+    int fn__(const int i) const { return topology_->fn__(i); }
+    // Attribute access in either storage. The kernels read positions through
+    // d__(), which costs nothing for doubles.
+    static const Cvec3 &d__(const Cvec3 &x) { return x; }
+    static Cvec3 d__(const Cvec3f &x) { return Cvec3(x[0], x[1], x[2]); }
+    static Cvec3f f__(const Cvec3 &x) { return Cvec3f(x[0], x[1], x[2]); }
+    int num_vertices__() const {
+        return float_storage_ ? position32_.size() : position_.size();
+    }
+    Cvec3 position__(const int v) const {
+        return float_storage_ ? d__(position32_[v]) : position_[v];
+    }
+    Cvec3 normal__(const int v) const {
+        return float_storage_ ? d__(normal32_[v]) : normal_[v];
+    }
+    void set_position__(const int v, const Cvec3 &p) {
+        if (float_storage_)
+            position32_[v] = f__(p);
+        else
+            position_[v] = p;
+    }
+    void set_normal__(const int v, const Cvec3 &n) {
+        if (float_storage_)
+            normal32_[v] = f__(n);
+        else
+            normal_[v] = n;
+    }
+    // Unset normals for every vertex, in the storage of the mesh
+    void reset_normals__() {
+        if (float_storage_)
+            normal32_.assign(position32_.size(), Cvec3f(-5e37f, 0, 0));
+        else
+            normal_.assign(position_.size(), Cvec3(-5e37, 0, 0));
+    }
+    // Moves the attribute from to the other storage
+    template <typename A, typename B>
+    void convert__(std::vector<A> &from, std::vector<B> &to) const {
+        to.resize(from.size());
+        for_range__(from.size(), [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i)
+                to[i] = B(from[i][0], from[i][1], from[i][2]);
+        });
+        std::vector<A>().swap(from);
+    }
+    // Moves the positions just computed in position_ to the float arrays
+    // when the mesh has float storage
+    void store_positions__() {
+        if (float_storage_)
+            convert__(position_, position32_);
+    }
+    // Forgets the dirty vertices and the face normals once the positions are
+    // replaced as a whole, so that the next updateNormals() redoes them all
+    void reset_dirty__() {
+        face_normals_fresh_ = false;
+        dirty_.clear();
+        std::vector<char>().swap(dirty_flag_);
+    }
+    void mark_dirty__(const int v) {
+        if (dirty_flag_.size() != (std::size_t)num_vertices__())
+            dirty_flag_.assign(num_vertices__(), 0);
+        if (!dirty_flag_[v]) {
+            dirty_flag_[v] = 1;
+            dirty_.push_back(v);
+        }
+    }
+    void clear_dirty__() {
+        for (std::size_t i = 0; i < dirty_.size(); ++i)
+            dirty_flag_[dirty_[i]] = 0;
+        dirty_.clear();
+    }
+    // Twice the area times the unit normal of face fv: the cross product of
+    // the two edges of a triangle, or of the two diagonals of a quad
+    template <typename P>
+    static Cvec3 face_normal__(const Cvec<int, 4> &fv, const P *p) {
+        const Cvec3 &p0 = d__(p[fv[0]]), &p1 = d__(p[fv[1]]),
+                    &p2 = d__(p[fv[2]]);
+        return fv[3] == -1 ? cross(p1 - p0, p2 - p0)
+                           : cross(p2 - p0, d__(p[fv[3]]) - p1);
+    }
+    Cvec3 face_normal__(const int i) const {
+        const Cvec<int, 4> &fv = topology_->face_[i].vertex_;
+        return float_storage_ ? face_normal__(fv, &position32_[0])
+                              : face_normal__(fv, &position_[0]);
+    }
+    // The normalized sum of the face normals around v, from face_normal_
+    Cvec3 vertex_normal__(const int v) const {
+        const topology_t &t = *topology_;
+        Cvec3 n;
+        for (int j = t.corner_offset_[v], e = t.corner_offset_[v + 1]; j < e;
+             ++j)
+            n += face_normal_[t.corner_face_[j]];
+        const double l2 = norm2(n);
+        return l2 > 0 ? n / std::sqrt(l2) : n;
+    }
+    // A halfedge tagged with the packed key of its undirected edge
+    struct edge_key_t {
+        unsigned long long key_;
+        halfedge_code halfedge_;
+    };
+    // Bounds of the c-th of n equal chunks of [0, size)
+    static int chunk_begin__(const int size, const int c, const int n) {
+        return (long long)size * c / n;
+    }
+    // Stable LSD radix sort of k on the low `bits` bits of key_, with tmp as
+    // scratch. Each chunk keeps its own digit histogram so that every pass
+    // can count and scatter in parallel.
+    void sort_edge_keys__(std::vector<edge_key_t> &k,
+                          std::vector<edge_key_t> &tmp, const int bits,
+                          const int chunks) const {
+        const int RADIX = 11, BUCKETS = 1 << RADIX;
+        const int n = k.size();
+        std::vector<int> count(chunks * BUCKETS);
+        tmp.resize(n);
+        for (int shift = 0; shift < bits; shift += RADIX) {
+            std::fill(count.begin(), count.end(), 0);
+            for_range__(chunks, [&](const int lo, const int hi) {
+                for (int c = lo; c < hi; ++c) {
+                    int *cc = &count[c * BUCKETS];
+                    for (int i = chunk_begin__(n, c, chunks),
+                             e = chunk_begin__(n, c + 1, chunks);
+                         i < e; ++i)
+                        ++cc[(k[i].key_ >> shift) & (BUCKETS - 1)];
+                }
+            }, 1);
+            // exclusive prefix sum in (digit, chunk) order keeps it stable
+            int sum = 0;
+            for (int d = 0; d < BUCKETS; ++d) {
+                for (int c = 0; c < chunks; ++c) {
+                    const int t = count[c * BUCKETS + d];
+                    count[c * BUCKETS + d] = sum;
+                    sum += t;
                 }
             }
+            for_range__(chunks, [&](const int lo, const int hi) {
+                for (int c = lo; c < hi; ++c) {
+                    int *cc = &count[c * BUCKETS];
+                    for (int i = chunk_begin__(n, c, chunks),
+                             e = chunk_begin__(n, c + 1, chunks);
+                         i < e; ++i)
+                        tmp[cc[(k[i].key_ >> shift) & (BUCKETS - 1)]++] = k[i];
+                }
+            }, 1);
+            k.swap(tmp);
         }
-        edge_.resize(E.size());
-        int e = 0;
-        for (std::map<std::pair<int, int>, Cvec<int, 2>>::iterator i =
-                 E.begin();
-             i != E.end(); ++i, ++e) {
-            edge_[e].halfedge_ = i->second;
-            for (int j = 0; j < 2; ++j) {
-                if (i->second[j] != -1)
-                    face_[i->second[j] & ((1 << 28) - 1)]
-                        .edge_[i->second[j] >> 28] = e | (j << 28);
-                else
-                    with_boundary_ = true;
+    }
+    void init_topology__(topology_t &t) const {
+        // Tag every halfedge with key max * nv + min of its two vertices and
+        // sort on it: halfedges of the same edge become adjacent runs, and
+        // edges come out in the same (max, min) order a map would give. The
+        // sort is stable, so each run is in face order.
+        const int nv = t.halfedge_.size();
+        const int chunks = parallel_ ? ThreadPool::shared().getNumThreads() : 1;
+        std::vector<edge_key_t> K, tmp;
+        check_size__(t.face_.size(), MAX_ELEMENTS, "faces");
+        std::vector<int> hindex(t.face_.size() + 1); // first halfedge of faces
+        long long corners = 0;
+        for (std::size_t i = 0; i < t.face_.size(); ++i) {
+            hindex[i] = corners;
+            corners += t.fn__(i);
+        }
+        check_size__(corners, INT_MAX, "face corners");
+        const int nh = corners;
+        hindex[t.face_.size()] = nh;
+        K.resize(nh);
+        for_range__(t.face_.size(), [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i) {
+                const int n = t.fn__(i);
+                for (int j = 0; j < n; ++j) {
+                    const int k = (j + 1) % n;
+                    const unsigned long long a = t.face_[i].vertex_[j],
+                                             b = t.face_[i].vertex_[k];
+                    edge_key_t &ek = K[hindex[i] + j];
+                    ek.key_ = a < b ? b * nv + a : a * nv + b;
+                    ek.halfedge_ = pack__(i, j);
+                }
             }
+        });
+        int bits = 0;
+        while (bits < 64 && ((unsigned long long)nv * nv - 1) >> bits)
+            ++bits;
+        sort_edge_keys__(K, tmp, bits, chunks);
+
+        // Number the runs: chunk c owns the runs that start inside it
+        std::vector<int> first(chunks + 1, 0);
+        for_range__(chunks, [&](const int lo, const int hi) {
+            for (int c = lo; c < hi; ++c) {
+                for (int i = chunk_begin__(nh, c, chunks),
+                         e = chunk_begin__(nh, c + 1, chunks);
+                     i < e; ++i)
+                    first[c + 1] += (i == 0 || K[i].key_ != K[i - 1].key_);
+            }
+        }, 1);
+        for (int c = 0; c < chunks; ++c)
+            first[c + 1] += first[c];
+        check_size__(first[chunks], MAX_ELEMENTS, "edges");
+        t.edge_.resize(first[chunks]);
+
+        // Same rules as before: the first halfedge of a run goes in slot 0,
+        // the last one in slot 1, and a run longer than two is non-manifold
+        std::vector<char> not_manifold(chunks, 0), with_boundary(chunks, 0);
+        for_range__(chunks, [&](const int lo, const int hi) {
+            for (int c = lo; c < hi; ++c) {
+                int e = first[c];
+                for (int i = chunk_begin__(nh, c, chunks),
+                         end = chunk_begin__(nh, c + 1, chunks);
+                     i < end; ++i) {
+                    if (i != 0 && K[i].key_ == K[i - 1].key_)
+                        continue; // belongs to a run owned by an earlier chunk
+                    int r = i + 1;
+                    while (r < nh && K[r].key_ == K[i].key_)
+                        ++r;
+                    Cvec<halfedge_code, 2> h(K[i].halfedge_, -1);
+                    if (r - i > 1)
+                        h[1] = K[r - 1].halfedge_;
+                    if (r - i > 2)
+                        not_manifold[c] = true;
+                    t.edge_[e].halfedge_ = h;
+                    for (int j = 0; j < 2; ++j) {
+                        if (h[j] != -1)
+                            t.face_[index__(h[j])].edge_[slot__(h[j])] =
+                                pack__(e, j);
+                        else
+                            with_boundary[c] = true;
+                    }
+                    ++e;
+                }
+            }
+        }, 1);
+        t.not_manifold_ = t.with_boundary_ = false;
+        for (int c = 0; c < chunks; ++c) {
+            t.not_manifold_ = t.not_manifold_ || not_manifold[c];
+            t.with_boundary_ = t.with_boundary_ || with_boundary[c];
         }
     }
     void resize__() {
-        v_.resize(vertex_.size());
-        f_.resize(face_.size());
-        e_.resize(edge_.size());
+        v_.resize(num_vertices__());
+        f_.resize(topology_->face_.size());
+        e_.resize(topology_->edge_.size());
+    }
+    // Work shared by all the readers once position_ and t.face_ are filled
+    // in: t becomes the topology of the mesh. Loaded meshes are centered and
+    // scaled to unit RMS radius.
+    void finish_load__(const std::shared_ptr<topology_t> &t,
+                       const char filename[], const bool normalize = true) {
+        const int nv = position_.size();
+        t->halfedge_.resize(nv);
+        for (std::size_t i = 0; i < t->face_.size(); ++i) {
+            for (int j = 0, n = t->fn__(i); j < n; ++j) {
+                const int v = t->face_[i].vertex_[j];
+                if (v < 0 || v >= nv)
+                    throw std::runtime_error(
+                        std::string("Vertex index out of range in ") +
+                        filename);
+                t->halfedge_[v] = pack__(i, j);
+            }
+        }
+        init_topology__(*t);
+        topology_ = t;
+        resize__();
+        if (normalize)
+            normalize__();
+        store_positions__();
+        reset_normals__();
+        reset_dirty__();
+        if (cache_rings_)
+            topology_->init_rings__();
+    }
+    void normalize__() {
+        Cvec3 center(0);
+        for (std::size_t i = 0; i < position_.size(); ++i) {
+            center += position_[i];
+        }
+        center /= position_.size();
+        for (std::size_t i = 0; i < position_.size(); ++i) {
+            position_[i] -= center;
+        }
+        double rms = 0;
+        for (std::size_t i = 0; i < position_.size(); ++i) {
+            rms += dot(position_[i], position_[i]);
+        }
+        rms = std::sqrt(rms / position_.size());
+        for (std::size_t i = 0; i < position_.size(); ++i) {
+            position_[i] *= 1 / rms;
+        }
     }
-    void load__(const char filename[]) {
-        using namespace std;
 
-        ifstream f(filename);
-        if (!f) {
-            throw std::runtime_error(std::string("Cannot open file ") +
-                                     filename);
+    // Helpers for the text readers below. They all work on the whole file
+    // in memory, split into line-aligned chunks that are scanned on the
+    // thread pool: a first pass counts what each chunk holds, a prefix sum
+    // turns the counts into output offsets, and a last pass parses every
+    // chunk straight into position_ and the faces. Parse errors are flagged per
+    // chunk and thrown once the pool is done.
+    int num_text_chunks__(const std::size_t size) const {
+        if (!parallel_)
+            return 1;
+        const std::size_t minChunk = 1 << 16;
+        return std::max<std::size_t>(
+            1, std::min<std::size_t>(4 * ThreadPool::shared().getNumThreads(),
+                                     size / minChunk));
+    }
+    // Offsets of chunks of [b, e) that each start at the beginning of a line
+    static std::vector<const char *> split_lines__(const char *b,
+                                                   const char *e,
+                                                   const int chunks) {
+        std::vector<const char *> split(chunks + 1, e);
+        split[0] = b;
+        for (int c = 1; c < chunks; ++c) {
+            const char *p =
+                std::max(split[c - 1], b + (long long)(e - b) * c / chunks);
+            while (p < e && p > b && p[-1] != '\n')
+                ++p;
+            split[c] = p;
         }
-        // Sets bits to report IO error using exception
-        f.exceptions(ios::eofbit | ios::failbit | ios::badbit);
+        return split;
+    }
+    static bool is_blank__(const char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+    static const char *skip_blank__(const char *p, const char *e) {
+        while (p < e && is_blank__(*p))
+            ++p;
+        return p;
+    }
+    static const char *skip_space__(const char *p, const char *e) {
+        while (p < e && (is_blank__(*p) || *p == '\n'))
+            ++p;
+        return p;
+    }
+    static const char *skip_token__(const char *p, const char *e) {
+        while (p < e && !is_blank__(*p) && *p != '\n')
+            ++p;
+        return p;
+    }
+    static const char *end_of_line__(const char *p, const char *e) {
+        const char *q = static_cast<const char *>(std::memchr(p, '\n', e - p));
+        return q ? q : e;
+    }
+    // Parses one number at p (after blanks); returns NULL on failure
+    static const char *parse_number__(const char *p, const char *e, int &x) {
+        p = skip_blank__(p, e);
+        const std::from_chars_result r = std::from_chars(p, e, x);
+        return r.ec == std::errc() ? r.ptr : NULL;
+    }
+    static const char *parse_number__(const char *p, const char *e,
+                                      double &x) {
+        p = skip_blank__(p, e);
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        const std::from_chars_result r = std::from_chars(p, e, x);
+        return r.ec == std::errc() ? r.ptr : NULL;
+#else
+        // Floating-point from_chars is missing from older libc++ (macOS
+        // before 14), so copy the token, which need not be terminated in a
+        // mapped file, and use strtod
+        const char *q = skip_token__(p, e);
+        char buffer[64];
+        std::string long_token;
+        char *s = buffer;
+        if (q - p < (std::ptrdiff_t)sizeof(buffer)) {
+            std::memcpy(buffer, p, q - p);
+            buffer[q - p] = 0;
+        } else {
+            long_token.assign(p, q);
+            s = &long_token[0];
+        }
+        char *end;
+        x = std::strtod(s, &end);
+        return end != s ? p + (end - s) : NULL;
+#endif
+    }
+    // Number of blank separated tokens in [p, e)
+    static int count_tokens__(const char *p, const char *e) {
+        int n = 0;
+        for (p = skip_blank__(p, e); p < e; p = skip_blank__(p, e)) {
+            p = skip_token__(p, e);
+            ++n;
+        }
+        return n;
+    }
+    // Faces a polygon with n corners turns into (fans above quads)
+    static int polygon_faces__(const int n) {
+        return n == 3 || n == 4 ? 1 : std::max(n - 2, 0);
+    }
+    // Writes polygon v[0..n) as face[f...]; returns the next free face
+    static int emit_polygon__(std::vector<face_t> &face, const int *v,
+                              const int n, int f) {
+        if (n == 3 || n == 4) {
+            for (int j = 0; j < 4; ++j)
+                face[f].vertex_[j] = j < n ? v[j] : -1;
+            return f + 1;
+        }
+        for (int j = 1; j + 1 < n; ++j, ++f) {
+            face[f].vertex_ = Cvec<int, 4>(v[0], v[j], v[j + 1], -1);
+        }
+        return f;
+    }
+    static void throw_malformed__(const std::vector<char> &bad,
+                                  const char filename[]) {
+        if (std::find(bad.begin(), bad.end(), 1) != bad.end())
+            throw std::runtime_error(std::string("Malformed mesh file ") +
+                                     filename);
+    }
 
+    // .mesh: "nv nt nq", then nv positions, nt tris and nq quads. Only the
+    // order of the numbers matters, so chunks count their tokens first.
+    void load_mesh__(topology_t &top, const char filename[], const char *b,
+                     const char *e) {
         int nv, nt, nq; // number of: vertices, tris, quads
-        f >> nv >> nt >> nq;
-        vertex_.resize(nv);
-        face_.resize(nt + nq);
-        for (int i = 0; i < nv; ++i) {
-            f >> vertex_[i].position_[0] >> vertex_[i].position_[1] >>
-                vertex_[i].position_[2];
+        b = parse_number__(skip_space__(b, e), e, nv);
+        b = b ? parse_number__(skip_space__(b, e), e, nt) : NULL;
+        b = b ? parse_number__(skip_space__(b, e), e, nq) : NULL;
+        if (!b || nv < 0 || nt < 0 || nq < 0)
+            throw std::runtime_error(std::string("Malformed mesh file ") +
+                                     filename);
+        position_.resize(nv);
+        top.face_.resize(nt + nq);
+
+        const int chunks = num_text_chunks__(e - b);
+        const std::vector<const char *> split = split_lines__(b, e, chunks);
+        std::vector<long long> first(chunks + 1, 0);
+        for_range__(chunks, [&](const int lo, const int hi) {
+            for (int c = lo; c < hi; ++c) {
+                long long n = 0;
+                const char *q = split[c + 1];
+                for (const char *p = skip_space__(split[c], q); p < q;
+                     p = skip_space__(skip_token__(p, q), q))
+                    ++n;
+                first[c + 1] = n;
+            }
+        }, 1);
+        for (int c = 0; c < chunks; ++c)
+            first[c + 1] += first[c];
+        const long long pv = 3LL * nv, pt = pv + 3LL * nt, pq = pt + 4LL * nq;
+        if (first[chunks] < pq)
+            throw std::runtime_error(std::string("Truncated mesh file ") +
+                                     filename);
+
+        std::vector<char> bad(chunks, 0);
+        for_range__(chunks, [&](const int lo, const int hi) {
+            for (int c = lo; c < hi; ++c) {
+                const char *p = skip_space__(split[c], split[c + 1]);
+                for (long long t = first[c]; t < first[c + 1] && t < pq; ++t) {
+                    if (t < pv) {
+                        p = parse_number__(p, split[c + 1],
+                                           position_[t / 3][t % 3]);
+                    } else if (t < pt) {
+                        face_t &f = top.face_[(t - pv) / 3];
+                        p = parse_number__(p, split[c + 1],
+                                           f.vertex_[(t - pv) % 3]);
+                        f.vertex_[3] = -1;
+                    } else {
+                        face_t &f = top.face_[nt + (t - pt) / 4];
+                        p = parse_number__(p, split[c + 1],
+                                           f.vertex_[(t - pt) % 4]);
+                    }
+                    if (!p) {
+                        bad[c] = true;
+                        break;
+                    }
+                    p = skip_space__(p, split[c + 1]);
+                }
+            }
+        }, 1);
+        throw_malformed__(bad, filename);
+    }
+
+    // Wavefront OBJ: "v x y z" and "f a b c ..." lines; indices may carry
+    // /texture/normal parts and be negative (relative). Other lines are
+    // ignored. Polygons with more than four corners are fanned into tris.
+    void load_obj__(topology_t &top, const char filename[], const char *b,
+                    const char *e) {
+        const int chunks = num_text_chunks__(e - b);
+        const std::vector<const char *> split = split_lines__(b, e, chunks);
+        std::vector<int> vfirst(chunks + 1, 0), ffirst(chunks + 1, 0);
+        for_range__(chunks, [&](const int lo, const int hi) {
+            for (int c = lo; c < hi; ++c) {
+                for (const char *p = split[c], *q; p < split[c + 1];
+                     p = q + 1) {
+                    q = end_of_line__(p, split[c + 1]);
+                    p = skip_blank__(p, q);
+                    if (q - p > 1 && p[0] == 'v' && is_blank__(p[1]))
+                        ++vfirst[c + 1];
+                    else if (q - p > 1 && p[0] == 'f' && is_blank__(p[1]))
+                        ffirst[c + 1] +=
+                            polygon_faces__(count_tokens__(p + 1, q));
+                }
+            }
+        }, 1);
+        for (int c = 0; c < chunks; ++c) {
+            vfirst[c + 1] += vfirst[c];
+            ffirst[c + 1] += ffirst[c];
         }
-        for (int i = 0; i < nt; ++i) {
-            f >> face_[i].vertex_[0] >> face_[i].vertex_[1] >>
-                face_[i].vertex_[2];
-            face_[i].vertex_[3] = -1;
+        position_.resize(vfirst[chunks]);
+        top.face_.resize(ffirst[chunks]);
+
+        std::vector<char> bad(chunks, 0);
+        for_range__(chunks, [&](const int lo, const int hi) {
+            std::vector<int> poly;
+            for (int c = lo; c < hi; ++c) {
+                int v = vfirst[c], f = ffirst[c];
+                for (const char *p = split[c], *q; p < split[c + 1] && !bad[c];
+                     p = q + 1) {
+                    q = end_of_line__(p, split[c + 1]);
+                    p = skip_blank__(p, q);
+                    if (q - p > 1 && p[0] == 'v' && is_blank__(p[1])) {
+                        Cvec3 &x = position_[v++];
+                        ++p;
+                        for (int j = 0; j < 3 && p; ++j)
+                            p = parse_number__(p, q, x[j]);
+                        bad[c] = !p;
+                    } else if (q - p > 1 && p[0] == 'f' && is_blank__(p[1])) {
+                        poly.clear();
+                        for (p = skip_blank__(p + 1, q); p < q && !bad[c];
+                             p = skip_blank__(skip_token__(p, q), q)) {
+                            int k;
+                            bad[c] = !parse_number__(p, q, k) || k == 0;
+                            // k is 1-based, or relative to the last vertex
+                            poly.push_back(k > 0 ? k - 1 : v + k);
+                        }
+                        if (poly.size() < 3)
+                            bad[c] = true;
+                        else if (!bad[c])
+                            f = emit_polygon__(top.face_, &poly[0],
+                                               poly.size(), f);
+                    }
+                }
+            }
+        }, 1);
+        throw_malformed__(bad, filename);
+    }
+
+    // ASCII PLY: the header declares the elements, in file order, and their
+    // properties. Positions come from the x, y, z properties of "vertex" and
+    // faces from the vertex_indices list of "face"; other elements and
+    // properties are skipped.
+    void load_ply__(topology_t &top, const char filename[], const char *b,
+                    const char *e) {
+        struct element_t {
+            std::string name_;
+            long long count_;
+            std::vector<std::string> props_;
+            std::vector<char> list_;
+        };
+        std::vector<element_t> elements;
+        bool ascii = false, header = false;
+        for (const char *q; b < e && !header; b = q + 1) {
+            q = end_of_line__(b, e);
+            std::istringstream line(std::string(b, q));
+            std::string word;
+            line >> word;
+            if (word == "format") {
+                line >> word;
+                ascii = word == "ascii";
+            } else if (word == "element") {
+                elements.push_back(element_t());
+                line >> elements.back().name_ >> elements.back().count_;
+            } else if (word == "property" && !elements.empty()) {
+                std::string type, name;
+                line >> type;
+                if (type == "list")
+                    line >> word >> word; // count and index types
+                line >> name;
+                elements.back().props_.push_back(name);
+                elements.back().list_.push_back(type == "list");
+            } else if (word == "end_header") {
+                header = true;
+            }
         }
-        for (int i = 0; i < nq; ++i) {
-            f >> face_[nt + i].vertex_[0] >> face_[nt + i].vertex_[1] >>
-                face_[nt + i].vertex_[2] >> face_[nt + i].vertex_[3];
+        if (!header)
+            throw std::runtime_error(std::string("Malformed PLY header in ") +
+                                     filename);
+        if (!ascii)
+            throw std::runtime_error(
+                std::string("Only ASCII PLY files are supported: ") +
+                filename);
+
+        // body lines of each element, and where the wanted properties are
+        long long line0 = 0, vline = -1, fline = -1, nv = 0, nf = 0;
+        int xyz[3] = {-1, -1, -1}, nvprops = 0, flist = -1;
+        for (std::size_t i = 0; i < elements.size(); ++i) {
+            const element_t &el = elements[i];
+            if (el.name_ == "vertex") {
+                vline = line0;
+                nv = el.count_;
+                nvprops = el.props_.size();
+                for (int j = 0; j < nvprops; ++j) {
+                    for (int k = 0; k < 3; ++k) {
+                        if (el.props_[j] == std::string(1, char('x' + k)))
+                            xyz[k] = j;
+                    }
+                }
+            } else if (el.name_ == "face") {
+                fline = line0;
+                nf = el.count_;
+                // the first list holds the indices; scalars before it are
+                // skipped
+                for (std::size_t j = 0; j < el.props_.size() && flist < 0;
+                     ++j) {
+                    if (el.list_[j])
+                        flist = j;
+                }
+            }
+            line0 += el.count_;
+        }
+        if (vline < 0 || xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0 ||
+            (fline >= 0 && flist < 0))
+            throw std::runtime_error(
+                std::string("PLY file lacks vertex positions or faces: ") +
+                filename);
+        position_.resize(nv);
+
+        // count lines per chunk, then faces per chunk, then parse
+        const int chunks = num_text_chunks__(e - b);
+        const std::vector<const char *> split = split_lines__(b, e, chunks);
+        std::vector<long long> lfirst(chunks + 1, 0);
+        std::vector<int> ffirst(chunks + 1, 0);
+        std::vector<char> bad(chunks, 0);
+        for_range__(chunks, [&](const int lo, const int hi) {
+            for (int c = lo; c < hi; ++c) {
+                for (const char *p = split[c]; p < split[c + 1];
+                     p = end_of_line__(p, split[c + 1]) + 1)
+                    lfirst[c + 1] += skip_blank__(p, split[c + 1]) <
+                                     end_of_line__(p, split[c + 1]);
+            }
+        }, 1);
+        for (int c = 0; c < chunks; ++c)
+            lfirst[c + 1] += lfirst[c];
+        if (lfirst[chunks] < line0)
+            throw std::runtime_error(std::string("Truncated mesh file ") +
+                                     filename);
+        // the list length of a face line, or -1
+        const auto face_size = [&](const char *p, const char *q) {
+            for (int j = 0; j < flist && p; ++j)
+                p = skip_token__(skip_blank__(p, q), q);
+            int n = -1;
+            return p && parse_number__(p, q, n) ? n : -1;
+        };
+        for_range__(chunks, [&](const int lo, const int hi) {
+            for (int c = lo; c < hi; ++c) {
+                long long l = lfirst[c];
+                for (const char *p = split[c], *q; p < split[c + 1];
+                     p = q + 1) {
+                    q = end_of_line__(p, split[c + 1]);
+                    if (skip_blank__(p, q) == q)
+                        continue;
+                    if (l >= fline && l < fline + nf)
+                        ffirst[c + 1] += polygon_faces__(face_size(p, q));
+                    ++l;
+                }
+            }
+        }, 1);
+        for (int c = 0; c < chunks; ++c)
+            ffirst[c + 1] += ffirst[c];
+        top.face_.resize(ffirst[chunks]);
+
+        for_range__(chunks, [&](const int lo, const int hi) {
+            std::vector<int> poly;
+            for (int c = lo; c < hi; ++c) {
+                long long l = lfirst[c];
+                int f = ffirst[c];
+                for (const char *p = split[c], *q; p < split[c + 1] && !bad[c];
+                     p = q + 1) {
+                    q = end_of_line__(p, split[c + 1]);
+                    if (skip_blank__(p, q) == q)
+                        continue;
+                    if (l >= vline && l < vline + nv) {
+                        Cvec3 &x = position_[l - vline];
+                        for (int j = 0; j < nvprops && p; ++j) {
+                            double t;
+                            p = parse_number__(p, q, t);
+                            for (int k = 0; k < 3; ++k) {
+                                if (xyz[k] == j)
+                                    x[k] = t;
+                            }
+                        }
+                        bad[c] = !p;
+                    } else if (l >= fline && l < fline + nf) {
+                        const int n = face_size(p, q);
+                        for (int j = 0; j <= flist; ++j)
+                            p = skip_token__(skip_blank__(p, q), q);
+                        poly.resize(std::max(n, 0));
+                        for (int j = 0; j < n && p; ++j)
+                            p = parse_number__(p, q, poly[j]);
+                        if (!p || n < 3)
+                            bad[c] = true;
+                        else
+                            f = emit_polygon__(top.face_, &poly[0], n, f);
+                    }
+                    ++l;
+                }
+            }
+        }, 1);
+        throw_malformed__(bad, filename);
+    }
+
+    static bool has_extension__(const char filename[], const char ext[]) {
+        const std::size_t n = std::strlen(filename), m = std::strlen(ext);
+        if (n < m)
+            return false;
+        for (std::size_t i = 0; i < m; ++i) {
+            if (std::tolower((unsigned char)filename[n - m + i]) != ext[i])
+                return false;
         }
-        for (int i = 0; i < nt; ++i) {
-            for (int j = 0; j < 3; ++j) {
-                vertex_[face_[i].vertex_[j]].halfedge_ = i | (j << 28);
+        return true;
+    }
+    void load__(const char filename[]) {
+        const MappedFile file(filename);
+        const char *b = file.data(), *e = b + file.size();
+        const std::shared_ptr<topology_t> t = std::make_shared<topology_t>();
+        if (has_extension__(filename, ".obj"))
+            load_obj__(*t, filename, b, e);
+        else if (has_extension__(filename, ".ply"))
+            load_ply__(*t, filename, b, e);
+        else
+            load_mesh__(*t, filename, b, e);
+        finish_load__(t, filename);
+    }
+
+    // Binary mesh format, version 1. All fields are in native byte order
+    // (checked through byte_order_), and the file holds one or more levels,
+    // e.g. a control mesh followed by its subdivisions:
+    //
+    //   binary_header_t
+    //   for each level:
+    //     binary_level_t
+    //     double position[nv][3]
+    //     if BINARY_TOPOLOGY:  face_t face[nf], halfedge_code halfedge[nv],
+    //                          edge_t edge[ne]
+    //     else:                int vertex[nf][4] (vertex[3] == -1 for tris)
+    //
+    // Positions are stored as they are in the mesh, i.e. already normalized.
+    // BINARY_WIDE_HALFEDGES marks topology written with 64-bit halfedge
+    // codes. A build of the other width reads only the vertices of its faces
+    // and matches the edges again.
+    struct binary_header_t {
+        char magic_[8];
+        unsigned version_;
+        unsigned byte_order_;
+        unsigned num_levels_;
+        unsigned reserved_[3];
+    };
+    struct binary_level_t {
+        unsigned flags_;
+        unsigned nv_, nf_, ne_;
+        unsigned long long bytes_; // payload size following this struct
+    };
+    enum {
+        BINARY_VERSION = 1,
+        BINARY_BYTE_ORDER = 0x01020304,
+        BINARY_TOPOLOGY = 1,
+        BINARY_NOT_MANIFOLD = 2,
+        BINARY_WITH_BOUNDARY = 4,
+        BINARY_WIDE_HALFEDGES = 8
+    };
+    static const char *binary_magic__() { return "CS175MSH"; }
+    static bool is_binary__(const char filename[]) {
+        std::ifstream f(filename, std::ios::binary);
+        char magic[8];
+        return f.read(magic, 8) &&
+               std::equal(magic, magic + 8, binary_magic__());
+    }
+    static binary_header_t read_binary_header__(const MappedFile &file,
+                                                const char filename[]) {
+        binary_header_t h;
+        if (file.size() < sizeof(h))
+            throw std::runtime_error(std::string("Truncated mesh file ") +
+                                     filename);
+        std::memcpy(&h, file.data(), sizeof(h));
+        if (!std::equal(h.magic_, h.magic_ + 8, binary_magic__()))
+            throw std::runtime_error(std::string("Not a binary mesh file ") +
+                                     filename);
+        if (h.byte_order_ != BINARY_BYTE_ORDER)
+            throw std::runtime_error(
+                std::string("Binary mesh file has foreign byte order ") +
+                filename);
+        if (h.version_ != BINARY_VERSION)
+            throw std::runtime_error(
+                std::string("Unsupported binary mesh file version ") +
+                filename);
+        return h;
+    }
+    // Throws unless the codes read into t by the fast path of load_binary__()
+    // are those init_topology__() would give the faces: every code in range,
+    // edges listing halfedges that point back at them, and on a manifold
+    // mesh faces whose edges point back at them, so that walking a one-ring
+    // cannot leave the arrays or go round forever
+    static void check_topology__(const topology_t &t, const char filename[]) {
+        const int nf = t.face_.size(), ne = t.edge_.size();
+        const auto corner = [&](const halfedge_code h) {
+            return h >= 0 && index__(h) < nf && slot__(h) < t.fn__(index__(h));
+        };
+        bool ok = true;
+        for (std::size_t v = 0; v < t.halfedge_.size() && ok && nf; ++v)
+            ok = corner(t.halfedge_[v]);
+        for (int e = 0; e < ne && ok; ++e) {
+            for (int k = 0; k < 2 && ok; ++k) {
+                const halfedge_code h = t.edge_[e].halfedge_[k];
+                ok = h == -1 ? t.with_boundary_
+                             : corner(h) && t.face_[index__(h)]
+                                                    .edge_[slot__(h)] ==
+                                                pack__(e, k);
             }
         }
-        for (int i = 0; i < nq; ++i) {
-            for (int j = 0; j < 4; ++j) {
-                vertex_[face_[nt + i].vertex_[j]].halfedge_ = i | (j << 28);
+        for (int i = 0; i < nf && ok; ++i) {
+            for (int j = 0, n = t.fn__(i); j < n && ok; ++j) {
+                const halfedge_code c = t.face_[i].edge_[j];
+                ok = c >= 0 && index__(c) < ne && slot__(c) < 2 &&
+                     (t.not_manifold_ ||
+                      t.edge_[index__(c)].halfedge_[slot__(c)] ==
+                          pack__(i, j));
             }
         }
-        init_topology__();
-        resize__();
-        Cvec3 center(0);
-        for (std::size_t i = 0; i < vertex_.size(); ++i) {
-            center += vertex_[i].position_;
+        if (!ok)
+            throw std::runtime_error(
+                std::string("Corrupt topology in binary mesh file ") +
+                filename);
+    }
+    void load_binary__(const char filename[], int level) {
+        static_assert(sizeof(face_t) ==
+                          4 * sizeof(int) + 4 * sizeof(halfedge_code),
+                      "face_t layout");
+        static_assert(sizeof(edge_t) == 2 * sizeof(halfedge_code),
+                      "edge_t layout");
+
+        const MappedFile file(filename);
+        const binary_header_t h = read_binary_header__(file, filename);
+        if (level < 0)
+            level += h.num_levels_;
+        if (level < 0 || level >= (int)h.num_levels_)
+            throw std::runtime_error(
+                std::string("No such level in binary mesh file ") + filename);
+
+        // skip to the requested level
+        std::size_t at = sizeof(binary_header_t);
+        binary_level_t l;
+        for (int i = 0;; ++i) {
+            if (file.size() < at + sizeof(l))
+                throw std::runtime_error(
+                    std::string("Truncated mesh file ") + filename);
+            std::memcpy(&l, file.data() + at, sizeof(l));
+            at += sizeof(l);
+            if (i == level)
+                break;
+            at += l.bytes_;
         }
-        center /= vertex_.size();
-        for (std::size_t i = 0; i < vertex_.size(); ++i) {
-            vertex_[i].position_ -= center;
+        const bool topology = l.flags_ & BINARY_TOPOLOGY;
+        // size of the halfedge codes in the file, and of its faces
+        const std::size_t code =
+            l.flags_ & BINARY_WIDE_HALFEDGES ? sizeof(long long) : sizeof(int);
+        const std::size_t face = sizeof(int) * 4 + code * 4;
+        const std::size_t bytes =
+            sizeof(double) * 3 * l.nv_ +
+            (topology ? face * l.nf_ + code * l.nv_ + code * 2 * l.ne_
+                      : sizeof(int) * 4 * l.nf_);
+        check_size__(l.nv_, INT_MAX, "vertices");
+        check_size__(l.nf_, MAX_ELEMENTS, "faces");
+        check_size__(l.ne_, MAX_ELEMENTS, "edges");
+        if (l.bytes_ != bytes || file.size() < at + bytes)
+            throw std::runtime_error(std::string("Truncated mesh file ") +
+                                     filename);
+
+        const char *p = file.data() + at;
+        const std::shared_ptr<topology_t> t = std::make_shared<topology_t>();
+        const int nv = l.nv_;
+        t->face_.resize(l.nf_);
+        t->halfedge_.resize(nv);
+        const char *positions = p;
+        p += sizeof(double) * 3 * l.nv_;
+        // codes as wide as ours are taken as they are, and checked below
+        const bool codes = topology && code == sizeof(halfedge_code);
+        if (codes) {
+            if (l.nf_)
+                std::memcpy(t->face_.data(), p, sizeof(face_t) * l.nf_);
+            p += sizeof(face_t) * l.nf_;
+            if (l.nv_)
+                std::memcpy(t->halfedge_.data(), p, code * l.nv_);
+            p += code * l.nv_;
+            t->edge_.resize(l.ne_);
+            if (l.ne_)
+                std::memcpy(t->edge_.data(), p, sizeof(edge_t) * l.ne_);
+            t->not_manifold_ = l.flags_ & BINARY_NOT_MANIFOLD;
+            t->with_boundary_ = l.flags_ & BINARY_WITH_BOUNDARY;
+        } else {
+            const std::size_t stride = topology ? face : sizeof(int) * 4;
+            for (std::size_t i = 0; i < t->face_.size(); ++i)
+                std::memcpy(&t->face_[i].vertex_[0], p + stride * i,
+                            sizeof(int) * 4);
         }
-        double rms = 0;
-        for (std::size_t i = 0; i < vertex_.size(); ++i) {
-            rms += dot(vertex_[i].position_, vertex_[i].position_);
+        // same checks as finish_load__(), before anything indexes by them
+        for (std::size_t i = 0; i < t->face_.size(); ++i) {
+            for (int j = 0, n = t->fn__(i); j < n; ++j) {
+                const int v = t->face_[i].vertex_[j];
+                if (v < 0 || v >= nv)
+                    throw std::runtime_error(
+                        std::string("Vertex index out of range in ") +
+                        filename);
+                if (!codes)
+                    t->halfedge_[v] = pack__(i, j);
+            }
         }
-        rms = std::sqrt(rms / vertex_.size());
-        for (std::size_t i = 0; i < vertex_.size(); ++i) {
-            vertex_[i].position_ *= 1 / rms;
+        if (codes)
+            check_topology__(*t, filename);
+        else
+            init_topology__(*t);
+
+        // the mesh is left untouched when the file is rejected
+        position_.resize(l.nv_);
+        for_range__(l.nv_, [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i)
+                std::memcpy(&position_[i][0],
+                            positions + sizeof(double) * 3 * i,
+                            sizeof(double) * 3);
+        });
+        store_positions__();
+        reset_normals__();
+        reset_dirty__();
+        topology_ = t;
+        resize__();
+        if (cache_rings_)
+            topology_->init_rings__();
+    }
+    void save_binary__(const char filename[], const bool topology,
+                       const bool append) const {
+        const topology_t &t = *topology_;
+        binary_header_t h;
+        std::fstream f;
+        if (append) {
+            const MappedFile file(filename);
+            h = read_binary_header__(file, filename);
+            f.open(filename, std::ios::in | std::ios::out | std::ios::binary);
+        } else {
+            std::memcpy(h.magic_, binary_magic__(), 8);
+            h.version_ = BINARY_VERSION;
+            h.byte_order_ = BINARY_BYTE_ORDER;
+            h.num_levels_ = 0;
+            std::fill(h.reserved_, h.reserved_ + 3, 0);
+            f.open(filename, std::ios::out | std::ios::trunc |
+                                 std::ios::binary);
         }
-        for (std::size_t i = 0; i < vertex_.size(); ++i) {
-            vertex_[i].normal_[0] = -5e37;
+        if (!f)
+            throw std::runtime_error(std::string("Cannot write file ") +
+                                     filename);
+        ++h.num_levels_;
+        f.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        f.seekp(0, std::ios::end);
+
+        binary_level_t l;
+        l.flags_ = (topology ? BINARY_TOPOLOGY : 0) |
+                   (t.not_manifold_ ? BINARY_NOT_MANIFOLD : 0) |
+                   (t.with_boundary_ ? BINARY_WITH_BOUNDARY : 0) |
+                   (topology && CODE_SHIFT > 28 ? BINARY_WIDE_HALFEDGES : 0);
+        l.nv_ = num_vertices__();
+        l.nf_ = t.face_.size();
+        l.ne_ = topology ? t.edge_.size() : 0;
+        l.bytes_ = sizeof(double) * 3 * l.nv_ +
+                   (topology ? sizeof(face_t) * l.nf_ +
+                                   sizeof(halfedge_code) * l.nv_ +
+                                   sizeof(edge_t) * l.ne_
+                             : sizeof(int) * 4 * l.nf_);
+        f.write(reinterpret_cast<const char *>(&l), sizeof(l));
+        for (int i = 0; i < (int)l.nv_; ++i) {
+            const Cvec3 x = position__(i);
+            f.write(reinterpret_cast<const char *>(&x[0]), sizeof(double) * 3);
         }
+        if (topology) {
+            if (l.nf_)
+                f.write(reinterpret_cast<const char *>(&t.face_[0]),
+                        sizeof(face_t) * l.nf_);
+            if (l.nv_)
+                f.write(reinterpret_cast<const char *>(&t.halfedge_[0]),
+                        sizeof(halfedge_code) * l.nv_);
+            if (l.ne_)
+                f.write(reinterpret_cast<const char *>(&t.edge_[0]),
+                        sizeof(edge_t) * l.ne_);
+        } else {
+            for (std::size_t i = 0; i < t.face_.size(); ++i)
+                f.write(reinterpret_cast<const char *>(&t.face_[i].vertex_[0]),
+                        sizeof(int) * 4);
+        }
+        if (!f)
+            throw std::runtime_error(std::string("Cannot write file ") +
+                                     filename);
+    }
+    // Runs fn(lo, hi) over [0, n), split across the shared thread pool in
+    // ranges of at least grain elements when the parallel mode is on
+    template <typename F>
+    void for_range__(const int n, F fn, const int grain = 1024) const {
+        if (parallel_)
+            ThreadPool::shared().parallelFor(0, n, fn, grain);
+        else
+            fn(0, n);
+    }
+    // Spreads the low 21 bits of x to every third bit of a 63-bit code
+    static unsigned long long spread_bits__(unsigned long long x) {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffULL;
+        x = (x | x << 16) & 0x1f0000ff0000ffULL;
+        x = (x | x << 8) & 0x100f00f00f00f00fULL;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+        x = (x | x << 2) & 0x1249249249249249ULL;
+        return x;
+    }
+    void swap__(Mesh &m) noexcept {
+        topology_.swap(m.topology_);
+        position_.swap(m.position_);
+        normal_.swap(m.normal_);
+        position32_.swap(m.position32_);
+        normal32_.swap(m.normal32_);
+        std::swap(float_storage_, m.float_storage_);
+        f_.swap(m.f_);
+        e_.swap(m.e_);
+        v_.swap(m.v_);
+        std::swap(cache_rings_, m.cache_rings_);
+        std::swap(parallel_, m.parallel_);
+        next_face_.swap(m.next_face_);
+        next_edge_.swap(m.next_edge_);
+        next_halfedge_.swap(m.next_halfedge_);
+        next_position_.swap(m.next_position_);
+        findex_.swap(m.findex_);
+        face_normal_.swap(m.face_normal_);
+        std::swap(face_normals_fresh_, m.face_normals_fresh_);
+        std::swap(track_dirty_, m.track_dirty_);
+        dirty_.swap(m.dirty_);
+        dirty_flag_.swap(m.dirty_flag_);
+    }
+    // The point kernels of computeCatmullClarkPoints() over positions p, in
+    // either storage
+    template <typename P> void catmull_clark_points__(const P *const p) {
+        const topology_t &t = *topology_;
+        const int nf = f_.size(), ne = e_.size(), nv = v_.size();
+        for_range__(nf, [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i) {
+                const Cvec<int, 4> &fv = t.face_[i].vertex_;
+                Cvec3 s;
+                s += d__(p[fv[0]]);
+                s += d__(p[fv[1]]);
+                s += d__(p[fv[2]]);
+                if (fv[3] == -1) {
+                    f_[i] = s / 3;
+                } else {
+                    s += d__(p[fv[3]]);
+                    f_[i] = s / 4;
+                }
+            }
+        });
+        for_range__(ne, [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i) {
+                const halfedge_code h0 = t.edge_[i].halfedge_[0],
+                                    h1 = t.edge_[i].halfedge_[1];
+                const int f = index__(h0), j = slot__(h0);
+                const Cvec<int, 4> &fv = t.face_[f].vertex_;
+                const int k = j == 3 || fv[j + 1] == -1 ? 0 : j + 1;
+                e_[i] = (d__(p[fv[j]]) + d__(p[fv[k]]) + f_[f] +
+                         f_[index__(h1)]) *
+                        0.25;
+            }
+        });
+        // The walks around the vertices are chains of dependent loads, so
+        // they go around WALKS vertices in lockstep to overlap their misses
+        enum { WALKS = 8 };
+        for_range__(nv, [&](const int lo, const int hi) {
+            halfedge_code h[WALKS], h0[WALKS];
+            Cvec3 s[WALKS];
+            int n[WALKS];
+            for (int b = lo; b < hi; b += WALKS) {
+                const int w = std::min<int>(WALKS, hi - b);
+                for (int q = 0; q < w; ++q) {
+                    h[q] = h0[q] = t.halfedge_[b + q];
+                    s[q] = Cvec3();
+                    n[q] = 0;
+                }
+                for (int left = w; left > 0;) {
+                    for (int q = 0; q < w; ++q) {
+                        if (h[q] == -1)
+                            continue;
+                        const int f = index__(h[q]), j = slot__(h[q]);
+                        const face_t &fc = t.face_[f];
+                        const int last = fc.vertex_[3] == -1 ? 2 : 3;
+                        s[q] +=
+                            d__(p[fc.vertex_[j == last ? 0 : j + 1]]) + f_[f];
+                        ++n[q];
+                        const halfedge_code e = fc.edge_[j == 0 ? last : j - 1];
+                        h[q] = t.edge_[index__(e)].halfedge_[slot__(e) ^ 1];
+                        if (h[q] == h0[q]) {
+                            h[q] = -1;
+                            --left;
+                        }
+                    }
+                }
+                for (int q = 0; q < w; ++q)
+                    v_[b + q] = d__(p[b + q]) * ((n[q] - 2.0) / n[q]) +
+                                s[q] / (double(n[q]) * n[q]);
+            }
+        });
     }
     void subdivide__() {
-        if (not_manifold_)
+        const topology_t &t = *topology_;
+        if (t.not_manifold_)
             throw std::runtime_error(
                 "Subdivision does not support non manifold mesh yet.");
-        if (with_boundary_)
+        if (t.with_boundary_)
             throw std::runtime_error(
                 "Subdivision does not support mesh with boundaries yet.");
-        std::vector<face_t> f;
-        std::vector<vertex_t> v;
-        std::vector<edge_t> e;
-        std::vector<int> findex;
-        v.resize(v_.size() + e_.size() + f_.size());
-        e.resize(4 * edge_.size());
-        f.resize(2 * edge_.size());
-        findex.resize(face_.size());
-        for (std::size_t i = 0; i < v_.size(); ++i) {
-            v[i].position_ = v_[i]; // v-vertices
-        }
-        for (std::size_t i = 0; i < e_.size(); ++i) {
-            v[i + v_.size()].position_ = e_[i]; // e-vertices
-        }
-        for (std::size_t i = 0; i < f_.size(); ++i) {
-            v[i + v_.size() + e_.size()].position_ = f_[i]; // f-vertices
-        }
+        const int nv = v_.size(), ne = e_.size(), nf = f_.size();
+        if (nv != num_vertices__())
+            throw std::runtime_error(
+                "Subdivision needs new points; compact() released them.");
+        // the next level has a quad per corner, i.e. two per edge, and four
+        // edges per edge
+        check_size__(2LL * ne, MAX_ELEMENTS, "faces");
+        check_size__(4LL * ne, MAX_ELEMENTS, "edges");
+        check_size__((long long)nv + ne + nf, INT_MAX, "vertices");
+        // The next level is built in the scratch buffers, which end up in the
+        // new topology block. When this mesh held the only reference to the
+        // old block, its buffers become the scratch for the next call.
+        const std::shared_ptr<topology_t> next = std::make_shared<topology_t>();
+        std::vector<face_t> &f = next->face_;
+        std::vector<edge_t> &e = next->edge_;
+        std::vector<halfedge_code> &vh = next->halfedge_;
+        std::vector<Cvec3> &v = next_position_;
+        std::vector<int> &findex = findex_;
+        f.swap(next_face_);
+        e.swap(next_edge_);
+        vh.swap(next_halfedge_);
+        v.resize(nv + ne + nf);
+        vh.resize(nv + ne + nf);
+        e.resize(4 * t.edge_.size());
+        f.resize(2 * t.edge_.size());
+        findex.resize(t.face_.size());
         int fi = 0;
-#ifndef NDEBUG
-        for (std::size_t i = 0; i < v.size(); ++i) {
-            v[i].halfedge_ = -1;
-        }
-#endif
-        for (std::size_t i = 0; i < face_.size(); ++i) {
+        for (std::size_t i = 0; i < t.face_.size(); ++i) {
             findex[i] = fi;
-            const int n = fn__(i);
-            for (int j = 0; j < n; ++j, ++fi) {
-                const int k = (j + n - 1) % n;
-                const int ej = face_[i].edge_[j] & ((1 << 28) - 1);
-                const int ek = face_[i].edge_[k] & ((1 << 28) - 1);
-                f[fi].vertex_[0] = face_[i].vertex_[j]; // the v-vertex
-                f[fi].vertex_[1] = v_.size() + ej;
-                f[fi].vertex_[2] = v_.size() + e_.size() + i; // the f-vertex
-                f[fi].vertex_[3] = v_.size() + ek;
-                v[f[fi].vertex_[0]].halfedge_ = fi | (0 << 28);
-                v[f[fi].vertex_[1]].halfedge_ = fi | (1 << 28);
-                v[f[fi].vertex_[2]].halfedge_ = fi | (2 << 28);
-                v[f[fi].vertex_[3]].halfedge_ = fi | (3 << 28);
-            }
-        }
-        for (std::size_t i = 0; i < edge_.size(); ++i) {
-            const int f0 = edge_[i].halfedge_[0] & ((1 << 28) - 1);
-            const int f1 = edge_[i].halfedge_[1] & ((1 << 28) - 1);
-            const int j0 = edge_[i].halfedge_[0] >> 28;
-            const int j1 = edge_[i].halfedge_[1] >> 28;
-            const int n0 = fn__(f0);
-            const int n1 = fn__(f1);
-            const int k0 = (j0 + 1) % n0;
-            const int k1 = (j1 + 1) % n1;
-            e[4 * i + 0].halfedge_[0] = (findex[f0] + j0) | (0 << 28);
-            e[4 * i + 0].halfedge_[1] = (findex[f1] + k1) | (3 << 28);
-            e[4 * i + 1].halfedge_[0] = (findex[f0] + j0) | (1 << 28);
-            e[4 * i + 1].halfedge_[1] = (findex[f0] + k0) | (2 << 28);
-            e[4 * i + 2].halfedge_[0] = (findex[f1] + j1) | (0 << 28);
-            e[4 * i + 2].halfedge_[1] = (findex[f0] + k0) | (3 << 28);
-            e[4 * i + 3].halfedge_[0] = (findex[f1] + j1) | (1 << 28);
-            e[4 * i + 3].halfedge_[1] = (findex[f1] + k1) | (2 << 28);
-            for (std::size_t j = 4 * i; j < 4 * i + 4; ++j) {
-                for (int k = 0; k < 2; ++k) {
-                    f[e[j].halfedge_[k] & ((1 << 28) - 1)]
-                        .edge_[e[j].halfedge_[k] >> 28] = j | (k << 28);
+            fi += t.fn__(i);
+        }
+        // Every element of the next level below depends only on findex, so
+        // each loop can be split over index ranges without any write
+        // conflicts. The halfedge of each new vertex is picked from its
+        // parent element (and not from whichever child quad happens to be
+        // written last) so that the result does not depend on the split.
+        for_range__(nv, [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i) {
+                const halfedge_code h = t.halfedge_[i];
+                v[i] = v_[i]; // v-vertices
+                vh[i] = pack__(findex[index__(h)] + slot__(h), 0);
+            }
+        });
+        for_range__(ne, [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i) {
+                const halfedge_code h = t.edge_[i].halfedge_[0];
+                v[i + nv] = e_[i]; // e-vertices
+                vh[i + nv] = pack__(findex[index__(h)] + slot__(h), 1);
+            }
+        });
+        for_range__(nf, [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i) {
+                v[i + nv + ne] = f_[i]; // f-vertices
+                vh[i + nv + ne] = pack__(findex[i], 2);
+                const int n = t.fn__(i);
+                for (int j = 0; j < n; ++j) {
+                    const int k = (j + n - 1) % n;
+                    const int ej = index__(t.face_[i].edge_[j]);
+                    const int ek = index__(t.face_[i].edge_[k]);
+                    face_t &c = f[findex[i] + j];
+                    c.vertex_[0] = t.face_[i].vertex_[j]; // the v-vertex
+                    c.vertex_[1] = nv + ej;
+                    c.vertex_[2] = nv + ne + i; // the f-vertex
+                    c.vertex_[3] = nv + ek;
                 }
             }
-        }
+        });
+        for_range__(t.edge_.size(), [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i) {
+                const int f0 = index__(t.edge_[i].halfedge_[0]);
+                const int f1 = index__(t.edge_[i].halfedge_[1]);
+                const int j0 = slot__(t.edge_[i].halfedge_[0]);
+                const int j1 = slot__(t.edge_[i].halfedge_[1]);
+                const int n0 = t.fn__(f0);
+                const int n1 = t.fn__(f1);
+                const int k0 = (j0 + 1) % n0;
+                const int k1 = (j1 + 1) % n1;
+                e[4 * i + 0].halfedge_[0] = pack__(findex[f0] + j0, 0);
+                e[4 * i + 0].halfedge_[1] = pack__(findex[f1] + k1, 3);
+                e[4 * i + 1].halfedge_[0] = pack__(findex[f0] + j0, 1);
+                e[4 * i + 1].halfedge_[1] = pack__(findex[f0] + k0, 2);
+                e[4 * i + 2].halfedge_[0] = pack__(findex[f1] + j1, 0);
+                e[4 * i + 2].halfedge_[1] = pack__(findex[f0] + k0, 3);
+                e[4 * i + 3].halfedge_[0] = pack__(findex[f1] + j1, 1);
+                e[4 * i + 3].halfedge_[1] = pack__(findex[f1] + k1, 2);
+                for (int j = 4 * i; j < 4 * i + 4; ++j) {
+                    for (int k = 0; k < 2; ++k) {
+                        f[index__(e[j].halfedge_[k])]
+                            .edge_[slot__(e[j].halfedge_[k])] = pack__(j, k);
+                    }
+                }
+            }
+        });
 #ifndef NDEBUG
-        for (std::size_t i = 0; i < v.size(); ++i) {
-            assert(v[i].halfedge_ != -1);
+        for (std::size_t i = 0; i < vh.size(); ++i) {
+            const halfedge_code h = vh[i];
+            assert(f[index__(h)].vertex_[slot__(h)] == (int)i);
         }
 #endif
-        vertex_.swap(v);
-        edge_.swap(e);
-        face_.swap(f);
+        if (topology_.use_count() == 1) {
+            next_face_.swap(topology_->face_);
+            next_edge_.swap(topology_->edge_);
+            next_halfedge_.swap(topology_->halfedge_);
+        }
+        topology_ = next;
+        position_.swap(v);
+        store_positions__();
+        reset_normals__();
+        reset_dirty__();
         resize__();
+        if (cache_rings_)
+            topology_->init_rings__();
     }
 
   public:
     struct VertexIterator; // forward declaration (needed by Vertex class)
+    struct RingIterator;   // forward declaration (needed by Vertex class)
 
-    // Default contructor. Assignment operator/constructor
-    Mesh() : not_manifold_(false), with_boundary_(false) {}
-    Mesh(const Mesh &m) { *this = m; }
+    // Default contructor. Copies share the topology of the original and
+    // get their own vertex attributes, so copying a mesh to animate it costs
+    // only its positions and normals. Moving a mesh steals everything and
+    // leaves an empty mesh behind.
+    Mesh()
+        : topology_(empty_topology__()), float_storage_(false),
+          cache_rings_(false), parallel_(false), face_normals_fresh_(false),
+          track_dirty_(false) {}
+    Mesh(const Mesh &m) : Mesh() { *this = m; }
+    Mesh(Mesh &&m) noexcept : Mesh() { swap__(m); }
     Mesh &operator=(const Mesh &m) {
-        face_ = m.face_;
-        vertex_ = m.vertex_;
-        edge_ = m.edge_;
+        topology_ = m.topology_;
+        position_ = m.position_;
+        normal_ = m.normal_;
+        position32_ = m.position32_;
+        normal32_ = m.normal32_;
+        float_storage_ = m.float_storage_;
         f_ = m.f_;
         e_ = m.e_;
         v_ = m.v_;
-        not_manifold_ = m.not_manifold_;
-        with_boundary_ = m.with_boundary_;
+        cache_rings_ = m.cache_rings_;
+        parallel_ = m.parallel_;
+        track_dirty_ = m.track_dirty_;
+        reset_dirty__();
+        return *this;
+    }
+    Mesh &operator=(Mesh &&m) noexcept {
+        Mesh tmp(std::move(m));
+        swap__(tmp);
         return *this;
     }
 
@@ -249,21 +1464,40 @@ class Mesh {
         const int v_;
 
         Vertex(Mesh &m, const int v) : m_(m), v_(v) {}
-        Cvec3 getPosition() const { return m_.vertex_[v_].position_; }
+        Cvec3 getPosition() const { return m_.position__(v_); }
         Cvec3 getNormal() const {
-            assert(m_.vertex_[v_].normal_[0] > -1e37 ||
+            const Cvec3 n = m_.normal__(v_);
+            assert(n[0] > -1e37 ||
                    !"Error: This normal is uninitialized, you can set it with "
                     "setNormal()");
-            return m_.vertex_[v_].normal_;
+            return n;
+        }
+        void setPosition(const Cvec3 &p) const {
+            m_.set_position__(v_, p);
+            if (m_.track_dirty_)
+                m_.mark_dirty__(v_);
         }
-        void setPosition(const Cvec3 &p) const { m_.vertex_[v_].position_ = p; }
-        void setNormal(const Cvec3 &n) const { m_.vertex_[v_].normal_ = n; }
+        void setNormal(const Cvec3 &n) const { m_.set_normal__(v_, n); }
         int getIndex() const { return v_; }
         VertexIterator getIterator() const {
-            assert((m_.vertex_[v_].halfedge_ & ((1 << 28) - 1)) <
-                   (int)m_.face_.size());
-            return VertexIterator(m_, m_.vertex_[v_].halfedge_);
+            const halfedge_code h = m_.topology_->halfedge_[v_];
+            assert(index__(h) < (int)m_.topology_->face_.size());
+            return VertexIterator(m_, h);
         }
+        // Walks the cached one-ring; requires cacheOneRings() to be on
+        RingIterator ringBegin() const {
+            assert(m_.cache_rings_ || !"Error: one-ring cache is disabled");
+            return RingIterator(m_, m_.topology_->ring_offset_[v_]);
+        }
+        RingIterator ringEnd() const {
+            assert(m_.cache_rings_ || !"Error: one-ring cache is disabled");
+            return RingIterator(m_, m_.topology_->ring_offset_[v_ + 1]);
+        }
+        // Number of cached ring entries. Like VertexIterator, the ring stops
+        // at the first boundary edge it meets, so on a boundary vertex this
+        // undercounts the neighbors; getValence() is exact only on closed
+        // meshes (see hasBoundary()).
+        int getValence() const { return m_.getRingSize(v_); }
     };
 
     // Mesh::Face class
@@ -274,15 +1508,14 @@ class Mesh {
         Face(Mesh &m, const int f) : m_(m), f_(f) {}
         int getNumVertices() const { return m_.fn__(f_); }
         Cvec3 getNormal() const {
-            return cross(m_.vertex_[m_.face_[f_].vertex_[1]].position_ -
-                             m_.vertex_[m_.face_[f_].vertex_[0]].position_,
-                         m_.vertex_[m_.face_[f_].vertex_[2]].position_ -
-                             m_.vertex_[m_.face_[f_].vertex_[0]].position_)
+            const Cvec<int, 4> &fv = m_.topology_->face_[f_].vertex_;
+            const Cvec3 p0 = m_.position__(fv[0]);
+            return cross(m_.position__(fv[1]) - p0, m_.position__(fv[2]) - p0)
                 .normalize();
         }
         Vertex getVertex(const int i) const {
             assert(i >= 0 && i < getNumVertices());
-            return Vertex(m_, m_.face_[f_].vertex_[i]);
+            return Vertex(m_, m_.topology_->face_[f_].vertex_[i]);
         }
     };
 
@@ -294,17 +1527,18 @@ class Mesh {
         Edge(Mesh &m, const int e) : m_(m), e_(e) {}
         Vertex getVertex(const int i) const {
             assert(i >= 0 && i < 2);
-            int faceIdx = m_.edge_[e_].halfedge_[0] & ((1 << 28) - 1);
-            int vertIdxWithinFace = ((m_.edge_[e_].halfedge_[0] >> 28) + i) % 4;
-            if (m_.face_[faceIdx].vertex_[vertIdxWithinFace] == -1) {
+            const topology_t &t = *m_.topology_;
+            int faceIdx = index__(t.edge_[e_].halfedge_[0]);
+            int vertIdxWithinFace = (slot__(t.edge_[e_].halfedge_[0]) + i) % 4;
+            if (t.face_[faceIdx].vertex_[vertIdxWithinFace] == -1) {
                 assert(vertIdxWithinFace == 3);
                 vertIdxWithinFace = 0;
             }
-            return Vertex(m_, m_.face_[faceIdx].vertex_[vertIdxWithinFace]);
+            return Vertex(m_, t.face_[faceIdx].vertex_[vertIdxWithinFace]);
         }
         Face getFace(const int i) const {
             assert(i >= 0 && i < 2);
-            return Face(m_, m_.edge_[e_].halfedge_[i] & ((1 << 28) - 1));
+            return Face(m_, index__(m_.topology_->edge_[e_].halfedge_[i]));
         }
         bool is_valid() const {
             return getVertex(0).v_ != -1 && getVertex(1).v_ != -1;
@@ -314,21 +1548,23 @@ class Mesh {
     // Mesh::VertexIterator
     struct VertexIterator {
         Mesh &m_;
-        int h_;
+        halfedge_code h_;
 
-        VertexIterator(Mesh &m, const int h) : m_(m), h_(h) {}
+        VertexIterator(Mesh &m, const halfedge_code h) : m_(m), h_(h) {}
         Vertex getVertex() const {
-            const int v(h_ >> 28);
-            const int f(h_ & ((1 << 28) - 1));
-            return Vertex(m_, m_.face_[f].vertex_[(v + 1) % m_.fn__(f)]);
+            const int v(slot__(h_));
+            const int f(index__(h_));
+            return Vertex(m_, m_.topology_->face_[f].vertex_[(v + 1) %
+                                                              m_.fn__(f)]);
         }
-        Face getFace() const { return Face(m_, h_ & ((1 << 28) - 1)); }
+        Face getFace() const { return Face(m_, index__(h_)); }
         VertexIterator &operator++() {
-            const int f(h_ & ((1 << 28) - 1)), v(h_ >> 28),
-                vj((v + m_.fn__(f) - 1) % m_.fn__(f)),
-                e(m_.face_[f].edge_[vj] & ((1 << 28) - 1)),
-                ei(m_.face_[f].edge_[vj] >> 28);
-            h_ = m_.edge_[e].halfedge_[ei ^ 1];
+            const topology_t &t = *m_.topology_;
+            const int f(index__(h_)), v(slot__(h_)),
+                vj((v + t.fn__(f) - 1) % t.fn__(f)),
+                e(index__(t.face_[f].edge_[vj])),
+                ei(slot__(t.face_[f].edge_[vj]));
+            h_ = t.edge_[e].halfedge_[ei ^ 1];
             return *this;
         }
         bool operator==(const VertexIterator &vi) const {
@@ -339,9 +1575,33 @@ class Mesh {
         }
     };
 
-    int getNumFaces() const { return face_.size(); }
-    int getNumEdges() const { return edge_.size(); }
-    int getNumVertices() const { return vertex_.size(); }
+    // Mesh::RingIterator
+    // Same visiting order as VertexIterator, but steps through the flat
+    // one-ring cache instead of hopping across faces and edges.
+    struct RingIterator {
+        Mesh &m_;
+        int i_;
+
+        RingIterator(Mesh &m, const int i) : m_(m), i_(i) {}
+        Vertex getVertex() const {
+            return Vertex(m_, m_.topology_->ring_vertex_[i_]);
+        }
+        Face getFace() const { return Face(m_, m_.topology_->ring_face_[i_]); }
+        RingIterator &operator++() {
+            ++i_;
+            return *this;
+        }
+        bool operator==(const RingIterator &ri) const {
+            return &m_ == &ri.m_ && i_ == ri.i_;
+        }
+        bool operator!=(const RingIterator &ri) const {
+            return &m_ != &ri.m_ || i_ != ri.i_;
+        }
+    };
+
+    int getNumFaces() const { return topology_->face_.size(); }
+    int getNumEdges() const { return topology_->edge_.size(); }
+    int getNumVertices() const { return num_vertices__(); }
 
     Vertex getVertex(const int i) { return Vertex(*this, i); }
     Edge getEdge(const int i) { return Edge(*this, i); }
@@ -355,8 +1615,363 @@ class Mesh {
     void setNewEdgeVertex(const Edge &e, const Cvec3 &p) { e_[e.e_] = p; }
     void setNewVertexVertex(const Vertex &v, const Cvec3 &p) { v_[v.v_] = p; }
 
+    // Fills in the Catmull-Clark face, edge and vertex points for the next
+    // subdivide(), straight from the topology arrays and split like the
+    // other loops in the parallel mode. The sums run in the order of the
+    // Face, Edge and VertexIterator walks, so the points are bit-identical
+    // to those computed by hand through setNewFaceVertex() and friends.
+    void computeCatmullClarkPoints() {
+        const topology_t &t = *topology_;
+        if (t.not_manifold_ || t.with_boundary_)
+            throw std::runtime_error("Catmull-Clark points need a closed, "
+                                     "manifold mesh.");
+        resize__(); // after compact()
+        if (float_storage_)
+            catmull_clark_points__(position32_.data());
+        else
+            catmull_clark_points__(position_.data());
+    }
+
     void subdivide() { subdivide__(); }
-    void load(const char filename[]) { load__(filename); }
+
+    // Sets the positions of finer, a mesh with the topology subdivide()
+    // makes out of this one, to the points set for the next subdivide(),
+    // e.g. to update a level kept from an earlier subdivide() after the
+    // positions of this mesh changed. Skips building the topology again.
+    void subdividePositions(Mesh &finer) const {
+        const int nv = v_.size(), ne = e_.size(), nf = f_.size();
+        if (nv != num_vertices__() ||
+            finer.num_vertices__() != nv + ne + nf ||
+            finer.topology_->face_.size() != 2 * topology_->edge_.size())
+            throw std::runtime_error(
+                "Mesh is not the subdivision of this mesh.");
+        for_range__(nv + ne + nf, [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i)
+                finer.set_position__(i, i < nv        ? v_[i]
+                                        : i < nv + ne ? e_[i - nv]
+                                                      : f_[i - nv - ne]);
+        });
+        finer.reset_normals__();
+        finer.reset_dirty__();
+    }
+
+    // Loads a text .mesh, .obj or ASCII .ply file (picked by extension), or
+    // the last level of a binary mesh file written by saveBinary()
+    void load(const char filename[]) {
+        if (is_binary__(filename))
+            load_binary__(filename, -1);
+        else
+            load__(filename);
+    }
+
+    // Replaces the mesh with the given vertices and faces, given as four
+    // vertex indices each with -1 as the last index of triangles. Unlike
+    // load(), the positions are kept as they are.
+    void build(const std::vector<Cvec3> &positions,
+               const std::vector<Cvec<int, 4>> &faces) {
+        const std::shared_ptr<topology_t> t = std::make_shared<topology_t>();
+        position_ = positions;
+        t->face_.resize(faces.size());
+        for (std::size_t i = 0; i < faces.size(); ++i)
+            t->face_[i].vertex_ = faces[i];
+        finish_load__(t, "Mesh::build()", false);
+    }
+
+    // Renumbers vertices along a Morton (Z-order) curve through their
+    // positions and sorts faces by their smallest vertex index in the new
+    // order, so that neighbors end up close in memory: files, and subdivide()
+    // with its e- and f-vertices appended at the end, leave them scattered.
+    // The edges are matched again on the new faces, so edges and halfedges
+    // follow the same order. Positions and normals move with their vertices.
+    // Returns the new index of every old vertex, for per-vertex data held
+    // elsewhere.
+    std::vector<int> reorder() {
+        // in doubles, which hold floats exactly
+        const bool floats = float_storage_;
+        setFloatStorage(false);
+        const topology_t &t = *topology_;
+        const int nv = position_.size(), nf = t.face_.size();
+        const int chunks =
+            parallel_ ? ThreadPool::shared().getNumThreads() : 1;
+        Cvec3 lo(1e300), hi(-1e300);
+        for (int i = 0; i < nv; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                lo[k] = std::min(lo[k], position_[i][k]);
+                hi[k] = std::max(hi[k], position_[i][k]);
+            }
+        }
+        std::vector<edge_key_t> key(nv), tmp;
+        for_range__(nv, [&](const int b, const int e) {
+            for (int i = b; i < e; ++i) {
+                unsigned long long code = 0;
+                for (int k = 0; k < 3; ++k) {
+                    const double x = hi[k] > lo[k] ? (position_[i][k] - lo[k]) /
+                                                         (hi[k] - lo[k])
+                                                   : 0;
+                    code |= spread_bits__((unsigned long long)(
+                                x * double((1 << 21) - 1)))
+                            << k;
+                }
+                key[i].key_ = code;
+                key[i].halfedge_ = i;
+            }
+        });
+        sort_edge_keys__(key, tmp, 63, chunks);
+        std::vector<int> newIndex(nv);
+        for (int i = 0; i < nv; ++i)
+            newIndex[key[i].halfedge_] = i;
+
+        // faces by their smallest new vertex index; the sort is stable, so
+        // faces around one vertex keep their relative order
+        int bits = 0;
+        while (bits < 31 && (nv - 1) >> bits > 0)
+            ++bits;
+        key.resize(nf);
+        for_range__(nf, [&](const int b, const int e) {
+            for (int i = b; i < e; ++i) {
+                int m = nv;
+                for (int j = 0, n = t.fn__(i); j < n; ++j)
+                    m = std::min(m, newIndex[t.face_[i].vertex_[j]]);
+                key[i].key_ = m;
+                key[i].halfedge_ = i;
+            }
+        });
+        sort_edge_keys__(key, tmp, bits, chunks);
+
+        const std::shared_ptr<topology_t> next = std::make_shared<topology_t>();
+        next->face_.resize(nf);
+        for_range__(nf, [&](const int b, const int e) {
+            for (int i = b; i < e; ++i) {
+                const face_t &f = t.face_[key[i].halfedge_];
+                for (int j = 0; j < 4; ++j)
+                    next->face_[i].vertex_[j] =
+                        f.vertex_[j] == -1 ? -1 : newIndex[f.vertex_[j]];
+            }
+        });
+        std::vector<Cvec3> position(nv), normal(nv);
+        for_range__(nv, [&](const int b, const int e) {
+            for (int i = b; i < e; ++i) {
+                position[newIndex[i]] = position_[i];
+                normal[newIndex[i]] = normal_[i];
+            }
+        });
+        position_.swap(position);
+        finish_load__(next, "Mesh::reorder()", false);
+        normal_.swap(normal);
+        setFloatStorage(floats);
+        return newIndex;
+    }
+
+    // Binary mesh files: saveBinary() writes the current mesh, optionally
+    // with its topology so that loading skips the edge matching. With
+    // append = true the mesh is added as a new level to an existing file.
+    // loadBinary() loads the given level; negative levels count from the end.
+    void saveBinary(const char filename[], const bool withTopology = true,
+                    const bool append = false) const {
+        save_binary__(filename, withTopology, append);
+    }
+    void loadBinary(const char filename[], const int level = -1) {
+        load_binary__(filename, level);
+    }
+    static int getNumBinaryLevels(const char filename[]) {
+        const MappedFile file(filename);
+        return read_binary_header__(file, filename).num_levels_;
+    }
+
+    // Enables the flat one-ring cache. While enabled, the cache is built for
+    // the new topology after every load() and subdivide(). The cache belongs
+    // to the topology, so it is built once for all the meshes sharing it.
+    void cacheOneRings(const bool enable = true) {
+        cache_rings_ = enable;
+        if (enable)
+            topology_->init_rings__();
+    }
+    bool hasOneRings() const { return cache_rings_; }
+
+    // Topology flags found by load(); subdivide() rejects both kinds of mesh
+    bool isManifold() const { return !topology_->not_manifold_; }
+    bool hasBoundary() const { return topology_->with_boundary_; }
+
+    // True when this mesh and m are copies with the very same topology
+    // block, e.g. instances of one mesh with different positions
+    bool sharesTopology(const Mesh &m) const {
+        return topology_ == m.topology_;
+    }
+
+    // Splits the loops of load() and subdivide() across ThreadPool::shared().
+    // The result is identical to the serial path.
+    void setParallel(const bool enable = true) { parallel_ = enable; }
+    bool isParallel() const { return parallel_; }
+
+    // Keeps positions and normals as packed floats, in half the memory of
+    // doubles, e.g. for meshes kept to be drawn: getFloatPositions() and
+    // getFloatNormals() then go to vertex buffers as they are. Everything
+    // still computes in double, reading and rounding to floats, so results
+    // differ from the double storage by float rounding. Switching converts
+    // the attributes the mesh holds.
+    void setFloatStorage(const bool enable = true) {
+        if (enable && !float_storage_) {
+            convert__(position_, position32_);
+            convert__(normal_, normal32_);
+        } else if (!enable && float_storage_) {
+            convert__(position32_, position_);
+            convert__(normal32_, normal_);
+        }
+        float_storage_ = enable;
+    }
+    bool hasFloatStorage() const { return float_storage_; }
+    // The positions and normals as getNumVertices() packed x, y, z floats,
+    // to upload with a memcpy; NULL without float storage
+    const Cvec3f *getFloatPositions() const {
+        return float_storage_ && !position32_.empty() ? &position32_[0] : NULL;
+    }
+    const Cvec3f *getFloatNormals() const {
+        return float_storage_ && !normal32_.empty() ? &normal32_[0] : NULL;
+    }
+
+    // Makes Vertex::setPosition() record the vertices it moves, so that
+    // updateNormals() redoes only their surroundings. setPosition() must then
+    // be called from one thread at a time. Switching it either way forgets
+    // the dirty vertices, as if every position had changed.
+    void trackDirtyVertices(const bool enable = true) {
+        track_dirty_ = enable;
+        reset_dirty__();
+    }
+    bool isTrackingDirtyVertices() const { return track_dirty_; }
+    // Vertices moved since the last computeNormals() or updateNormals(), in
+    // the order they were first moved
+    const std::vector<int> &getDirtyVertices() const { return dirty_; }
+
+    // Bytes held by the mesh: its topology block, even when shared with
+    // copies, its vertex attributes and its scratch buffers
+    std::size_t getMemoryUsage() const {
+        const topology_t &t = *topology_;
+        return t.face_.capacity() * sizeof(face_t) +
+               t.edge_.capacity() * sizeof(edge_t) +
+               t.halfedge_.capacity() * sizeof(halfedge_code) +
+               (t.ring_offset_.capacity() + t.ring_vertex_.capacity() +
+                t.ring_face_.capacity() + t.corner_offset_.capacity() +
+                t.corner_face_.capacity() + findex_.capacity() +
+                dirty_.capacity()) *
+                   sizeof(int) +
+               (position_.capacity() + normal_.capacity() + f_.capacity() +
+                e_.capacity() + v_.capacity() + next_position_.capacity() +
+                face_normal_.capacity()) *
+                   sizeof(Cvec3) +
+               (position32_.capacity() + normal32_.capacity()) *
+                   sizeof(Cvec3f) +
+               next_face_.capacity() * sizeof(face_t) +
+               next_edge_.capacity() * sizeof(edge_t) +
+               next_halfedge_.capacity() * sizeof(halfedge_code) +
+               dirty_flag_.capacity();
+    }
+    // Frees the points for the next subdivide() and the scratch buffers,
+    // which together take more than the positions and topology, for meshes
+    // that are kept around to be drawn. computeCatmullClarkPoints() sizes
+    // the points again; setNewFaceVertex() and friends need it first.
+    void compact() {
+        std::vector<Cvec3>().swap(f_);
+        std::vector<Cvec3>().swap(e_);
+        std::vector<Cvec3>().swap(v_);
+        std::vector<face_t>().swap(next_face_);
+        std::vector<edge_t>().swap(next_edge_);
+        std::vector<halfedge_code>().swap(next_halfedge_);
+        std::vector<Cvec3>().swap(next_position_);
+        std::vector<int>().swap(findex_);
+        std::vector<Cvec3>().swap(face_normal_);
+        face_normals_fresh_ = false;
+    }
+
+    // Sets every vertex normal to the normalized sum of the area-weighted
+    // normals of its incident faces. Each face normal is computed once, and
+    // each vertex then gathers its own faces, so the parallel mode needs no
+    // locks or per-thread buffers and gives bit-identical results. Vertices
+    // without faces get a zero normal.
+    void computeNormals() {
+        const int nf = topology_->face_.size(), nv = num_vertices__();
+        topology_->init_corners__();
+        face_normal_.resize(nf);
+        for_range__(nf, [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i)
+                face_normal_[i] = face_normal__(i);
+        });
+        for_range__(nv, [&](const int lo, const int hi) {
+            for (int v = lo; v < hi; ++v)
+                set_normal__(v, vertex_normal__(v));
+        });
+        face_normals_fresh_ = true;
+        clear_dirty__();
+    }
+
+    // Brings the normals up to date after Vertex::setPosition() moved a few
+    // vertices, with the same result as computeNormals() but only redoing
+    // the faces around the dirty vertices and the vertices of those faces,
+    // so that a brush stroke costs in proportion to the brush. Falls back to
+    // computeNormals() unless trackDirtyVertices() is on and computeNormals()
+    // ran since the positions last changed as a whole (load(), subdivide(),
+    // compact() and the like). Sets spans to the sorted ranges [first, last)
+    // of the vertices whose position or normal changed, e.g. for
+    // FormattedVbo::update(), merging ranges at most maxGap vertices apart.
+    void updateNormals(std::vector<std::pair<int, int>> &spans,
+                       const int maxGap = 0) {
+        spans.clear();
+        const topology_t &t = *topology_;
+        const int nv = num_vertices__();
+        if (!track_dirty_ || !face_normals_fresh_) {
+            computeNormals();
+            if (nv > 0)
+                spans.push_back(std::make_pair(0, nv));
+            return;
+        }
+        std::vector<int> faces, vertices(dirty_);
+        for (std::size_t i = 0; i < dirty_.size(); ++i) {
+            for (int j = t.corner_offset_[dirty_[i]],
+                     e = t.corner_offset_[dirty_[i] + 1];
+                 j < e; ++j)
+                faces.push_back(t.corner_face_[j]);
+        }
+        std::sort(faces.begin(), faces.end());
+        faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+        for (std::size_t i = 0; i < faces.size(); ++i) {
+            for (int j = 0, n = fn__(faces[i]); j < n; ++j)
+                vertices.push_back(t.face_[faces[i]].vertex_[j]);
+        }
+        std::sort(vertices.begin(), vertices.end());
+        vertices.erase(std::unique(vertices.begin(), vertices.end()),
+                       vertices.end());
+        for_range__(faces.size(), [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i)
+                face_normal_[faces[i]] = face_normal__(faces[i]);
+        });
+        for_range__(vertices.size(), [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i)
+                set_normal__(vertices[i], vertex_normal__(vertices[i]));
+        });
+        clear_dirty__();
+        for (std::size_t i = 0; i < vertices.size(); ++i) {
+            if (!spans.empty() && vertices[i] - spans.back().second <= maxGap)
+                spans.back().second = vertices[i] + 1;
+            else
+                spans.push_back(std::make_pair(vertices[i], vertices[i] + 1));
+        }
+    }
+
+    // Raw access to the cached one-ring of vertex v: getRingSize(v) neighbor
+    // vertex indices and incident face indices, both in cyclic order. Requires
+    // cacheOneRings() to be on. Around a boundary vertex the ring is partial,
+    // as it ends at the first boundary edge.
+    int getRingSize(const int v) const {
+        assert(cache_rings_ || !"Error: one-ring cache is disabled");
+        return topology_->ring_offset_[v + 1] - topology_->ring_offset_[v];
+    }
+    const int *getRingVertices(const int v) const {
+        assert(cache_rings_ || !"Error: one-ring cache is disabled");
+        return topology_->ring_vertex_.data() + topology_->ring_offset_[v];
+    }
+    const int *getRingFaces(const int v) const {
+        assert(cache_rings_ || !"Error: one-ring cache is disabled");
+        return topology_->ring_face_.data() + topology_->ring_offset_[v];
+    }
 };
 
 #endif
@@ -0,0 +1,1856 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   Micro benchmarks for mesh.h. Build with "make meshbench" and run
+//   from this directory so that bunny.mesh is found, e.g.
+//
+//     ./meshbench rings [maxLevel]
+//     ./meshbench subdivide [maxLevel]
+//     ./meshbench load [level]
+//     ./meshbench binload [level]
+//     ./meshbench parse [level]
+//     ./meshbench export [maxLevel]
+//     ./meshbench normals [maxLevel]
+//     ./meshbench stencils [level]
+//     ./meshbench lod [level]
+//     ./meshbench bvh [level]
+//     ./meshbench instances [level]
+//     ./meshbench reorder [level]
+//     ./meshbench outofcore [level]
+//     ./meshbench points [level]
+//     ./meshbench levels [level]
+//     ./meshbench meshlets [level]
+//     ./meshbench sculpt [level]
+//     ./meshbench storage [level]
+//     ./meshbench shells [level]
+//     ./meshbench fur [level]
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cvec.h"
+#include "fursim.h"
+#include "levelcache.h"
+#include "mesh.h"
+#include "meshbvh.h"
+#include "meshlets.h"
+#include "outofcore.h"
+#include "simplify.h"
+#include "stencils.h"
+#include "vertexcache.h"
+
+using namespace std;
+
+static double nowSeconds() {
+  return chrono::duration<double>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Fills in the Catmull-Clark face, edge and vertex points through the public
+// Mesh API; the reference for Mesh::computeCatmullClarkPoints()
+static void catmullClarkPoints(Mesh &m) {
+  for (int i = 0; i < m.getNumFaces(); ++i) {
+    const Mesh::Face f = m.getFace(i);
+    Cvec3 p;
+    for (int j = 0; j < f.getNumVertices(); ++j)
+      p += f.getVertex(j).getPosition();
+    m.setNewFaceVertex(f, p / f.getNumVertices());
+  }
+  for (int i = 0; i < m.getNumEdges(); ++i) {
+    const Mesh::Edge e = m.getEdge(i);
+    m.setNewEdgeVertex(e, (e.getVertex(0).getPosition() +
+                           e.getVertex(1).getPosition() +
+                           m.getNewFaceVertex(e.getFace(0)) +
+                           m.getNewFaceVertex(e.getFace(1))) *
+                              0.25);
+  }
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    const Mesh::Vertex v = m.getVertex(i);
+    Cvec3 s;
+    int n = 0;
+    Mesh::VertexIterator it(v.getIterator()), it0(it);
+    do {
+      s += it.getVertex().getPosition() + m.getNewFaceVertex(it.getFace());
+      ++n;
+    } while (++it != it0);
+    m.setNewVertexVertex(v, v.getPosition() * ((n - 2.0) / n) +
+                                s / (double(n) * n));
+  }
+}
+
+static void catmullClark(Mesh &m) {
+  m.computeCatmullClarkPoints();
+  m.subdivide();
+}
+
+// Compares connectivity, first halfedges and positions of two meshes
+static bool sameMesh(Mesh &a, Mesh &b) {
+  if (a.getNumVertices() != b.getNumVertices() ||
+      a.getNumEdges() != b.getNumEdges() || a.getNumFaces() != b.getNumFaces())
+    return false;
+  for (int i = 0; i < a.getNumFaces(); ++i) {
+    const Mesh::Face fa = a.getFace(i), fb = b.getFace(i);
+    if (fa.getNumVertices() != fb.getNumVertices())
+      return false;
+    for (int j = 0; j < fa.getNumVertices(); ++j)
+      if (fa.getVertex(j).getIndex() != fb.getVertex(j).getIndex())
+        return false;
+  }
+  for (int i = 0; i < a.getNumEdges(); ++i) {
+    const Mesh::Edge ea = a.getEdge(i), eb = b.getEdge(i);
+    for (int j = 0; j < 2; ++j)
+      if (ea.getVertex(j).getIndex() != eb.getVertex(j).getIndex() ||
+          ea.getFace(j).f_ != eb.getFace(j).f_)
+        return false;
+  }
+  for (int i = 0; i < a.getNumVertices(); ++i) {
+    const Mesh::Vertex va = a.getVertex(i), vb = b.getVertex(i);
+    if (va.getIterator().h_ != vb.getIterator().h_ ||
+        norm2(va.getPosition() - vb.getPosition()) != 0)
+      return false;
+  }
+  return true;
+}
+
+// Sums neighbor and face indices over every one-ring using VertexIterator
+static long ringSumIterator(Mesh &m) {
+  long sum = 0;
+  for (int i = 0, n = m.getNumVertices(); i < n; ++i) {
+    Mesh::VertexIterator it(m.getVertex(i).getIterator()), it0(it);
+    do {
+      sum += it.getVertex().getIndex() + it.getFace().f_;
+    } while (++it != it0);
+  }
+  return sum;
+}
+
+// Same as ringSumIterator, but through the cached RingIterator
+static long ringSumCached(Mesh &m) {
+  long sum = 0;
+  for (int i = 0, n = m.getNumVertices(); i < n; ++i) {
+    const Mesh::Vertex v = m.getVertex(i);
+    for (Mesh::RingIterator it = v.ringBegin(), e = v.ringEnd(); it != e; ++it)
+      sum += it.getVertex().getIndex() + it.getFace().f_;
+  }
+  return sum;
+}
+
+// Same as ringSumCached, but over the raw arrays
+static long ringSumRaw(const Mesh &m) {
+  long sum = 0;
+  for (int i = 0, n = m.getNumVertices(); i < n; ++i) {
+    const int *rv = m.getRingVertices(i), *rf = m.getRingFaces(i);
+    for (int j = 0, k = m.getRingSize(i); j < k; ++j)
+      sum += rv[j] + rf[j];
+  }
+  return sum;
+}
+
+// Repeats f until at least minSeconds elapsed; returns seconds per call
+template <typename F> static double timeIt(F f, long &result) {
+  const double minSeconds = 0.2;
+  int reps = 0;
+  const double t0 = nowSeconds();
+  double t1 = t0;
+  do {
+    result = f();
+    ++reps;
+    t1 = nowSeconds();
+  } while (t1 - t0 < minSeconds);
+  return (t1 - t0) / reps;
+}
+
+static void benchRings(int maxLevel) {
+  Mesh m;
+  m.load("bunny.mesh");
+  printf("%5s %9s %10s %14s %14s %14s\n", "level", "vertices", "ring size",
+         "iter Mvis/s", "cached Mvis/s", "raw Mvis/s");
+  for (int level = 0; level <= maxLevel; ++level) {
+    if (level > 0)
+      catmullClark(m);
+    m.cacheOneRings();
+    long ringTotal = 0;
+    for (int i = 0; i < m.getNumVertices(); ++i)
+      ringTotal += m.getRingSize(i);
+
+    long r0, r1, r2;
+    const double t0 = timeIt([&] { return ringSumIterator(m); }, r0);
+    const double t1 = timeIt([&] { return ringSumCached(m); }, r1);
+    const double t2 = timeIt([&] { return ringSumRaw(m); }, r2);
+    if (r0 != r1 || r0 != r2)
+      throw runtime_error("one-ring cache disagrees with VertexIterator");
+    printf("%5d %9d %10ld %14.1f %14.1f %14.1f\n", level, m.getNumVertices(),
+           ringTotal, ringTotal / t0 * 1e-6, ringTotal / t1 * 1e-6,
+           ringTotal / t2 * 1e-6);
+    m.cacheOneRings(false);
+  }
+}
+
+static void benchSubdivide(int maxLevel) {
+  Mesh serial, parallel;
+  serial.load("bunny.mesh");
+  parallel.load("bunny.mesh");
+  parallel.setParallel();
+  printf("threads: %d\n", ThreadPool::shared().getNumThreads());
+  printf("%5s %9s %9s %12s %12s %8s\n", "level", "faces", "edges",
+         "serial ms", "parallel ms", "speedup");
+  for (int level = 1; level <= maxLevel; ++level) {
+    serial.computeCatmullClarkPoints();
+    parallel.computeCatmullClarkPoints();
+    const double t0 = nowSeconds();
+    serial.subdivide();
+    const double t1 = nowSeconds();
+    parallel.subdivide();
+    const double t2 = nowSeconds();
+    if (!sameMesh(serial, parallel))
+      throw runtime_error("parallel subdivision differs from serial");
+    printf("%5d %9d %9d %12.2f %12.2f %8.2f\n", level, serial.getNumFaces(),
+           serial.getNumEdges(), (t1 - t0) * 1e3, (t2 - t1) * 1e3,
+           (t1 - t0) / (t2 - t1));
+  }
+}
+
+// Writes m as a text .mesh file (tris first, then quads)
+static void writeMesh(Mesh &m, const char filename[]) {
+  ofstream f(filename);
+  int nt = 0;
+  for (int i = 0; i < m.getNumFaces(); ++i)
+    nt += m.getFace(i).getNumVertices() == 3;
+  f << m.getNumVertices() << " " << nt << " " << m.getNumFaces() - nt << "\n";
+  f.precision(9);
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    const Cvec3 p = m.getVertex(i).getPosition();
+    f << p[0] << " " << p[1] << " " << p[2] << "\n";
+  }
+  for (int n = 3; n <= 4; ++n) {
+    for (int i = 0; i < m.getNumFaces(); ++i) {
+      const Mesh::Face face = m.getFace(i);
+      if (face.getNumVertices() != n)
+        continue;
+      for (int j = 0; j < n; ++j)
+        f << face.getVertex(j).getIndex() << (j + 1 < n ? " " : "\n");
+    }
+  }
+  if (!f)
+    throw runtime_error(string("Cannot write file ") + filename);
+}
+
+// Writes m as a Wavefront .obj file
+static void writeObj(Mesh &m, const char filename[]) {
+  ofstream f(filename);
+  f.precision(9);
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    const Cvec3 p = m.getVertex(i).getPosition();
+    f << "v " << p[0] << " " << p[1] << " " << p[2] << "\n";
+  }
+  for (int i = 0; i < m.getNumFaces(); ++i) {
+    const Mesh::Face face = m.getFace(i);
+    f << "f";
+    for (int j = 0; j < face.getNumVertices(); ++j)
+      f << " " << face.getVertex(j).getIndex() + 1;
+    f << "\n";
+  }
+  if (!f)
+    throw runtime_error(string("Cannot write file ") + filename);
+}
+
+// Writes m as an ASCII .ply file
+static void writePly(Mesh &m, const char filename[]) {
+  ofstream f(filename);
+  f << "ply\nformat ascii 1.0\nelement vertex " << m.getNumVertices()
+    << "\nproperty float x\nproperty float y\nproperty float z\n"
+    << "element face " << m.getNumFaces()
+    << "\nproperty list uchar int vertex_indices\nend_header\n";
+  f.precision(9);
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    const Cvec3 p = m.getVertex(i).getPosition();
+    f << p[0] << " " << p[1] << " " << p[2] << "\n";
+  }
+  for (int i = 0; i < m.getNumFaces(); ++i) {
+    const Mesh::Face face = m.getFace(i);
+    f << face.getNumVertices();
+    for (int j = 0; j < face.getNumVertices(); ++j)
+      f << " " << face.getVertex(j).getIndex();
+    f << "\n";
+  }
+  if (!f)
+    throw runtime_error(string("Cannot write file ") + filename);
+}
+
+// The std::map based edge matching that init_topology__ used to do, run on
+// the faces of an already loaded mesh. Returns the halfedge pair of each edge.
+static vector<Cvec<int, 2>> mapTopology(Mesh &m) {
+  map<pair<int, int>, Cvec<int, 2>> E;
+  for (int i = 0; i < m.getNumFaces(); ++i) {
+    const Mesh::Face face = m.getFace(i);
+    const int n = face.getNumVertices();
+    for (int j = 0; j < n; ++j) {
+      const int vj = i | (j << 28);
+      pair<int, int> e(face.getVertex(j).getIndex(),
+                       face.getVertex((j + 1) % n).getIndex());
+      if (e.first < e.second)
+        swap(e.first, e.second);
+      if (E.find(e) == E.end())
+        E[e] = Cvec<int, 2>(vj, -1);
+      else
+        E[e][1] = vj;
+    }
+  }
+  vector<Cvec<int, 2>> edges;
+  edges.reserve(E.size());
+  for (map<pair<int, int>, Cvec<int, 2>>::iterator i = E.begin(); i != E.end();
+       ++i)
+    edges.push_back(i->second);
+  return edges;
+}
+
+// Parses a .mesh file the way Mesh::load does, without building anything
+static void parseOnly(const char filename[]) {
+  ifstream f(filename);
+  int nv, nt, nq;
+  f >> nv >> nt >> nq;
+  vector<double> p(3 * nv);
+  vector<int> idx(3 * nt + 4 * nq);
+  for (size_t i = 0; i < p.size(); ++i)
+    f >> p[i];
+  for (size_t i = 0; i < idx.size(); ++i)
+    f >> idx[i];
+}
+
+static void benchLoad(int level) {
+  const char *filename = "/tmp/meshbench-bunny.mesh";
+  {
+    Mesh m;
+    m.load("bunny.mesh");
+    for (int i = 0; i < level; ++i)
+      catmullClark(m);
+    writeMesh(m, filename);
+  }
+  Mesh serial, parallel;
+  parallel.setParallel();
+  const double t0 = nowSeconds();
+  serial.load(filename);
+  const double t1 = nowSeconds();
+  parallel.load(filename);
+  const double t2 = nowSeconds();
+  parseOnly(filename);
+  const double t3 = nowSeconds();
+  const vector<Cvec<int, 2>> edges = mapTopology(serial);
+  const double t4 = nowSeconds();
+
+  // Binary files with and without stored topology differ on load only by
+  // the edge matching, which isolates its cost
+  const char *withTopology = "/tmp/meshbench-bunny.bmesh";
+  const char *noTopology = "/tmp/meshbench-bunny-notopo.bmesh";
+  serial.saveBinary(withTopology);
+  serial.saveBinary(noTopology, false);
+  Mesh a, b;
+  const double t5 = nowSeconds();
+  a.load(withTopology);
+  const double t6 = nowSeconds();
+  b.load(noTopology);
+  const double t7 = nowSeconds();
+
+  if (!sameMesh(serial, parallel) || !sameMesh(serial, b))
+    throw runtime_error("edge matching differs between load paths");
+  if ((int)edges.size() != serial.getNumEdges())
+    throw runtime_error("edge count differs from std::map matching");
+  for (int i = 0; i < serial.getNumEdges(); ++i) {
+    const Mesh::Edge e = serial.getEdge(i);
+    for (int j = 0; j < 2; ++j) {
+      if (e.getFace(j).f_ != (edges[i][j] & ((1 << 28) - 1)))
+        throw runtime_error("edges differ from std::map matching");
+    }
+  }
+
+  const double sorted = (t7 - t6) - (t6 - t5), mapped = t4 - t3;
+  printf("bunny level %d: %d vertices, %d faces, %d edges, threads: %d\n",
+         level, serial.getNumVertices(), serial.getNumFaces(),
+         serial.getNumEdges(), ThreadPool::shared().getNumThreads());
+  printf("load() serial:           %8.1f ms\n", (t1 - t0) * 1e3);
+  printf("load() parallel:         %8.1f ms\n", (t2 - t1) * 1e3);
+  printf("radix sort edge matching:%8.1f ms\n", sorted * 1e3);
+  printf("std::map edge matching:  %8.1f ms (%.1fx slower)\n", mapped * 1e3,
+         mapped / sorted);
+  printf("old load() estimate:     %8.1f ms (ifstream >> plus std::map, "
+         "%.2fx slower)\n",
+         (t4 - t2) * 1e3, (t4 - t2) / (t1 - t0));
+  remove(filename);
+  remove(withTopology);
+  remove(noTopology);
+}
+
+// Copies the binary mesh file from to to with the halfedge code at offset at
+// bytes from its end replaced by code, and checks that loading the copy
+// throws and leaves m as it was
+static void checkCorruptLoad(Mesh &m, const char from[], const char to[],
+                             const size_t at, const Mesh::halfedge_code code) {
+  ifstream in(from, ios::binary);
+  string bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  memcpy(&bytes[bytes.size() - at], &code, sizeof(code));
+  ofstream(to, ios::binary).write(bytes.data(), bytes.size());
+  const Mesh before(m);
+  bool thrown = false;
+  try {
+    m.load(to);
+  } catch (const runtime_error &) {
+    thrown = true;
+  }
+  Mesh copy(before);
+  if (!thrown || !sameMesh(m, copy))
+    throw runtime_error("corrupt binary mesh file loaded");
+  remove(to);
+}
+
+static void benchBinaryLoad(int level) {
+  const char *text = "/tmp/meshbench-bunny.mesh";
+  const char *binary = "/tmp/meshbench-bunny.bmesh";
+  const char *noTopology = "/tmp/meshbench-bunny-notopo.bmesh";
+  const char *levels = "/tmp/meshbench-bunny-levels.bmesh";
+  {
+    Mesh m;
+    m.load("bunny.mesh");
+    m.saveBinary(levels);
+    for (int i = 0; i < level; ++i) {
+      catmullClark(m);
+      m.saveBinary(levels, true, true);
+    }
+    writeMesh(m, text);
+  }
+  // the text file is normalized again on load, so convert from what it gives
+  Mesh fromText;
+  double t0 = nowSeconds();
+  fromText.load(text);
+  double t1 = nowSeconds();
+  const double textTime = t1 - t0;
+  fromText.saveBinary(binary);
+  fromText.saveBinary(noTopology, false);
+
+  Mesh a, b, c;
+  t0 = nowSeconds();
+  a.load(binary);
+  t1 = nowSeconds();
+  const double binaryTime = t1 - t0;
+  b.load(noTopology);
+  const double noTopologyTime = nowSeconds() - t1;
+  t0 = nowSeconds();
+  c.loadBinary(levels, level);
+  const double levelTime = nowSeconds() - t0;
+  if (!sameMesh(fromText, a) || !sameMesh(fromText, b))
+    throw runtime_error("binary mesh differs from text mesh");
+
+  // Out of range and inconsistent codes, counted back from the end of the
+  // files: faces, then vertex halfedges, then edges with topology
+  const char *corrupt = "/tmp/meshbench-corrupt.bmesh";
+  const size_t code = sizeof(Mesh::halfedge_code);
+  const size_t nv = a.getNumVertices(), ne = a.getNumEdges();
+  const size_t edges = 2 * code * ne, faces = (4 * sizeof(int) + 4 * code) *
+                                                  a.getNumFaces();
+  const size_t halfedges = code * nv + edges;
+  checkCorruptLoad(a, noTopology, corrupt, 4 * sizeof(int) * a.getNumFaces(),
+                   -3);                                           // vertex
+  checkCorruptLoad(a, binary, corrupt, halfedges + faces, nv);    // vertex
+  checkCorruptLoad(a, binary, corrupt, halfedges + faces - 4 * sizeof(int),
+                   ne);                                           // edge
+  checkCorruptLoad(a, binary, corrupt, halfedges, -7);            // halfedge
+  checkCorruptLoad(a, binary, corrupt, edges, a.getNumFaces());   // halfedge
+  checkCorruptLoad(a, binary, corrupt, edges - code, 1);          // halfedge
+
+  printf("bunny level %d: %d vertices, %d faces\n", level,
+         fromText.getNumVertices(), fromText.getNumFaces());
+  printf("text load():                 %8.1f ms\n", textTime * 1e3);
+  printf("binary load(), topology:     %8.1f ms (%.1fx)\n", binaryTime * 1e3,
+         textTime / binaryTime);
+  printf("binary load(), no topology:  %8.1f ms (%.1fx)\n",
+         noTopologyTime * 1e3, textTime / noTopologyTime);
+  printf("binary level %d of %d:         %8.1f ms\n", level,
+         Mesh::getNumBinaryLevels(levels), levelTime * 1e3);
+  remove(text);
+  remove(binary);
+  remove(noTopology);
+  remove(levels);
+}
+
+static void benchParse(int level) {
+  const char *files[] = {"/tmp/meshbench-bunny.mesh", "/tmp/meshbench-bunny.obj",
+                         "/tmp/meshbench-bunny.ply"};
+  {
+    Mesh m;
+    m.load("bunny.mesh");
+    for (int i = 0; i < level; ++i)
+      catmullClark(m);
+    writeMesh(m, files[0]);
+    writeObj(m, files[1]);
+    writePly(m, files[2]);
+  }
+  printf("bunny level %d, threads: %d\n", level,
+         ThreadPool::shared().getNumThreads());
+  const double t0 = nowSeconds();
+  parseOnly(files[0]);
+  printf("ifstream >> parsing alone: %8.1f ms\n", (nowSeconds() - t0) * 1e3);
+  printf("%-6s %12s %12s\n", "format", "load() ms", "parallel ms");
+  Mesh reference;
+  reference.load(files[0]);
+  for (int i = 0; i < 3; ++i) {
+    Mesh serial, parallel;
+    parallel.setParallel();
+    const double t1 = nowSeconds();
+    serial.load(files[i]);
+    const double t2 = nowSeconds();
+    parallel.load(files[i]);
+    const double t3 = nowSeconds();
+    if (!sameMesh(reference, serial) || !sameMesh(reference, parallel))
+      throw runtime_error(string("mesh differs when read from ") + files[i]);
+    printf("%-6s %12.1f %12.1f\n", strrchr(files[i], '.') + 1,
+           (t2 - t1) * 1e3, (t3 - t2) * 1e3);
+    remove(files[i]);
+  }
+}
+
+// Compares the triangle soup drawn by asst9 before with indexed,
+// cache-optimized triangles, as makeMeshGeometry() in asst9.cpp uploads them
+// through makeSplitIndexedGeometryPN()
+static void benchExport(int maxLevel) {
+  const int vertexBytes = 6 * sizeof(float); // VertexPN
+  Mesh m;
+  m.load("bunny.mesh");
+  printf("%5s %9s %10s %10s %10s %8s %8s %8s\n", "level", "triangles",
+         "soup KB", "indexed KB", "saved", "ACMR in", "ACMR opt", "opt ms");
+  for (int level = 0; level <= maxLevel; ++level) {
+    if (level > 0)
+      catmullClark(m);
+    vector<unsigned> indices;
+    getMeshTriangles(m, indices);
+    const int nv = m.getNumVertices();
+    const double acmr = computeAcmr(indices, nv);
+    const double t0 = nowSeconds();
+    optimizeVertexCache(indices, nv);
+    const double t1 = nowSeconds();
+
+    vector<unsigned> sorted(indices), original;
+    getMeshTriangles(m, original);
+    sort(sorted.begin(), sorted.end());
+    sort(original.begin(), original.end());
+    if (sorted != original)
+      throw runtime_error("optimizeVertexCache lost or added indices");
+
+    const double soup = double(indices.size()) * vertexBytes;
+    const double indexed =
+        double(nv) * vertexBytes +
+        double(indices.size()) * (nv <= 0x10000 ? 2 : 4);
+    printf("%5d %9d %10.0f %10.0f %9.1fx %8.3f %8.3f %8.1f\n", level,
+           int(indices.size() / 3), soup / 1024, indexed / 1024,
+           soup / indexed, acmr, computeAcmr(indices, nv), (t1 - t0) * 1e3);
+  }
+  printf("(soup ACMR is 3.000: every corner is its own vertex)\n");
+}
+
+// Vertex normals the way asst9 computed them through the iterators: the
+// average of the unit normals of the incident faces
+static void iteratorNormals(Mesh &m) {
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    const Mesh::Vertex v = m.getVertex(i);
+    Cvec3 n;
+    int count = 0;
+    Mesh::VertexIterator it(v.getIterator()), it0(it);
+    do {
+      n += it.getFace().getNormal();
+      ++count;
+    } while (++it != it0);
+    v.setNormal(n / count);
+  }
+}
+
+// Straightforward scatter of area-weighted face normals, as a reference for
+// Mesh::computeNormals()
+static vector<Cvec3> scatterNormals(Mesh &m) {
+  vector<Cvec3> n(m.getNumVertices());
+  for (int i = 0; i < m.getNumFaces(); ++i) {
+    const Mesh::Face f = m.getFace(i);
+    const Cvec3 p0 = f.getVertex(0).getPosition(),
+                p1 = f.getVertex(1).getPosition(),
+                p2 = f.getVertex(2).getPosition();
+    const Cvec3 fn = f.getNumVertices() == 3
+                         ? cross(p1 - p0, p2 - p0)
+                         : cross(p2 - p0, f.getVertex(3).getPosition() - p1);
+    for (int j = 0; j < f.getNumVertices(); ++j)
+      n[f.getVertex(j).getIndex()] += fn;
+  }
+  for (size_t i = 0; i < n.size(); ++i)
+    n[i] /= sqrt(norm2(n[i]));
+  return n;
+}
+
+static void benchNormals(int maxLevel) {
+  Mesh serial, parallel;
+  serial.load("bunny.mesh");
+  parallel.load("bunny.mesh");
+  parallel.setParallel();
+  printf("threads: %d\n", ThreadPool::shared().getNumThreads());
+  printf("%5s %9s %12s %12s %12s %10s\n", "level", "vertices", "iterator ms",
+         "kernel ms", "parallel ms", "max angle");
+  for (int level = 0; level <= maxLevel; ++level) {
+    if (level > 0) {
+      catmullClark(serial);
+      catmullClark(parallel);
+    }
+    long unused;
+    const double t0 = timeIt([&] { iteratorNormals(serial); return 0L; },
+                             unused);
+    vector<Cvec3> averaged(serial.getNumVertices());
+    for (int i = 0; i < serial.getNumVertices(); ++i)
+      averaged[i] = serial.getVertex(i).getNormal();
+    const double t1 = timeIt([&] { serial.computeNormals(); return 0L; },
+                             unused);
+    const double t2 = timeIt([&] { parallel.computeNormals(); return 0L; },
+                             unused);
+
+    const vector<Cvec3> reference = scatterNormals(serial);
+    double maxAngle = 0;
+    for (int i = 0; i < serial.getNumVertices(); ++i) {
+      const Cvec3 a = serial.getVertex(i).getNormal(),
+                  b = parallel.getVertex(i).getNormal();
+      for (int j = 0; j < 3; ++j) {
+        if (a[j] != b[j] || a[j] != reference[i][j])
+          throw runtime_error("computeNormals differs from the reference");
+      }
+      maxAngle = max(maxAngle,
+                     acos(min(1.0, dot(a, normalize(averaged[i])))));
+    }
+    printf("%5d %9d %12.2f %12.2f %12.2f %9.2fd\n", level,
+           serial.getNumVertices(), t0 * 1e3, t1 * 1e3, t2 * 1e3,
+           maxAngle * 180 / M_PI);
+  }
+  printf("(max angle: largest change from the averaged unit face normals)\n");
+}
+
+// Largest distance between the positions of the first n vertices of a and b
+static double maxDistance(Mesh &a, Mesh &b, int n) {
+  double d = 0;
+  for (int i = 0; i < n; ++i)
+    d = max(d, sqrt(norm2(a.getVertex(i).getPosition() -
+                          b.getVertex(i).getPosition())));
+  return d;
+}
+
+static void benchStencils(int level) {
+  Mesh control;
+  control.load("bunny.mesh");
+  Mesh refined;
+  double t0 = nowSeconds();
+  const SubdivisionStencils stencils(control, level, refined, true);
+  const double buildTime = nowSeconds() - t0;
+  printf("bunny level %d: %d vertices, %ld weights (%.1f per vertex), "
+         "threads: %d\n",
+         level, stencils.getNumVertices(), stencils.getNumWeights(),
+         double(stencils.getNumWeights()) / stencils.getNumVertices(),
+         ThreadPool::shared().getNumThreads());
+  printf("stencil build:           %8.1f ms\n", buildTime * 1e3);
+
+  // Bend the control mesh, so that nothing is left over from the positions
+  // the stencils were built with
+  for (int i = 0; i < control.getNumVertices(); ++i) {
+    const Mesh::Vertex v = control.getVertex(i);
+    const Cvec3 p = v.getPosition();
+    v.setPosition(p + Cvec3(0.2 * sin(2 * p[1]), 0, 0));
+  }
+  long unused;
+  const double tSubdivide = timeIt([&] {
+    Mesh m(control);
+    for (int i = 0; i < level; ++i)
+      catmullClark(m);
+    return 0L;
+  }, unused);
+  Mesh reference(control);
+  for (int i = 0; i < level; ++i)
+    catmullClark(reference);
+
+  const double tRefine =
+      timeIt([&] { stencils.refine(control, refined); return 0L; }, unused);
+  const double refineError =
+      maxDistance(refined, reference, refined.getNumVertices());
+  refined.setParallel();
+  const double tParallel =
+      timeIt([&] { stencils.refine(control, refined); return 0L; }, unused);
+  if (maxDistance(refined, reference, refined.getNumVertices()) > 1e-5)
+    throw runtime_error("stencils differ from subdivide()");
+  // Dirty tracking is held off across the threads, leaving all the normals
+  // to the next updateNormals()
+  refined.trackDirtyVertices();
+  refined.computeNormals();
+  stencils.refine(control, refined);
+  vector<pair<int, int>> spans;
+  refined.updateNormals(spans);
+  if (!refined.isTrackingDirtyVertices() || spans.size() != 1 ||
+      spans[0] != make_pair(0, refined.getNumVertices()))
+    throw runtime_error("refine() left dirty tracking behind");
+  refined.trackDirtyVertices(false);
+  const double tLimit =
+      timeIt([&] { stencils.limit(control, refined); return 0L; }, unused);
+
+  // The limit points are where the vertices go with more subdivision, and
+  // the limit normals should agree with the normals of the refined mesh
+  Mesh finer(reference);
+  for (int i = 0; i < 3; ++i)
+    catmullClark(finer);
+  finer.computeNormals();
+  double maxAngle = 0;
+  for (int i = 0; i < refined.getNumVertices(); ++i) {
+    maxAngle = max(maxAngle, acos(min(1.0, dot(refined.getVertex(i).getNormal(),
+                                               finer.getVertex(i).getNormal()))));
+  }
+  printf("catmullClark + subdivide:%8.1f ms\n", tSubdivide * 1e3);
+  printf("stencil refine:          %8.1f ms (%.1fx), max error %.2g\n",
+         tRefine * 1e3, tSubdivide / tRefine, refineError);
+  printf("stencil refine parallel: %8.1f ms (%.1fx)\n", tParallel * 1e3,
+         tSubdivide / tParallel);
+  printf("limit positions+normals: %8.1f ms, %.2g from level %d, "
+         "normals within %.2fd\n",
+         tLimit * 1e3, maxDistance(refined, finer, refined.getNumVertices()),
+         level + 3, maxAngle * 180 / M_PI);
+}
+
+static void benchLod(int level) {
+  Mesh m;
+  m.load("bunny.mesh");
+  for (int i = 0; i < level; ++i)
+    catmullClark(m);
+  vector<int> budgets;
+  const int numTriangles = getNumMeshTriangles(m);
+  for (int n = numTriangles / 2; n >= 100; n /= 2)
+    budgets.push_back(n);
+  const double t0 = nowSeconds();
+  MeshSimplifier s(m);
+  const double t1 = nowSeconds();
+  if (s.getNumTriangles() != numTriangles)
+    throw runtime_error("simplifier split the faces differently");
+  printf("bunny level %d: %d faces, %d triangles, setup %.1f ms\n", level,
+         m.getNumFaces(), numTriangles, (t1 - t0) * 1e3);
+  printf("%9s %9s %9s %10s\n", "budget", "triangles", "vertices", "ms");
+  for (size_t i = 0; i < budgets.size(); ++i) {
+    const double t2 = nowSeconds();
+    s.simplify(budgets[i]);
+    Mesh lod;
+    s.getMesh(lod);
+    const double t3 = nowSeconds();
+    if (!lod.isManifold() || lod.hasBoundary())
+      throw runtime_error("simplification changed the topology");
+    printf("%9d %9d %9d %10.1f\n", budgets[i], getNumMeshTriangles(lod),
+           lod.getNumVertices(), (t3 - t2) * 1e3);
+  }
+}
+
+// Brute force versions of the MeshBvh queries, on triangles split the same
+// way
+static double bruteRay(Mesh &m, const Cvec3 &o, const Cvec3 &d) {
+  double best = 1e300;
+  for (int i = 0; i < m.getNumFaces(); ++i) {
+    const Mesh::Face f = m.getFace(i);
+    for (int j = 1; j + 1 < f.getNumVertices(); ++j) {
+      const Cvec3 p0 = f.getVertex(0).getPosition();
+      const Cvec3 e1 = f.getVertex(j).getPosition() - p0,
+                  e2 = f.getVertex(j + 1).getPosition() - p0;
+      const Cvec3 p = cross(d, e2), s = o - p0, q = cross(s, e1);
+      const double det = dot(e1, p);
+      if (det == 0)
+        continue;
+      const double u = dot(s, p) / det, v = dot(d, q) / det,
+                   t = dot(e2, q) / det;
+      if (u >= 0 && v >= 0 && u + v <= 1 && t >= 0)
+        best = min(best, t);
+    }
+  }
+  return best;
+}
+
+// Distance of p to the nearest vertex of m, an upper bound on the distance
+// to the surface
+static double nearestVertex(Mesh &m, const Cvec3 &p) {
+  double best = 1e300;
+  for (int i = 0; i < m.getNumVertices(); ++i)
+    best = min(best, norm2(m.getVertex(i).getPosition() - p));
+  return sqrt(best);
+}
+
+static void benchBvh(int level) {
+  Mesh m;
+  m.load("bunny.mesh");
+  for (int i = 0; i < level; ++i)
+    catmullClark(m);
+  double t0 = nowSeconds();
+  MeshBvh bvh(m);
+  const double buildTime = nowSeconds() - t0;
+  printf("bunny level %d: %d faces, %d triangles, %d nodes\n", level,
+         m.getNumFaces(), bvh.getNumTriangles(), bvh.getNumNodes());
+  printf("build:           %8.1f ms\n", buildTime * 1e3);
+
+  // Rays from a sphere around the bunny toward points around it, and
+  // query points at about the distance of its surface from the center
+  srand(175);
+  const int numRays = 20000;
+  vector<Cvec3> origins(numRays), directions(numRays);
+  for (int i = 0; i < numRays; ++i) {
+    Cvec3 a, b;
+    for (int k = 0; k < 3; ++k) {
+      a[k] = rand() / (RAND_MAX + 1.0) - 0.5;
+      b[k] = rand() / (RAND_MAX + 1.0) - 0.5;
+    }
+    origins[i] = normalize(a) * 3;
+    directions[i] = b * 2 - origins[i];
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1) {
+      // bend the bunny and refit
+      for (int i = 0; i < m.getNumVertices(); ++i) {
+        const Mesh::Vertex v = m.getVertex(i);
+        const Cvec3 p = v.getPosition();
+        v.setPosition(p + Cvec3(0.2 * sin(2 * p[1]), 0, 0));
+      }
+      t0 = nowSeconds();
+      bvh.refit(m);
+      printf("refit:           %8.1f ms\n", (nowSeconds() - t0) * 1e3);
+    }
+    int hits = 0;
+    MeshBvh::Hit hit;
+    t0 = nowSeconds();
+    for (int i = 0; i < numRays; ++i)
+      hits += bvh.intersect(origins[i], directions[i], hit);
+    const double rayTime = (nowSeconds() - t0) / numRays;
+    t0 = nowSeconds();
+    for (int i = 0; i < numRays; ++i)
+      bvh.closestPoint(origins[i] * (0.25 + 0.05 * (i % 4)), hit);
+    const double pointTime = (nowSeconds() - t0) / numRays;
+    vector<int> faces;
+    t0 = nowSeconds();
+    for (int i = 0; i < numRays; ++i) {
+      const Cvec3 c = origins[i] * 0.2;
+      bvh.overlap(c - Cvec3(0.05), c + Cvec3(0.05), faces);
+    }
+    const double boxTime = (nowSeconds() - t0) / numRays;
+    printf("%s ray %.2f us (%d%% hit), closest point %.2f us, box %.2f us\n",
+           pass == 0 ? "built: " : "refit: ", rayTime * 1e6,
+           hits * 100 / numRays, pointTime * 1e6, boxTime * 1e6);
+
+    // check a few queries against brute force
+    for (int i = 0; i < 50; ++i) {
+      const double t = bruteRay(m, origins[i], directions[i]);
+      const bool found = bvh.intersect(origins[i], directions[i], hit);
+      if (found != (t < 1e300) || (found && abs(hit.distance - t) > 1e-9))
+        throw runtime_error("ray query differs from brute force");
+      if (found) {
+        Cvec3 p;
+        for (int k = 0; k < 3; ++k)
+          p += m.getVertex(hit.vertices[k]).getPosition() * hit.barycentric[k];
+        if (norm(p - hit.point) > 1e-9)
+          throw runtime_error("ray hit barycentrics are off");
+      }
+      const Cvec3 q = origins[i] * 0.3;
+      bvh.closestPoint(q, hit);
+      if (hit.distance > nearestVertex(m, q) + 1e-12)
+        throw runtime_error("closest point is further than a vertex");
+      faces.clear();
+      bvh.overlap(hit.point - Cvec3(1e-6), hit.point + Cvec3(1e-6), faces);
+      if (find(faces.begin(), faces.end(), hit.face) == faces.end())
+        throw runtime_error("box overlap misses the closest face");
+    }
+  }
+}
+
+// Copies of a mesh share its topology, so instancing the bunny costs only
+// the per-vertex attributes. Checks that instances stay independent.
+static void benchInstances(int level) {
+  Mesh m;
+  m.load("bunny.mesh");
+  for (int i = 0; i < level; ++i)
+    catmullClark(m);
+  const int nv = m.getNumVertices(), ne = m.getNumEdges(),
+            nf = m.getNumFaces();
+  const double topologyBytes = 8.0 * sizeof(int) * nf +
+                               2.0 * sizeof(int) * ne + sizeof(int) * nv;
+  const double attributeBytes = sizeof(Cvec3) * (2.0 * nv + nv + ne + nf);
+  printf("bunny level %d: %d vertices, %d faces\n", level, nv, nf);
+  printf("topology per mesh:   %8.2f MB, shared by all copies\n",
+         topologyBytes / (1 << 20));
+  printf("attributes per copy: %8.2f MB\n", attributeBytes / (1 << 20));
+
+  const int N = 16;
+  vector<Mesh> instances;
+  long unused;
+  const double tCopy = timeIt([&] {
+    instances.assign(N, m);
+    return 0L;
+  }, unused);
+  const double tMove = timeIt([&] {
+    Mesh a(std::move(instances.back()));
+    instances.back() = std::move(a);
+    return 0L;
+  }, unused);
+  printf("copy:                %8.3f ms per instance\n", tCopy / N * 1e3);
+  printf("move:                %8.3f us\n", tMove * 1e6);
+
+  for (int i = 0; i < N; ++i) {
+    if (!instances[i].sharesTopology(m) || !sameMesh(instances[i], m))
+      throw runtime_error("copy does not share the original's topology");
+  }
+  // Moving the positions of an instance leaves the others alone, and
+  // subdividing it gives it a topology of its own
+  Mesh &a = instances[0];
+  a.getVertex(0).setPosition(Cvec3(1, 2, 3));
+  if (norm2(m.getVertex(0).getPosition() - Cvec3(1, 2, 3)) == 0 ||
+      sameMesh(a, m))
+    throw runtime_error("instances share their positions");
+  a = m;
+  catmullClark(a);
+  Mesh b(m);
+  catmullClark(b);
+  if (a.sharesTopology(m) || !sameMesh(a, b) ||
+      m.getNumVertices() != nv || !sameMesh(m, instances[1]))
+    throw runtime_error("subdividing an instance changed the original");
+  Mesh c(std::move(a));
+  if (a.getNumVertices() != 0 || a.getNumFaces() != 0 || !sameMesh(c, b))
+    throw runtime_error("move did not transfer the mesh");
+  printf("instances check out\n");
+}
+
+// Mean distance between the indices of neighboring vertices, over every
+// one-ring: a rough measure of how far apart in memory neighbors live
+static double meanNeighborDistance(Mesh &m) {
+  double sum = 0;
+  long n = 0;
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    const int *rv = m.getRingVertices(i);
+    for (int j = 0, k = m.getRingSize(i); j < k; ++j, ++n)
+      sum += abs(rv[j] - i);
+  }
+  return sum / n;
+}
+
+// Sets out[i] to the mean of the neighbors of vertex i, read through the raw
+// one-ring arrays: the neighbor gather of smoothing and the like, which
+// reads positions all over the mesh unless neighbors are close in memory
+static void neighborMeans(Mesh &m, vector<Cvec3> &out) {
+  out.resize(m.getNumVertices());
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    const int *rv = m.getRingVertices(i), n = m.getRingSize(i);
+    Cvec3 sum;
+    for (int j = 0; j < n; ++j)
+      sum += m.getVertex(rv[j]).getPosition();
+    out[i] = sum / n;
+  }
+}
+
+// One-ring walks, neighbor gathers and normals on a subdivided bunny, in
+// subdivision order and after Mesh::reorder()
+static void benchReorder(int level) {
+  Mesh m;
+  m.load("bunny.mesh");
+  for (int i = 0; i < level; ++i)
+    catmullClark(m);
+  m.cacheOneRings();
+  Mesh r(m);
+  const double t0 = nowSeconds();
+  const vector<int> newIndex = r.reorder();
+  const double t1 = nowSeconds();
+  printf("bunny level %d: %d vertices, reorder() %.1f ms\n", level,
+         m.getNumVertices(), (t1 - t0) * 1e3);
+
+  if (r.getNumVertices() != m.getNumVertices() ||
+      r.getNumFaces() != m.getNumFaces() ||
+      r.getNumEdges() != m.getNumEdges() || !r.isManifold() ||
+      r.hasBoundary())
+    throw runtime_error("reorder() changed the mesh");
+  long ringTotal = 0;
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    const int *a = m.getRingVertices(i), *b = r.getRingVertices(newIndex[i]);
+    const int n = m.getRingSize(i);
+    ringTotal += n;
+    if (r.getRingSize(newIndex[i]) != n ||
+        norm2(m.getVertex(i).getPosition() -
+              r.getVertex(newIndex[i]).getPosition()) != 0)
+      throw runtime_error("reorder() moved a vertex");
+    // same ring, possibly starting elsewhere
+    int k = 0;
+    while (k < n && b[k] != newIndex[a[0]])
+      ++k;
+    for (int j = 0; j < n; ++j) {
+      if (k == n || b[(j + k) % n] != newIndex[a[j]])
+        throw runtime_error("reorder() changed a one-ring");
+    }
+  }
+
+  long unused;
+  Mesh *meshes[2] = {&m, &r};
+  double tIter[2], tCached[2], tGather[2], tNormals[2];
+  vector<Cvec3> means[2];
+  for (int i = 0; i < 2; ++i) {
+    Mesh &x = *meshes[i];
+    tIter[i] = timeIt([&] { return ringSumIterator(x); }, unused);
+    tCached[i] = timeIt([&] { return ringSumCached(x); }, unused);
+    tGather[i] =
+        timeIt([&] { neighborMeans(x, means[i]); return 0L; }, unused);
+    tNormals[i] = timeIt([&] { x.computeNormals(); return 0L; }, unused);
+  }
+  double maxDiff = 0, maxMeanDiff = 0;
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    maxDiff = max(maxDiff, sqrt(norm2(m.getVertex(i).getNormal() -
+                                      r.getVertex(newIndex[i]).getNormal())));
+    maxMeanDiff = max(maxMeanDiff,
+                      sqrt(norm2(means[0][i] - means[1][newIndex[i]])));
+  }
+  if (maxDiff > 1e-9 || maxMeanDiff > 1e-12)
+    throw runtime_error("normals differ after reorder()");
+
+  printf("%-26s %12s %12s %8s\n", "", "subdivided", "reordered", "speedup");
+  printf("%-26s %12.1f %12.1f\n", "mean neighbor distance",
+         meanNeighborDistance(m), meanNeighborDistance(r));
+  printf("%-26s %12.1f %12.1f %8.2f\n", "VertexIterator Mvis/s",
+         ringTotal / tIter[0] * 1e-6, ringTotal / tIter[1] * 1e-6,
+         tIter[0] / tIter[1]);
+  // The cached rings are rebuilt in the new order with the new topology,
+  // but RingIterator reads the ring arrays alone, front to back, whatever
+  // the order: it only shows the loop over the valences, which in Morton
+  // order no longer come in runs as subdivide() leaves them, costing a few
+  // more mispredicted loop exits. The gather below is what reorder() is for
+  printf("%-26s %12.1f %12.1f %8.2f\n", "RingIterator Mvis/s",
+         ringTotal / tCached[0] * 1e-6, ringTotal / tCached[1] * 1e-6,
+         tCached[0] / tCached[1]);
+  printf("%-26s %12.1f %12.1f %8.2f\n", "neighbor gather Mvis/s",
+         ringTotal / tGather[0] * 1e-6, ringTotal / tGather[1] * 1e-6,
+         tGather[0] / tGather[1]);
+  printf("%-26s %12.1f %12.1f %8.2f\n", "computeNormals() ms",
+         tNormals[0] * 1e3, tNormals[1] * 1e3, tNormals[0] / tNormals[1]);
+}
+
+// Streams the subdivided bunny to a chunk file patch by patch and checks the
+// chunks against subdivide() in memory: every face once, with the same
+// vertices, and every vertex bit for bit at the same position, also where
+// patches meet
+static void benchOutOfCore(int level) {
+  const char *filename = "/tmp/meshbench-bunny.chunks";
+  Mesh control;
+  control.load("bunny.mesh");
+  const long long patchFaces =
+      (long long)control.getNumFaces() << (2 * level) >> 4;
+  double t0 = nowSeconds();
+  ChunkedSubdivision::write(control, level, filename, patchFaces);
+  const double streamTime = nowSeconds() - t0;
+  t0 = nowSeconds();
+  Mesh m(control);
+  for (int i = 0; i < level; ++i)
+    catmullClark(m);
+  const double memoryTime = nowSeconds() - t0;
+
+  const ChunkedSubdivision chunks(filename);
+  if (chunks.getNumFaces() != m.getNumFaces() ||
+      chunks.getNumVertices() != m.getNumVertices())
+    throw runtime_error("chunk file has the wrong size");
+  vector<char> faceSeen(m.getNumFaces(), 0);
+  vector<int> vertexSeen(m.getNumVertices(), 0);
+  ChunkedSubdivision::Chunk c;
+  long largest = 0;
+  for (int i = 0; i < chunks.getNumChunks(); ++i) {
+    chunks.readChunk(i, c);
+    largest = max(largest, (long)c.faceIds.size());
+    for (size_t j = 0; j < c.faceIds.size(); ++j) {
+      const Mesh::Face f = m.getFace(c.faceIds[j]);
+      if (faceSeen[c.faceIds[j]]++)
+        throw runtime_error("face in more than one chunk");
+      for (int k = 0; k < 4; ++k) {
+        if (c.faces[j][k] !=
+            (k < f.getNumVertices() ? f.getVertex(k).getIndex() : -1))
+          throw runtime_error("chunk face has other vertices");
+      }
+    }
+    for (size_t j = 0; j < c.vertexIds.size(); ++j) {
+      ++vertexSeen[c.vertexIds[j]];
+      if (norm2(c.positions[j] - m.getVertex(c.vertexIds[j]).getPosition()) !=
+          0)
+        throw runtime_error("chunk vertex differs from subdivide()");
+    }
+  }
+  long seam = 0;
+  for (int i = 0; i < m.getNumVertices(); ++i) {
+    if (!vertexSeen[i])
+      throw runtime_error("vertex missing from the chunks");
+    seam += vertexSeen[i] > 1;
+  }
+  if (count(faceSeen.begin(), faceSeen.end(), 0))
+    throw runtime_error("face missing from the chunks");
+  printf("bunny level %d: %d faces in %d chunks of up to %ld faces\n", level,
+         m.getNumFaces(), chunks.getNumChunks(), largest);
+  printf("in memory:  %8.1f ms\n", memoryTime * 1e3);
+  printf("streamed:   %8.1f ms (%.2fx)\n", streamTime * 1e3,
+         streamTime / memoryTime);
+  printf("%ld seam vertices, all identical to the in-memory mesh\n", seam);
+  remove(filename);
+}
+
+// Times the Catmull-Clark points through the public API against
+// Mesh::computeCatmullClarkPoints(), serial and parallel, and checks that
+// all three agree bit for bit
+static void benchPoints(int maxLevel) {
+  Mesh m;
+  m.load("bunny.mesh");
+  printf("threads: %d\n", ThreadPool::shared().getNumThreads());
+  printf("%5s %9s %10s %10s %12s %8s\n", "level", "faces", "api ms",
+         "serial ms", "parallel ms", "speedup");
+  for (int level = 0; level <= maxLevel; ++level) {
+    Mesh api(m), serial(m), parallel(m);
+    parallel.setParallel();
+    const double t0 = nowSeconds();
+    catmullClarkPoints(api);
+    const double t1 = nowSeconds();
+    serial.computeCatmullClarkPoints();
+    const double t2 = nowSeconds();
+    parallel.computeCatmullClarkPoints();
+    const double t3 = nowSeconds();
+    const auto same = [](const Cvec3 &a, const Cvec3 &b, const Cvec3 &c) {
+      return memcmp(&a, &b, sizeof(a)) == 0 && memcmp(&a, &c, sizeof(a)) == 0;
+    };
+    for (int i = 0; i < m.getNumFaces(); ++i) {
+      if (!same(api.getNewFaceVertex(api.getFace(i)),
+                serial.getNewFaceVertex(serial.getFace(i)),
+                parallel.getNewFaceVertex(parallel.getFace(i))))
+        throw runtime_error("face points differ");
+    }
+    for (int i = 0; i < m.getNumEdges(); ++i) {
+      if (!same(api.getNewEdgeVertex(api.getEdge(i)),
+                serial.getNewEdgeVertex(serial.getEdge(i)),
+                parallel.getNewEdgeVertex(parallel.getEdge(i))))
+        throw runtime_error("edge points differ");
+    }
+    for (int i = 0; i < m.getNumVertices(); ++i) {
+      if (!same(api.getNewVertexVertex(api.getVertex(i)),
+                serial.getNewVertexVertex(serial.getVertex(i)),
+                parallel.getNewVertexVertex(parallel.getVertex(i))))
+        throw runtime_error("vertex points differ");
+    }
+    printf("%5d %9d %10.2f %10.2f %12.2f %8.2f\n", level, m.getNumFaces(),
+           (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t3 - t2) * 1e3,
+           (t1 - t0) / (t3 - t2));
+    catmullClark(m);
+  }
+}
+
+// Switches between the levels of the bunny through a SubdivisionLevelCache:
+// first visits, lookups, levels after the control positions moved, and a
+// budget that only fits some of the levels. Every level is checked against
+// subdivide() from level 0.
+static void benchLevels(int maxLevel) {
+  Mesh control;
+  control.load("bunny.mesh");
+  SubdivisionLevelCache cache(control, size_t(2) << 30);
+  const auto check = [&](Mesh &m, const int level) {
+    Mesh ref(control);
+    for (int i = 0; i < level; ++i)
+      catmullClark(ref);
+    for (int i = 0; i < ref.getNumVertices(); ++i) {
+      if (norm2(m.getVertex(i).getPosition() -
+                ref.getVertex(i).getPosition()) != 0)
+        throw runtime_error("cached level differs from subdivide()");
+    }
+  };
+  printf("%5s %9s %10s %10s %10s %10s\n", "level", "faces", "first ms",
+         "lookup ms", "moved ms", "MB");
+  vector<double> first(maxLevel + 1), lookup(maxLevel + 1);
+  for (int level = 0; level <= maxLevel; ++level) {
+    double t0 = nowSeconds();
+    cache.getLevel(level);
+    first[level] = nowSeconds() - t0;
+  }
+  for (int level = maxLevel; level >= 0; --level) {
+    const double t0 = nowSeconds();
+    cache.getLevel(level);
+    lookup[level] = nowSeconds() - t0;
+  }
+  for (int level = 0; level <= maxLevel; ++level)
+    check(cache.getLevel(level), level);
+
+  // move the control vertices; every level keeps its topology
+  vector<unsigned> revision(maxLevel + 1);
+  for (int level = 0; level <= maxLevel; ++level)
+    revision[level] = cache.getRevision(level);
+  for (int i = 0; i < control.getNumVertices(); ++i) {
+    const Mesh::Vertex v = control.getVertex(i);
+    v.setPosition(v.getPosition() * 1.1 + Cvec3(0, 0.05, 0));
+  }
+  cache.setControlPositions(control);
+  for (int level = 0; level <= maxLevel; ++level) {
+    const double t0 = nowSeconds();
+    Mesh &m = cache.getLevel(level);
+    const double moved = nowSeconds() - t0;
+    if (cache.getRevision(level) == revision[level])
+      throw runtime_error("moved level kept its revision");
+    check(m, level);
+    printf("%5d %9d %10.2f %10.4f %10.2f %10.1f\n", level, m.getNumFaces(),
+           first[level] * 1e3, lookup[level] * 1e3, moved * 1e3,
+           m.getMemoryUsage() / 1048576.0);
+  }
+
+  // a budget just above the finest level drops the others, least recently
+  // used first
+  const size_t all = cache.getMemoryUsage();
+  cache.setBudget(cache.getLevel(maxLevel).getMemoryUsage() * 5 / 4);
+  int cached = 0;
+  for (int level = 0; level <= maxLevel; ++level)
+    cached += cache.isCached(level);
+  if (!cache.isCached(maxLevel) || cache.isCached(maxLevel - 1))
+    throw runtime_error("budget evicted the wrong levels");
+  printf("all levels: %.1f MB; budget %.1f MB keeps %d of them, %.1f MB\n",
+         all / 1048576.0, cache.getBudget() / 1048576.0, cached,
+         cache.getMemoryUsage() / 1048576.0);
+  check(cache.getLevel(maxLevel - 1), maxLevel - 1);
+}
+
+// Model view matrix of an eye at eye looking at target, with y up
+static Matrix4 lookAt(const Cvec3 &eye, const Cvec3 &target) {
+  const Cvec3 z = normalize(eye - target);
+  const Cvec3 x = normalize(cross(Cvec3(0, 1, 0), z)), y = cross(z, x);
+  Matrix4 e;
+  for (int i = 0; i < 3; ++i) {
+    e(i, 0) = x[i];
+    e(i, 1) = y[i];
+    e(i, 2) = z[i];
+    e(i, 3) = eye[i];
+  }
+  return inv(e);
+}
+
+// Splits the subdivided bunny into meshlets and culls them from distant,
+// near and close-up views. Checks that the meshlets hold every triangle
+// once within their limits, and that culling keeps every triangle that
+// faces the eye with a corner in the frustum.
+static void benchMeshlets(int level) {
+  Mesh m;
+  m.load("bunny.mesh");
+  for (int i = 0; i < level; ++i)
+    catmullClark(m);
+  vector<unsigned> indices;
+  getMeshTriangles(m, indices);
+  const int nt = indices.size() / 3, nv = m.getNumVertices();
+  vector<Cvec3> positions(nv);
+  double radius = 0;
+  for (int i = 0; i < nv; ++i) {
+    positions[i] = m.getVertex(i).getPosition();
+    radius = max(radius, norm(positions[i]));
+  }
+  optimizeVertexCache(indices, nv);
+  const double acmr = computeAcmr(indices, nv);
+  vector<unsigned> sorted(indices);
+  vector<Meshlet> meshlets;
+  double t0 = nowSeconds();
+  buildMeshlets(indices, positions, meshlets);
+  const double buildTime = nowSeconds() - t0;
+
+  vector<int> meshletOf(nt);
+  int maxVertices = 0, maxTriangles = 0;
+  double cones = 0, vertices = 0;
+  for (size_t i = 0; i < meshlets.size(); ++i) {
+    const Meshlet &ml = meshlets[i];
+    maxVertices = max(maxVertices, ml.numVertices);
+    maxTriangles = max(maxTriangles, ml.numIndices / 3);
+    cones += ml.coneCutoff < 1;
+    vertices += ml.numVertices;
+    for (int j = ml.firstIndex / 3; j < (ml.firstIndex + ml.numIndices) / 3;
+         ++j)
+      meshletOf[j] = i;
+  }
+  const auto triangleKeys = [](const vector<unsigned> &idx) {
+    vector<Cvec<unsigned, 3>> k(idx.size() / 3);
+    for (size_t i = 0; i < k.size(); ++i)
+      k[i] = Cvec<unsigned, 3>(idx[3 * i], idx[3 * i + 1], idx[3 * i + 2]);
+    sort(k.begin(), k.end(), [](const Cvec<unsigned, 3> &a,
+                                const Cvec<unsigned, 3> &b) {
+      return lexicographical_compare(&a[0], &a[0] + 3, &b[0], &b[0] + 3);
+    });
+    return k;
+  };
+  const vector<Cvec<unsigned, 3>> before = triangleKeys(sorted),
+                                  after = triangleKeys(indices);
+  for (int i = 0; i < nt; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      if (before[i][k] != after[i][k])
+        throw runtime_error("meshlets lost or changed triangles");
+    }
+  }
+  if (maxVertices > 64 || maxTriangles > 124)
+    throw runtime_error("meshlet over its limits");
+  printf("bunny level %d: %d triangles in %d meshlets (%.1f vertices, %.1f "
+         "triangles, %.0f%% with a cone), built in %.1f ms\n",
+         level, nt, (int)meshlets.size(), vertices / meshlets.size(),
+         double(nt) / meshlets.size(), 100 * cones / meshlets.size(),
+         buildTime * 1e3);
+  // the meshlets are drawn in the cache-optimized order, which they must
+  // not undo
+  const double meshletAcmr = computeAcmr(indices, nv);
+  if (meshletAcmr > acmr)
+    throw runtime_error("meshlets undo the vertex cache optimization");
+  printf("ACMR %.3f optimized, %.3f in meshlets\n", acmr, meshletAcmr);
+
+  const Matrix4 projection = Matrix4::makeProjection(60, 1, -0.1, -50);
+  const char *names[] = {"distant", "near", "close-up"};
+  printf("%9s %8s %8s %11s %8s\n", "view", "meshlets", "ranges",
+         "triangles", "cull us");
+  vector<int> visible;
+  vector<char> kept(meshlets.size());
+  for (int kind = 0; kind < 3; ++kind) {
+    double shown = 0, ranges = 0, drawn = 0, time = 0;
+    const int views = 16;
+    for (int view = 0; view < views; ++view) {
+      Cvec3 eye, target;
+      const double a = 2 * CS175_PI * view / views, b = 0.6 * sin(3 * a);
+      const Cvec3 dir(cos(a) * cos(b), sin(b), sin(a) * cos(b));
+      if (kind < 2) {
+        eye = dir * radius * (kind == 0 ? 3.0 : 1.4);
+      } else {
+        // just off the surface point furthest along dir
+        int best = 0;
+        for (int i = 1; i < nv; ++i) {
+          if (dot(positions[i], dir) > dot(positions[best], dir))
+            best = i;
+        }
+        target = positions[best];
+        eye = target + dir * radius * 0.2;
+      }
+      const Matrix4 MVM = lookAt(eye, target);
+      visible.clear();
+      t0 = nowSeconds();
+      cullMeshlets(meshlets, MVM, projection, visible);
+      time += nowSeconds() - t0;
+      fill(kept.begin(), kept.end(), 0);
+      for (size_t i = 0; i < visible.size(); ++i) {
+        kept[visible[i]] = 1;
+        drawn += meshlets[visible[i]].numIndices / 3;
+        ranges += i == 0 || visible[i - 1] + 1 != visible[i];
+      }
+      shown += visible.size();
+      Cvec4 planes[6];
+      getFrustumPlanes(MVM, projection, planes);
+      for (int t = 0; t < nt; ++t) {
+        const Cvec3 &p0 = positions[indices[3 * t]],
+                    &p1 = positions[indices[3 * t + 1]],
+                    &p2 = positions[indices[3 * t + 2]];
+        if (kept[meshletOf[t]] || dot(cross(p1 - p0, p2 - p0), eye - p0) <= 0)
+          continue;
+        for (int k = 0; k < 3; ++k) {
+          const Cvec4 p(positions[indices[3 * t + k]], 1);
+          bool inside = true;
+          for (int j = 0; j < 6; ++j)
+            inside = inside && dot(planes[j], p) >= 0;
+          if (inside)
+            throw runtime_error("culled a visible triangle");
+        }
+      }
+    }
+    printf("%9s %8.0f %8.0f %10.1f%% %8.1f\n", names[kind], shown / views,
+           ranges / views, 100 * drawn / (double(nt) * views),
+           time / views * 1e6);
+  }
+}
+
+// The bunny subdivided in double and in float storage: memory, kernels,
+// getting the attributes ready for vertex buffers (VertexPN for doubles,
+// plain copies of the float arrays), and how far the floats drift. Also
+// checks that switching storage, reorder() and binary files keep floats.
+static void benchStorage(int level) {
+  Mesh d, f;
+  f.setFloatStorage();
+  d.load("bunny.mesh");
+  f.load("bunny.mesh");
+  double tSubdivide[2] = {0, 0};
+  Mesh *meshes[2] = {&d, &f};
+  for (int i = 0; i < level; ++i) {
+    for (int k = 0; k < 2; ++k) {
+      const double t0 = nowSeconds();
+      meshes[k]->computeCatmullClarkPoints();
+      meshes[k]->subdivide();
+      tSubdivide[k] = nowSeconds() - t0;
+    }
+  }
+  const int nv = d.getNumVertices();
+  long unused;
+  double tNormals[2], tUpload[2];
+  for (int k = 0; k < 2; ++k) {
+    Mesh &m = *meshes[k];
+    tNormals[k] = timeIt([&] { m.computeNormals(); return 0L; }, unused);
+  }
+  vector<Cvec3f> interleaved(2 * nv); // as in VertexPN
+  tUpload[0] = timeIt([&] {
+    for (int i = 0; i < nv; ++i) {
+      const Mesh::Vertex v = d.getVertex(i);
+      const Cvec3 x = v.getPosition(), y = v.getNormal();
+      interleaved[2 * i] = Cvec3f(x[0], x[1], x[2]);
+      interleaved[2 * i + 1] = Cvec3f(y[0], y[1], y[2]);
+    }
+    return 0L;
+  }, unused);
+  vector<Cvec3f> p(nv), n(nv);
+  tUpload[1] = timeIt([&] {
+    memcpy(&p[0], f.getFloatPositions(), sizeof(Cvec3f) * nv);
+    memcpy(&n[0], f.getFloatNormals(), sizeof(Cvec3f) * nv);
+    return 0L;
+  }, unused);
+  d.compact();
+  f.compact();
+
+  double maxDistance = 0, maxAngle = 0;
+  for (int i = 0; i < nv; ++i) {
+    const Mesh::Vertex a = d.getVertex(i), b = f.getVertex(i);
+    maxDistance =
+        max(maxDistance, sqrt(norm2(a.getPosition() - b.getPosition())));
+    maxAngle = max(maxAngle,
+                   acos(min(1.0, dot(a.getNormal(), b.getNormal()) /
+                                     sqrt(norm2(b.getNormal())))));
+  }
+  printf("bunny level %d: %d vertices\n", level, nv);
+  printf("%-26s %12s %12s\n", "", "double", "float");
+  printf("%-26s %12.1f %12.1f\n", "compact mesh MB",
+         d.getMemoryUsage() / 1048576.0, f.getMemoryUsage() / 1048576.0);
+  printf("%-26s %12.1f %12.1f\n", "subdivide() last level ms",
+         tSubdivide[0] * 1e3, tSubdivide[1] * 1e3);
+  printf("%-26s %12.2f %12.2f\n", "computeNormals() ms", tNormals[0] * 1e3,
+         tNormals[1] * 1e3);
+  printf("%-26s %12.2f %12.2f\n", "vertex buffer data ms", tUpload[0] * 1e3,
+         tUpload[1] * 1e3);
+  printf("float drift: %.2g in position (unit RMS radius), %.2gd in normal\n",
+         maxDistance, maxAngle * 180 / M_PI);
+
+  // back to doubles and to floats again, which is exact
+  Mesh g(f);
+  g.setFloatStorage(false);
+  if (g.hasFloatStorage() || g.getFloatPositions() != NULL)
+    throw runtime_error("setFloatStorage(false) kept floats");
+  g.setFloatStorage();
+  if (memcmp(g.getFloatPositions(), f.getFloatPositions(),
+             sizeof(Cvec3f) * nv) ||
+      memcmp(g.getFloatNormals(), f.getFloatNormals(), sizeof(Cvec3f) * nv))
+    throw runtime_error("switching storage changed the floats");
+  // reorder() moves the floats with their vertices
+  const vector<int> newIndex = g.reorder();
+  if (!g.hasFloatStorage())
+    throw runtime_error("reorder() dropped the float storage");
+  for (int i = 0; i < nv; ++i) {
+    if (memcmp(&g.getFloatPositions()[newIndex[i]], &f.getFloatPositions()[i],
+               sizeof(Cvec3f)))
+      throw runtime_error("reorder() changed a float position");
+  }
+  // binary files hold doubles, which load back to the same floats
+  const char *filename = "/tmp/meshbench_storage.bin";
+  f.saveBinary(filename);
+  Mesh h;
+  h.setFloatStorage();
+  h.loadBinary(filename);
+  remove(filename);
+  if (h.getNumVertices() != nv ||
+      memcmp(h.getFloatPositions(), f.getFloatPositions(),
+             sizeof(Cvec3f) * nv))
+    throw runtime_error("a binary file changed the float positions");
+  printf("float storage checks out\n");
+}
+
+// Brush strokes of growing radius on the subdivided bunny, in subdivision
+// order and after Mesh::reorder(): Mesh::updateNormals() against
+// computeNormals(), which it must match bit for bit, and the vertex buffer
+// spans it asks to upload, as is and with gaps of up to 16 vertices merged.
+// The spans must be exactly the moved vertices and those of their faces,
+// and uploading them alone must keep a copy of the buffer up to date.
+static void sculptBench(int level) {
+  Mesh m;
+  m.load("bunny.mesh");
+  for (int i = 0; i < level; ++i)
+    catmullClark(m);
+  const int nv = m.getNumVertices();
+  const size_t vertexBytes = 6 * sizeof(float); // VertexPN
+  printf("bunny level %d: %d vertices, %.1f MB of VertexPN\n", level, nv,
+         nv * vertexBytes / 1048576.0);
+  const double radii[] = {0.01, 0.03, 0.1, 0.3};
+  const int strokes = 8;
+  for (int order = 0; order < 2; ++order) {
+    if (order == 1)
+      m.reorder();
+    m.trackDirtyVertices();
+    const double t0 = nowSeconds();
+    m.computeNormals();
+    const double tFull = nowSeconds() - t0;
+    // the same strokes, updated with gaps of up to 16 vertices merged
+    Mesh g(m);
+    g.trackDirtyVertices();
+    g.computeNormals();
+    // the vertex buffer, positions and normals interleaved, as uploaded
+    // whole once and then only in the spans of every stroke
+    vector<Cvec3> shadow(2 * nv);
+    for (int i = 0; i < nv; ++i) {
+      shadow[2 * i] = m.getVertex(i).getPosition();
+      shadow[2 * i + 1] = m.getVertex(i).getNormal();
+    }
+    printf("%s order: computeNormals() %.1f ms, uploading all %.0f KB\n",
+           order == 0 ? "subdivision" : "reordered", tFull * 1e3,
+           nv * vertexBytes / 1024.0);
+    printf("%7s %9s %9s %10s %8s %8s %10s %9s\n", "radius", "brushed",
+           "updated", "update ms", "spans", "gap 16", "upload KB",
+           "speedup");
+    for (int r = 0; r < 4; ++r) {
+      double brushed = 0, updated = 0, time = 0, spans = 0, merged = 0,
+             bytes = 0;
+      for (int s = 0; s < strokes; ++s) {
+        const Cvec3 center =
+            m.getVertex(int(nv * (s + 0.5) / strokes)).getPosition();
+        vector<Cvec3> before(nv);
+        for (int i = 0; i < nv; ++i)
+          before[i] = m.getVertex(i).getNormal();
+        for (int i = 0; i < nv; ++i) {
+          const Cvec3 p = m.getVertex(i).getPosition();
+          const double d = sqrt(norm2(p - center)) / radii[r];
+          if (d < 1) {
+            const Cvec3 q = p + before[i] * (0.2 * radii[r] * (1 - d * d));
+            m.getVertex(i).setPosition(q);
+            g.getVertex(i).setPosition(q);
+          }
+        }
+        brushed += m.getDirtyVertices().size();
+        // what the spans must hold: the moved vertices and those of their
+        // faces, found here through VertexIterator rather than the corner
+        // cache updateNormals() uses
+        vector<char> expected(nv, 0);
+        for (const int v : m.getDirtyVertices()) {
+          expected[v] = 1;
+          Mesh::VertexIterator it(m.getVertex(v).getIterator()), it0(it);
+          do {
+            const Mesh::Face f = it.getFace();
+            for (int j = 0; j < f.getNumVertices(); ++j)
+              expected[f.getVertex(j).getIndex()] = 1;
+          } while (++it != it0);
+        }
+
+        vector<pair<int, int>> span, gap;
+        const double t1 = nowSeconds();
+        m.updateNormals(span);
+        time += nowSeconds() - t1;
+        g.updateNormals(gap, 16);
+        spans += span.size();
+        merged += gap.size();
+        for (size_t i = 0; i < span.size(); ++i) {
+          updated += span[i].second - span[i].first;
+          bytes += (span[i].second - span[i].first) * vertexBytes;
+          // as FormattedVbo::update() uploads them
+          for (int j = span[i].first; j < span[i].second; ++j) {
+            shadow[2 * j] = m.getVertex(j).getPosition();
+            shadow[2 * j + 1] = m.getVertex(j).getNormal();
+          }
+        }
+
+        // the same normals as computeNormals(), changed only within the
+        // spans, which the merged ones cover
+        Mesh reference(m);
+        reference.computeNormals();
+        vector<char> inSpan(nv, 0), inGap(nv, 0);
+        for (size_t i = 0; i < span.size(); ++i) {
+          // coalesced: sorted, and apart from each other
+          if (i > 0 && span[i].first <= span[i - 1].second)
+            throw runtime_error("spans not coalesced");
+          fill(inSpan.begin() + span[i].first,
+               inSpan.begin() + span[i].second, 1);
+        }
+        if (inSpan != expected)
+          throw runtime_error("spans differ from the dirty vertices");
+        for (size_t i = 0; i < gap.size(); ++i) {
+          if (i > 0 && gap[i].first - gap[i - 1].second <= 16)
+            throw runtime_error("spans closer than maxGap");
+          fill(inGap.begin() + gap[i].first, inGap.begin() + gap[i].second,
+               1);
+        }
+        for (int i = 0; i < nv; ++i) {
+          const Cvec3 a = m.getVertex(i).getNormal(),
+                      b = reference.getVertex(i).getNormal(),
+                      c = g.getVertex(i).getNormal();
+          for (int j = 0; j < 3; ++j) {
+            if (a[j] != b[j] || a[j] != c[j])
+              throw runtime_error("updateNormals() differs from "
+                                  "computeNormals()");
+          }
+          if ((inSpan[i] && !inGap[i]) ||
+              (!inSpan[i] && norm2(a - before[i]) != 0))
+            throw runtime_error("a normal changed outside the spans");
+          if (norm2(shadow[2 * i] - m.getVertex(i).getPosition()) != 0 ||
+              norm2(shadow[2 * i + 1] - a) != 0)
+            throw runtime_error("span uploads missed a vertex");
+        }
+      }
+      printf("%7.2f %9.0f %9.0f %10.3f %8.0f %8.0f %10.1f %8.0fx\n", radii[r],
+             brushed / strokes, updated / strokes, time / strokes * 1e3,
+             spans / strokes, merged / strokes, bytes / strokes / 1024,
+             tFull / (time / strokes));
+    }
+  }
+}
+
+// The per-frame CPU work of the fur shells in asst9, on the subdivided
+// bunny with hair tips blown sideways: extruding all shells into vertex
+// buffers as updateShellGeometry() does, against gathering the tips at the
+// corners for the instanced shells. Checks that the vertex shader's
+// extrusion, evaluated here in float, lands on the CPU shells.
+static void benchShells(int level) {
+  const int numShells = 24;
+  const double furHeight = 0.21;
+  Mesh m;
+  m.setFloatStorage();
+  m.load("bunny.mesh");
+  for (int i = 0; i < level; ++i) {
+    m.computeCatmullClarkPoints();
+    m.subdivide();
+  }
+  m.computeNormals();
+  const int nv = m.getNumVertices();
+  const Cvec3f *positions = m.getFloatPositions();
+  const Cvec3f *normals = m.getFloatNormals();
+  vector<Cvec3> tips(nv);
+  for (int i = 0; i < nv; ++i) {
+    const Mesh::Vertex v = m.getVertex(i);
+    tips[i] = v.getPosition() +
+              (v.getNormal() + Cvec3(0.5, -0.3, 0)).normalize() * furHeight;
+  }
+  vector<int> corners;
+  for (int i = 0; i < m.getNumFaces(); ++i) {
+    const Mesh::Face f = m.getFace(i);
+    for (int j = 0; j < f.getNumVertices(); ++j)
+      corners.push_back(f.getVertex(j).getIndex());
+  }
+  const int nc = corners.size();
+
+  struct ShellVertex { // as VertexPNX
+    Cvec3f p, n;
+    Cvec2f x;
+  };
+  const Cvec2f triTex[] = {Cvec2f(0, 0), Cvec2f(0.7f, 0), Cvec2f(0, 0.7f)};
+  vector<ShellVertex> shells(size_t(nc) * numShells);
+  long unused;
+  const double tCpu = timeIt([&] {
+    vector<Cvec3f> steps(nv), bends(nv);
+    for (int v = 0; v < nv; ++v) {
+      const Cvec3 p(positions[v][0], positions[v][1], positions[v][2]);
+      const Cvec3 n = Cvec3(normals[v][0], normals[v][1], normals[v][2]) *
+                      (furHeight / numShells);
+      const Cvec3 d = (tips[v] - n * numShells - p) *
+                      (2 / (pow(numShells, 2) - numShells));
+      steps[v] = Cvec3f(n[0], n[1], n[2]);
+      bends[v] = Cvec3f(d[0], d[1], d[2]);
+    }
+    for (int s = 0; s < numShells; ++s) {
+      const float a = s + 1, b = (s * s + s) / 2;
+      ShellVertex *out = &shells[size_t(nc) * s];
+      for (int i = 0; i < nc; ++i) {
+        const int v = corners[i];
+        out[i].p = steps[v] * a + bends[v] * b + positions[v];
+        out[i].n = steps[v];
+        out[i].x = triTex[i % 3];
+      }
+    }
+    return 0L;
+  }, unused);
+  vector<Cvec3f> cornerTips(nc);
+  const double tInstanced = timeIt([&] {
+    for (int i = 0; i < nc; ++i) {
+      const Cvec3 &t = tips[corners[i]];
+      cornerTips[i] = Cvec3f(t[0], t[1], t[2]);
+    }
+    return 0L;
+  }, unused);
+
+  // bunny-shell-gl3.vshader, with the bunny frame being the world frame
+  double maxError = 0;
+  const float N = numShells;
+  for (int s = 0; s < numShells; ++s) {
+    for (int i = 0; i < nc; ++i) {
+      const Cvec3f &p = positions[corners[i]];
+      const Cvec3f n = normals[corners[i]] * float(furHeight / N);
+      const Cvec3f d = (cornerTips[i] - n * N - p) * (2.0f / (N * N - N));
+      const Cvec3f q = p + n * float(s + 1) + d * float((s * s + s) / 2.0f);
+      const Cvec3f e = q - shells[size_t(nc) * s + i].p;
+      maxError = max(maxError, sqrt(double(norm2(e))));
+    }
+  }
+  const double kbCpu = sizeof(ShellVertex) * double(nc) * numShells / 1024;
+  const double kbInstanced = sizeof(Cvec3f) * double(nc) / 1024;
+  printf("bunny level %d: %d corners, %d shells\n", level, nc, numShells);
+  printf("%-20s %12s %12s\n", "", "CPU", "instanced");
+  printf("%-20s %12.2f %12.2f\n", "CPU ms per frame", tCpu * 1e3,
+         tInstanced * 1e3);
+  printf("%-20s %12.1f %12.1f\n", "KB uploaded", kbCpu, kbInstanced);
+  printf("shader extrusion within %.2g of the CPU shells\n", maxError);
+  if (maxError > 1e-5)
+    throw runtime_error("the instanced shells differ from the CPU shells");
+}
+
+// The hair tip loop of asst9 before FurSim, in double over Mesh::Vertex,
+// with the tips spread across the shared thread pool
+static void furStepDouble(Mesh &m, const Matrix4 &meshToWorld,
+                          const FurSim::Params &p, vector<Cvec3> &tips,
+                          vector<Cvec3> &velocities) {
+  ThreadPool::shared().parallelFor(
+      0, m.getNumVertices(),
+      [&](const int lo, const int hi) {
+        for (int v = lo; v < hi; ++v) {
+          const Mesh::Vertex vtx = m.getVertex(v);
+          const Cvec3 pos = Cvec3(meshToWorld * Cvec4(vtx.getPosition(), 1.));
+          const Cvec3 norm =
+              Cvec3(meshToWorld * Cvec4(vtx.getNormal())).normalize();
+          for (int step = 0; step < p.numSteps; ++step) {
+            const Cvec3 force =
+                p.gravity + (pos + norm * p.furHeight - tips[v]) * p.stiffness;
+            tips[v] += velocities[v] * p.timeStep;
+            tips[v] = pos + (tips[v] - pos).normalize() * p.furHeight;
+            velocities[v] = (force * p.timeStep + velocities[v]) * p.damping;
+          }
+        }
+      },
+      256);
+}
+
+// Tips per second through a substep of the hair simulation, on the bunny
+// swinging about: the double loop against FurSim, and how far apart their
+// tips end up. Also checks that FurSim interpolates from the tips before
+// its last step.
+static void benchFur(int level) {
+  Mesh m;
+  m.load("bunny.mesh");
+  for (int i = 0; i < level; ++i) {
+    m.computeCatmullClarkPoints();
+    m.subdivide();
+  }
+  m.computeNormals();
+  const int nv = m.getNumVertices();
+  const FurSim::Params p = {0.21, 4, 0.96, 0.02, Cvec3(0, -0.5, 0), 10};
+  FurSim fur;
+  fur.reset(m, Matrix4(), p.furHeight);
+  vector<Cvec3> tips(nv), velocities(nv, Cvec3(0));
+  for (int v = 0; v < nv; ++v) {
+    const Mesh::Vertex vtx = m.getVertex(v);
+    tips[v] = vtx.getPosition() + vtx.getNormal() * p.furHeight;
+  }
+  const int frames = 60;
+  double tDouble = 0, tFloat = 0;
+  vector<Cvec3f> previous(nv);
+  for (int f = 0; f < frames; ++f) {
+    for (int v = 0; v < nv; ++v)
+      previous[v] = fur.getTip(v);
+    const Matrix4 meshToWorld =
+        Matrix4::makeTranslation(Cvec3(0, 0.3 * sin(f * 0.2), 0)) *
+        Matrix4::makeYRotation(40 * sin(f * 0.1));
+    const double t0 = nowSeconds();
+    furStepDouble(m, meshToWorld, p, tips, velocities);
+    const double t1 = nowSeconds();
+    fur.step(meshToWorld, p);
+    tFloat += nowSeconds() - t1;
+    tDouble += t1 - t0;
+  }
+  double maxError = 0;
+  for (int v = 0; v < nv; ++v) {
+    const Cvec3f t = fur.getTip(v), t0 = fur.getTip(v, 0),
+                 t1 = fur.getTip(v, 1);
+    if (memcmp(&t0, &previous[v], sizeof(t0)) || memcmp(&t1, &t, sizeof(t)))
+      throw runtime_error("FurSim interpolates from the wrong tips");
+    maxError = max(maxError,
+                   sqrt(norm2(Cvec3(t[0], t[1], t[2]) - tips[v])));
+  }
+  const double tipSteps = double(nv) * p.numSteps * frames;
+  printf("bunny level %d: %d tips, %d frames of %d substeps, %d threads\n",
+         level, nv, frames, p.numSteps, ThreadPool::shared().getNumThreads());
+  printf("%-24s %12s %12s\n", "", "double", "FurSim");
+  printf("%-24s %12.2f %12.2f\n", "ms per frame", tDouble / frames * 1e3,
+         tFloat / frames * 1e3);
+  printf("%-24s %12.1f %12.1f\n", "million tip substeps/s",
+         tipSteps / tDouble * 1e-6, tipSteps / tFloat * 1e-6);
+  printf("FurSim tips within %.2g of the double tips (hair length %g)\n",
+         maxError, p.furHeight);
+  if (!(maxError < 1e-3))
+    throw runtime_error("FurSim strayed from the double simulation");
+}
+
+static void usage() {
+  fprintf(stderr, "usage: meshbench rings [maxLevel]\n"
+                  "       meshbench subdivide [maxLevel]\n"
+                  "       meshbench load [level]\n"
+                  "       meshbench binload [level]\n"
+                  "       meshbench parse [level]\n"
+                  "       meshbench export [maxLevel]\n"
+                  "       meshbench normals [maxLevel]\n"
+                  "       meshbench stencils [level]\n"
+                  "       meshbench lod [level]\n"
+                  "       meshbench bvh [level]\n"
+                  "       meshbench instances [level]\n"
+                  "       meshbench reorder [level]\n"
+                  "       meshbench outofcore [level]\n"
+                  "       meshbench points [level]\n"
+                  "       meshbench levels [level]\n"
+                  "       meshbench meshlets [level]\n"
+                  "       meshbench sculpt [level]\n"
+                  "       meshbench storage [level]\n"
+                  "       meshbench shells [level]\n"
+                  "       meshbench fur [level]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2)
+    usage();
+  try {
+    const string cmd = argv[1];
+    if (cmd == "rings")
+      benchRings(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "subdivide")
+      benchSubdivide(argc > 2 ? atoi(argv[2]) : 5);
+    else if (cmd == "load")
+      benchLoad(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "binload")
+      benchBinaryLoad(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "parse")
+      benchParse(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "export")
+      benchExport(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "normals")
+      benchNormals(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "stencils")
+      benchStencils(argc > 2 ? atoi(argv[2]) : 3);
+    else if (cmd == "lod")
+      benchLod(argc > 2 ? atoi(argv[2]) : 2);
+    else if (cmd == "bvh")
+      benchBvh(argc > 2 ? atoi(argv[2]) : 3);
+    else if (cmd == "instances")
+      benchInstances(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "reorder")
+      benchReorder(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "outofcore")
+      benchOutOfCore(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "points")
+      benchPoints(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "levels")
+      benchLevels(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "meshlets")
+      benchMeshlets(argc > 2 ? atoi(argv[2]) : 3);
+    else if (cmd == "sculpt")
+      sculptBench(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "storage")
+      benchStorage(argc > 2 ? atoi(argv[2]) : 4);
+    else if (cmd == "shells")
+      benchShells(argc > 2 ? atoi(argv[2]) : 0);
+    else if (cmd == "fur")
+      benchFur(argc > 2 ? atoi(argv[2]) : 2);
+    else
+      usage();
+    return 0;
+  } catch (const runtime_error &e) {
+    fprintf(stderr, "Exception caught: %s\n", e.what());
+    return -1;
+  }
+}
@@ -0,0 +1,560 @@
+#ifndef MESHBVH_H
+#define MESHBVH_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "cvec.h"
+#include "mesh.h"
+
+// Bounding volume hierarchy over the faces of a Mesh, for ray casts,
+// closest point and box overlap queries on the CPU.
+//
+//   MeshBvh bvh(mesh);
+//   MeshBvh::Hit hit;
+//   if (bvh.intersect(origin, direction, hit))
+//       ... hit.face, hit.point, hit.barycentric of hit.vertices ...
+//   ...  // move vertices of mesh
+//   bvh.refit(mesh);
+//
+// Quads are split into two triangles along their 0-2 diagonal; hits report
+// the face along with the triangle of it that was hit. The tree is built
+// with a binned surface area heuristic and stored as a flat array of 32
+// byte nodes in depth-first order, with the two children of a node next to
+// each other. refit() recomputes the boxes for new vertex positions without
+// changing the tree, which stays valid but gets looser as the mesh deforms
+// away from the shape it was built for.
+class MeshBvh {
+  public:
+    struct Hit {
+        int face;             // hit face, or -1 if there is none
+        Cvec<int, 3> vertices; // the triangle of the face that was hit
+        Cvec3 barycentric;     // weights of vertices at the hit point
+        Cvec3 point;
+        double distance; // ray parameter, or distance to the query point
+
+        Hit() : face(-1), distance(std::numeric_limits<double>::infinity()) {}
+    };
+
+  private:
+    // Single precision boxes, rounded outward so that they stay
+    // conservative. count_ > 0 marks a leaf holding the triangles
+    // [first_, first_ + count_); inner nodes have their children at first_
+    // and first_ + 1.
+    struct node_t {
+        float min_[3];
+        int first_;
+        float max_[3];
+        int count_;
+    };
+    struct tri_t {
+        Cvec<int, 3> vertex_;
+        int face_;
+    };
+    enum { BINS = 16, MAX_LEAF = 8, MAX_DEPTH = 64 };
+
+    std::vector<node_t> node_;
+    std::vector<tri_t> tri_; // in leaf order
+    std::vector<Cvec3> position_;
+
+    static float round_down__(const double x) {
+        const float f = float(x);
+        return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity())
+                     : f;
+    }
+    static float round_up__(const double x) {
+        const float f = float(x);
+        return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity())
+                     : f;
+    }
+    struct box_t {
+        Cvec3 min_, max_;
+
+        box_t()
+            : min_(std::numeric_limits<double>::infinity()),
+              max_(-std::numeric_limits<double>::infinity()) {}
+        void grow(const Cvec3 &p) {
+            for (int k = 0; k < 3; ++k) {
+                min_[k] = std::min(min_[k], p[k]);
+                max_[k] = std::max(max_[k], p[k]);
+            }
+        }
+        void grow(const box_t &b) {
+            for (int k = 0; k < 3; ++k) {
+                min_[k] = std::min(min_[k], b.min_[k]);
+                max_[k] = std::max(max_[k], b.max_[k]);
+            }
+        }
+        double area() const {
+            const Cvec3 d = max_ - min_;
+            return d[0] < 0 ? 0 : d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+        }
+    };
+    box_t tri_box__(const tri_t &t) const {
+        box_t b;
+        for (int k = 0; k < 3; ++k)
+            b.grow(position_[t.vertex_[k]]);
+        return b;
+    }
+    static void set_box__(node_t &n, const box_t &b) {
+        for (int k = 0; k < 3; ++k) {
+            n.min_[k] = round_down__(b.min_[k]);
+            n.max_[k] = round_up__(b.max_[k]);
+        }
+    }
+
+    void copy_positions__(Mesh &m) {
+        position_.resize(m.getNumVertices());
+        for (int i = 0; i < m.getNumVertices(); ++i)
+            position_[i] = m.getVertex(i).getPosition();
+    }
+    void build__() {
+        const int n = tri_.size();
+        node_.clear();
+        if (n == 0)
+            return;
+        node_.reserve(2 * n);
+        // Triangles are partitioned in place along with their boxes, so that
+        // every pass over a node's range reads memory in order
+        struct prim_t {
+            box_t box_;
+            Cvec3 centroid_;
+            int tri_;
+        };
+        std::vector<prim_t> prim(n);
+        for (int i = 0; i < n; ++i) {
+            prim[i].box_ = tri_box__(tri_[i]);
+            prim[i].centroid_ = (prim[i].box_.min_ + prim[i].box_.max_) * 0.5;
+            prim[i].tri_ = i;
+        }
+
+        // Work list of nodes to split: node index, range of prim, depth
+        struct work_t {
+            int node_, begin_, end_, depth_;
+        };
+        std::vector<work_t> work;
+        node_.push_back(node_t());
+        const work_t root = {0, 0, n, 0};
+        work.push_back(root);
+        while (!work.empty()) {
+            const work_t w = work.back();
+            work.pop_back();
+            box_t bounds, centers;
+            for (int i = w.begin_; i < w.end_; ++i) {
+                bounds.grow(prim[i].box_);
+                centers.grow(prim[i].centroid_);
+            }
+            set_box__(node_[w.node_], bounds);
+            const int count = w.end_ - w.begin_;
+
+            // Best binned split over the three axes. Costs are relative to
+            // intersecting one triangle, with traversal costing as much.
+            int bestAxis = -1, bestBin = 0;
+            double bestCost = count;
+            // small nodes get as many bins as triangles, which is plenty
+            const int bins = std::min<int>(BINS, count);
+            if (count > 1 && w.depth_ < MAX_DEPTH - 1) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    const double lo = centers.min_[axis],
+                                 extent = centers.max_[axis] - lo;
+                    if (!(extent > 0))
+                        continue;
+                    const double scale = bins / extent;
+                    box_t binBox[BINS];
+                    int binCount[BINS] = {0};
+                    for (int i = w.begin_; i < w.end_; ++i) {
+                        const int b = std::min(
+                            bins - 1,
+                            int(scale * (prim[i].centroid_[axis] - lo)));
+                        ++binCount[b];
+                        binBox[b].grow(prim[i].box_);
+                    }
+                    // right-to-left sweep first, then left-to-right
+                    double rightArea[BINS];
+                    int rightCount[BINS];
+                    box_t r;
+                    int rc = 0;
+                    for (int b = bins - 1; b > 0; --b) {
+                        r.grow(binBox[b]);
+                        rc += binCount[b];
+                        rightArea[b] = r.area();
+                        rightCount[b] = rc;
+                    }
+                    box_t l;
+                    int lc = 0;
+                    for (int b = 0; b < bins - 1; ++b) {
+                        l.grow(binBox[b]);
+                        lc += binCount[b];
+                        if (lc == 0 || rightCount[b + 1] == 0)
+                            continue;
+                        const double cost =
+                            1 + (lc * l.area() +
+                                 rightCount[b + 1] * rightArea[b + 1]) /
+                                    bounds.area();
+                        if (cost < bestCost) {
+                            bestCost = cost;
+                            bestAxis = axis;
+                            bestBin = b;
+                        }
+                    }
+                }
+            }
+            if (bestAxis < 0 && (count <= MAX_LEAF || w.depth_ >= MAX_DEPTH - 1)) {
+                node_[w.node_].first_ = w.begin_;
+                node_[w.node_].count_ = count;
+                continue;
+            }
+            int mid;
+            if (bestAxis >= 0) {
+                const double lo = centers.min_[bestAxis],
+                             scale = bins / (centers.max_[bestAxis] - lo);
+                mid = std::partition(
+                          prim.begin() + w.begin_, prim.begin() + w.end_,
+                          [&](const prim_t &p) {
+                              return std::min(bins - 1,
+                                              int(scale * (p.centroid_[bestAxis] -
+                                                           lo))) <= bestBin;
+                          }) -
+                      prim.begin();
+            } else {
+                // too many triangles for a leaf, but no split pays off (all
+                // centroids coincide, say): halve the range
+                mid = (w.begin_ + w.end_) / 2;
+            }
+            const int left = node_.size();
+            node_[w.node_].first_ = left;
+            node_[w.node_].count_ = 0;
+            node_.push_back(node_t());
+            node_.push_back(node_t());
+            const work_t r = {left + 1, mid, w.end_, w.depth_ + 1},
+                         l = {left, w.begin_, mid, w.depth_ + 1};
+            work.push_back(r);
+            work.push_back(l);
+        }
+        std::vector<tri_t> sorted(n);
+        for (int i = 0; i < n; ++i)
+            sorted[i] = tri_[prim[i].tri_];
+        tri_.swap(sorted);
+    }
+
+    // Slab test; returns the entry distance, or infinity on a miss
+    static double ray_box__(const node_t &n, const Cvec3 &o, const Cvec3 &inv,
+                            const double tMax) {
+        double t0 = 0, t1 = tMax;
+        for (int k = 0; k < 3; ++k) {
+            double a = (n.min_[k] - o[k]) * inv[k],
+                   b = (n.max_[k] - o[k]) * inv[k];
+            if (a > b)
+                std::swap(a, b);
+            // written so that NaNs (0 * inf) leave the interval alone
+            t0 = a > t0 ? a : t0;
+            t1 = b < t1 ? b : t1;
+        }
+        return t0 <= t1 ? t0 : std::numeric_limits<double>::infinity();
+    }
+    // Moller-Trumbore; updates hit if the triangle is closer
+    bool ray_tri__(const tri_t &t, const Cvec3 &o, const Cvec3 &d,
+                   Hit &hit) const {
+        const Cvec3 &p0 = position_[t.vertex_[0]];
+        const Cvec3 e1 = position_[t.vertex_[1]] - p0,
+                    e2 = position_[t.vertex_[2]] - p0;
+        const Cvec3 p = cross(d, e2);
+        const double det = dot(e1, p);
+        if (det == 0)
+            return false;
+        const double inv = 1 / det;
+        const Cvec3 s = o - p0;
+        const double u = dot(s, p) * inv;
+        if (u < 0 || u > 1)
+            return false;
+        const Cvec3 q = cross(s, e1);
+        const double v = dot(d, q) * inv;
+        if (v < 0 || u + v > 1)
+            return false;
+        const double dist = dot(e2, q) * inv;
+        if (dist < 0 || dist >= hit.distance)
+            return false;
+        hit.face = t.face_;
+        hit.vertices = t.vertex_;
+        hit.barycentric = Cvec3(1 - u - v, u, v);
+        hit.distance = dist;
+        return true;
+    }
+    // Closest point of a triangle to p, from Ericson, "Real-Time Collision
+    // Detection", 5.1.5; returns its barycentrics
+    Cvec3 closest_on_tri__(const tri_t &t, const Cvec3 &p) const {
+        const Cvec3 &a = position_[t.vertex_[0]], &b = position_[t.vertex_[1]],
+                    &c = position_[t.vertex_[2]];
+        const Cvec3 ab = b - a, ac = c - a, ap = p - a;
+        const double d1 = dot(ab, ap), d2 = dot(ac, ap);
+        if (d1 <= 0 && d2 <= 0)
+            return Cvec3(1, 0, 0);
+        const Cvec3 bp = p - b;
+        const double d3 = dot(ab, bp), d4 = dot(ac, bp);
+        if (d3 >= 0 && d4 <= d3)
+            return Cvec3(0, 1, 0);
+        const double vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+            const double v = d1 / (d1 - d3);
+            return Cvec3(1 - v, v, 0);
+        }
+        const Cvec3 cp = p - c;
+        const double d5 = dot(ab, cp), d6 = dot(ac, cp);
+        if (d6 >= 0 && d5 <= d6)
+            return Cvec3(0, 0, 1);
+        const double vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+            const double w = d2 / (d2 - d6);
+            return Cvec3(1 - w, 0, w);
+        }
+        const double va = d3 * d6 - d5 * d4;
+        if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+            const double w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+            return Cvec3(0, 1 - w, w);
+        }
+        const double denom = 1 / (va + vb + vc);
+        const double v = vb * denom, w = vc * denom;
+        return Cvec3(1 - v - w, v, w);
+    }
+    static double box_distance2__(const node_t &n, const Cvec3 &p) {
+        double d2 = 0;
+        for (int k = 0; k < 3; ++k) {
+            const double d = std::max(std::max(n.min_[k] - p[k], 0.0),
+                                      p[k] - n.max_[k]);
+            d2 += d * d;
+        }
+        return d2;
+    }
+    static bool box_overlap__(const node_t &n, const Cvec3 &bmin,
+                              const Cvec3 &bmax) {
+        for (int k = 0; k < 3; ++k) {
+            if (n.max_[k] < bmin[k] || n.min_[k] > bmax[k])
+                return false;
+        }
+        return true;
+    }
+    // Separating axis test of Akenine-Moller, "Fast 3D Triangle-Box
+    // Overlap Testing": the box axes, the triangle normal, and the nine
+    // cross products of box axes and triangle edges
+    bool tri_box_overlap__(const tri_t &t, const Cvec3 &center,
+                           const Cvec3 &half) const {
+        Cvec3 v[3];
+        for (int k = 0; k < 3; ++k)
+            v[k] = position_[t.vertex_[k]] - center;
+        for (int k = 0; k < 3; ++k) {
+            if (std::min(v[0][k], std::min(v[1][k], v[2][k])) > half[k] ||
+                std::max(v[0][k], std::max(v[1][k], v[2][k])) < -half[k])
+                return false;
+        }
+        const Cvec3 e[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+        Cvec3 axes[10];
+        axes[0] = cross(e[0], e[1]);
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                Cvec3 a;
+                a[j] = 1;
+                axes[1 + 3 * i + j] = cross(a, e[i]);
+            }
+        }
+        for (int i = 0; i < 10; ++i) {
+            const Cvec3 &a = axes[i];
+            const double p0 = dot(v[0], a), p1 = dot(v[1], a), p2 = dot(v[2], a);
+            const double r = half[0] * std::abs(a[0]) +
+                             half[1] * std::abs(a[1]) + half[2] * std::abs(a[2]);
+            if (std::min(p0, std::min(p1, p2)) > r ||
+                std::max(p0, std::max(p1, p2)) < -r)
+                return false;
+        }
+        return true;
+    }
+
+  public:
+    MeshBvh() {}
+    explicit MeshBvh(Mesh &m) { build(m); }
+
+    // Builds the tree over the current faces and positions of m
+    void build(Mesh &m) {
+        copy_positions__(m);
+        tri_.clear();
+        for (int i = 0; i < m.getNumFaces(); ++i) {
+            const Mesh::Face f = m.getFace(i);
+            for (int j = 1; j + 1 < f.getNumVertices(); ++j) {
+                const tri_t t = {Cvec<int, 3>(f.getVertex(0).getIndex(),
+                                              f.getVertex(j).getIndex(),
+                                              f.getVertex(j + 1).getIndex()),
+                                 i};
+                tri_.push_back(t);
+            }
+        }
+        build__();
+    }
+
+    // Updates the boxes to the current positions of m, which must have the
+    // topology the tree was built for
+    void refit(Mesh &m) {
+        copy_positions__(m);
+        for (int i = node_.size() - 1; i >= 0; --i) {
+            node_t &n = node_[i];
+            box_t b;
+            if (n.count_ > 0) {
+                for (int j = n.first_; j < n.first_ + n.count_; ++j)
+                    b.grow(tri_box__(tri_[j]));
+            } else {
+                // children come after their parent in the array
+                for (int c = n.first_; c < n.first_ + 2; ++c) {
+                    for (int k = 0; k < 3; ++k) {
+                        b.min_[k] = std::min(b.min_[k], double(node_[c].min_[k]));
+                        b.max_[k] = std::max(b.max_[k], double(node_[c].max_[k]));
+                    }
+                }
+            }
+            set_box__(n, b);
+        }
+    }
+
+    int getNumNodes() const { return node_.size(); }
+    int getNumTriangles() const { return tri_.size(); }
+
+    // Closest hit of the ray origin + t * direction with 0 <= t < tMax.
+    // direction need not be unit length; hit.distance is t.
+    bool intersect(const Cvec3 &origin, const Cvec3 &direction, Hit &hit,
+                   const double tMax =
+                       std::numeric_limits<double>::infinity()) const {
+        hit = Hit();
+        hit.distance = tMax;
+        if (node_.empty())
+            return false;
+        const Cvec3 inv(1 / direction[0], 1 / direction[1], 1 / direction[2]);
+        int stack[MAX_DEPTH];
+        int top = 0, i = 0;
+        for (;;) {
+            const node_t &n = node_[i];
+            if (n.count_ > 0) {
+                for (int j = n.first_; j < n.first_ + n.count_; ++j)
+                    ray_tri__(tri_[j], origin, direction, hit);
+            } else {
+                // visit the nearer child first and come back for the other
+                int a = n.first_, b = n.first_ + 1;
+                double ta = ray_box__(node_[a], origin, inv, hit.distance),
+                       tb = ray_box__(node_[b], origin, inv, hit.distance);
+                if (tb < ta) {
+                    std::swap(a, b);
+                    std::swap(ta, tb);
+                }
+                if (ta < hit.distance) {
+                    if (tb < hit.distance)
+                        stack[top++] = b;
+                    i = a;
+                    continue;
+                }
+            }
+            // pop the next node that the ray enters before the closest hit
+            // found so far
+            for (i = -1; top > 0;) {
+                const int c = stack[--top];
+                if (ray_box__(node_[c], origin, inv, hit.distance) <
+                    hit.distance) {
+                    i = c;
+                    break;
+                }
+            }
+            if (i < 0)
+                break;
+        }
+        if (hit.face < 0)
+            return false;
+        hit.point = origin + direction * hit.distance;
+        return true;
+    }
+
+    // Closest point of the mesh to p within maxDistance
+    bool closestPoint(const Cvec3 &p, Hit &hit,
+                      const double maxDistance =
+                          std::numeric_limits<double>::infinity()) const {
+        hit = Hit();
+        if (node_.empty())
+            return false;
+        double best2 = maxDistance * maxDistance;
+        int stack[MAX_DEPTH];
+        int top = 0, i = 0;
+        for (;;) {
+            const node_t &n = node_[i];
+            if (n.count_ > 0) {
+                for (int j = n.first_; j < n.first_ + n.count_; ++j) {
+                    const Cvec3 w = closest_on_tri__(tri_[j], p);
+                    const tri_t &t = tri_[j];
+                    const Cvec3 q = position_[t.vertex_[0]] * w[0] +
+                                    position_[t.vertex_[1]] * w[1] +
+                                    position_[t.vertex_[2]] * w[2];
+                    const double d2 = norm2(q - p);
+                    if (d2 < best2 || (hit.face < 0 && d2 <= best2)) {
+                        best2 = d2;
+                        hit.face = t.face_;
+                        hit.vertices = t.vertex_;
+                        hit.barycentric = w;
+                        hit.point = q;
+                    }
+                }
+            } else {
+                int a = n.first_, b = n.first_ + 1;
+                double da = box_distance2__(node_[a], p),
+                       db = box_distance2__(node_[b], p);
+                if (db < da) {
+                    std::swap(a, b);
+                    std::swap(da, db);
+                }
+                if (da <= best2) {
+                    if (db <= best2)
+                        stack[top++] = b;
+                    i = a;
+                    continue;
+                }
+            }
+            // pop the next node that can still hold something closer
+            for (i = -1; top > 0;) {
+                const int c = stack[--top];
+                if (box_distance2__(node_[c], p) <= best2) {
+                    i = c;
+                    break;
+                }
+            }
+            if (i < 0)
+                break;
+        }
+        if (hit.face < 0)
+            return false;
+        hit.distance = std::sqrt(best2);
+        return true;
+    }
+
+    // Appends to faces every face with a triangle that overlaps the box
+    // [bmin, bmax]. A quad overlapping with both its triangles is listed
+    // twice.
+    void overlap(const Cvec3 &bmin, const Cvec3 &bmax,
+                 std::vector<int> &faces) const {
+        if (node_.empty())
+            return;
+        const Cvec3 center = (bmin + bmax) * 0.5, half = (bmax - bmin) * 0.5;
+        int stack[MAX_DEPTH];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const node_t &n = node_[stack[--top]];
+            if (!box_overlap__(n, bmin, bmax))
+                continue;
+            if (n.count_ > 0) {
+                for (int j = n.first_; j < n.first_ + n.count_; ++j) {
+                    if (tri_box_overlap__(tri_[j], center, half))
+                        faces.push_back(tri_[j].face_);
+                }
+            } else {
+                stack[top++] = n.first_ + 1;
+                stack[top++] = n.first_;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,79 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   Converts a text .mesh file into the binary mesh format read by
+//   Mesh::load()/Mesh::loadBinary(). Build with "make meshconvert".
+//
+//     ./meshconvert [-notopology] [-levels N] in.mesh out.bmesh
+//     ./meshconvert -stream N in.mesh out.chunks
+//
+//   -notopology  store only positions and faces (smaller file, but the
+//                edges are rebuilt on load)
+//   -levels N    also store Catmull-Clark subdivision levels 1..N
+//   -stream N    write only level N, patch by patch, as the chunk file of
+//                outofcore.h; for levels too large to hold in memory
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "cvec.h"
+#include "mesh.h"
+#include "outofcore.h"
+
+using namespace std;
+
+static void usage() {
+  fprintf(stderr,
+          "usage: meshconvert [-notopology] [-levels N] in.mesh out.bmesh\n"
+          "       meshconvert -stream N in.mesh out.chunks\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  bool topology = true;
+  int levels = 0, stream = -1;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "-notopology") == 0)
+      topology = false;
+    else if (strcmp(argv[i], "-levels") == 0 && i + 1 < argc)
+      levels = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-stream") == 0 && i + 1 < argc)
+      stream = atoi(argv[++i]);
+    else
+      usage();
+  }
+  if (argc - i != 2)
+    usage();
+  try {
+    Mesh m;
+    m.setParallel();
+    m.load(argv[i]);
+    if (stream >= 0) {
+      ChunkedSubdivision::write(m, stream, argv[i + 1]);
+      const ChunkedSubdivision chunks(argv[i + 1]);
+      printf("level %d: %lld vertices, %lld faces in %d chunks\n", stream,
+             chunks.getNumVertices(), chunks.getNumFaces(),
+             chunks.getNumChunks());
+      return 0;
+    }
+    m.saveBinary(argv[i + 1], topology);
+    printf("level 0: %d vertices, %d faces\n", m.getNumVertices(),
+           m.getNumFaces());
+    for (int level = 1; level <= levels; ++level) {
+      m.computeCatmullClarkPoints();
+      m.subdivide();
+      m.saveBinary(argv[i + 1], topology, true);
+      printf("level %d: %d vertices, %d faces\n", level, m.getNumVertices(),
+             m.getNumFaces());
+    }
+    return 0;
+  } catch (const runtime_error &e) {
+    fprintf(stderr, "Exception caught: %s\n", e.what());
+    return -1;
+  }
+}
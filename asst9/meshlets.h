@@ -0,0 +1,152 @@
+#ifndef MESHLETS_H
+#define MESHLETS_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cvec.h"
+#include "matrix4.h"
+
+//--------------------------------------------------------------------------------
+// Meshlets: small clusters of neighboring triangles with bounds, so that the
+// parts of a mesh outside the view frustum or facing away from the eye can
+// be culled on the CPU a cluster at a time
+//--------------------------------------------------------------------------------
+
+// A run of triangles in the index list split by buildMeshlets(), with a
+// bounding sphere and a cone holding the normals of its triangles. The cone
+// is given by its axis and the sine of its half angle (cutoff); a cutoff of
+// 1 means the triangles face too many ways for the cone to cull anything.
+struct Meshlet {
+    int firstIndex, numIndices;
+    int numVertices;
+    Cvec3 center;
+    double radius;
+    Cvec3 coneAxis;
+    double coneCutoff;
+};
+
+// Splits the triangle list indices, with positions giving the vertices,
+// into a sequence of meshlets of at most maxVertices vertices and
+// maxTriangles triangles, and appends them to meshlets. Each meshlet is the
+// longest run of triangles that fits, in the order of indices, which should
+// come from optimizeVertexCache(): that order sweeps the surface in compact
+// strips, so the runs make tight clusters, and the triangles are drawn
+// exactly as optimized, with the same post-transform cache hits.
+inline void buildMeshlets(const std::vector<unsigned> &indices,
+                          const std::vector<Cvec3> &positions,
+                          std::vector<Meshlet> &meshlets,
+                          const int maxVertices = 64,
+                          const int maxTriangles = 124) {
+    const int nt = indices.size() / 3, nv = positions.size();
+    std::vector<int> stamp(nv, -1); // meshlet that last took the vertex
+    std::vector<int> members;
+    std::vector<Cvec3> normals;
+    for (int t = 0; t < nt;) {
+        const int id = meshlets.size();
+        Meshlet m;
+        m.firstIndex = 3 * t;
+        m.numVertices = 0;
+        members.clear();
+        for (; t < nt && t - m.firstIndex / 3 < maxTriangles; ++t) {
+            int added = 0;
+            for (int k = 0; k < 3; ++k)
+                added += stamp[indices[3 * t + k]] != id;
+            if (m.numVertices + added > maxVertices)
+                break;
+            for (int k = 0; k < 3; ++k) {
+                const int v = indices[3 * t + k];
+                if (stamp[v] != id) {
+                    stamp[v] = id;
+                    ++m.numVertices;
+                    members.push_back(v);
+                }
+            }
+        }
+        m.numIndices = 3 * t - m.firstIndex;
+
+        // bounding sphere around the center of the bounding box
+        Cvec3 lo = positions[members[0]], hi = lo;
+        for (std::size_t j = 1; j < members.size(); ++j) {
+            for (int k = 0; k < 3; ++k) {
+                lo[k] = std::min(lo[k], positions[members[j]][k]);
+                hi[k] = std::max(hi[k], positions[members[j]][k]);
+            }
+        }
+        m.center = (lo + hi) * 0.5;
+        m.radius = 0;
+        for (std::size_t j = 0; j < members.size(); ++j) {
+            m.radius =
+                std::max(m.radius, norm(positions[members[j]] - m.center));
+        }
+
+        // normal cone: the average unit normal, and the widest angle to it
+        normals.clear();
+        Cvec3 axis;
+        for (int i = m.firstIndex; i < m.firstIndex + m.numIndices; i += 3) {
+            const Cvec3 &p0 = positions[indices[i]];
+            const Cvec3 n = cross(positions[indices[i + 1]] - p0,
+                                  positions[indices[i + 2]] - p0);
+            const double l = norm(n);
+            if (l > 0) {
+                normals.push_back(n / l);
+                axis += normals.back();
+            }
+        }
+        const double l = norm(axis);
+        double minDot = l > 0 ? 1 : -1;
+        for (std::size_t j = 0; j < normals.size() && minDot > 0; ++j)
+            minDot = std::min(minDot, dot(normals[j], axis) / l);
+        m.coneAxis = l > 0 ? axis / l : Cvec3(0, 0, 1);
+        m.coneCutoff = minDot > 0 ? std::sqrt(1 - minDot * minDot) : 1;
+        meshlets.push_back(m);
+    }
+}
+
+// The six planes of the view frustum of projection * MVM, in the model
+// frame of MVM, as (a, b, c, d) with a x + b y + c z + d >= 0 inside
+inline void getFrustumPlanes(const Matrix4 &MVM, const Matrix4 &projection,
+                             Cvec4 planes[6]) {
+    const Matrix4 m = projection * MVM;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            planes[2 * i][j] = m(3, j) + m(i, j);
+            planes[2 * i + 1][j] = m(3, j) - m(i, j);
+        }
+    }
+}
+
+// True when the bounding sphere of m is entirely outside one of the planes
+inline bool isOutsideFrustum(const Meshlet &m, const Cvec4 planes[6]) {
+    for (int i = 0; i < 6; ++i) {
+        const Cvec3 n(planes[i][0], planes[i][1], planes[i][2]);
+        if (dot(n, m.center) + planes[i][3] < -m.radius * norm(n))
+            return true;
+    }
+    return false;
+}
+
+// True when every triangle of m faces away from eye, a point in the model
+// frame, wherever in its bounding sphere the triangle is
+inline bool isBackFacing(const Meshlet &m, const Cvec3 &eye) {
+    const Cvec3 d = m.center - eye;
+    return dot(d, m.coneAxis) >= m.coneCutoff * norm(d) + m.radius;
+}
+
+// Appends the indices of the meshlets that may be visible with the model
+// view matrix MVM and the projection to visible
+inline void cullMeshlets(const std::vector<Meshlet> &meshlets,
+                         const Matrix4 &MVM, const Matrix4 &projection,
+                         std::vector<int> &visible) {
+    Cvec4 planes[6];
+    getFrustumPlanes(MVM, projection, planes);
+    const Cvec3 eye(inv(MVM) * Cvec4(0, 0, 0, 1));
+    for (std::size_t i = 0; i < meshlets.size(); ++i) {
+        if (!isOutsideFrustum(meshlets[i], planes) &&
+            !isBackFacing(meshlets[i], eye))
+            visible.push_back(i);
+    }
+}
+
+#endif
@@ -0,0 +1,459 @@
+#ifndef OUTOFCORE_H
+#define OUTOFCORE_H
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cvec.h"
+#include "mappedfile.h"
+#include "mesh.h"
+
+// Catmull-Clark subdivision of meshes whose refined levels do not fit in
+// memory. The control mesh is cut into patches of nearby faces, in the
+// Morton order of Mesh::reorder(). Each patch is subdivided on its own, with
+// a halo of the faces around it, and only the refined faces of the patch
+// itself are written out, one chunk per patch. Memory holds the control mesh
+// and a single refined patch at a time.
+//
+//   ChunkedSubdivision::write(control, 6, "scan.chunks");
+//   ChunkedSubdivision chunks("scan.chunks");
+//   ChunkedSubdivision::Chunk c;
+//   for (int i = 0; i < chunks.getNumChunks(); ++i) {
+//       chunks.readChunk(i, c);
+//       ...
+//   }
+//
+// Vertices and faces carry the indices subdivide() gives them in memory,
+// and every position comes out of Mesh::computeCatmullClarkPoints(), whose
+// sums run in the same order for a patch as for the whole mesh.
+// So each chunk is an exact piece of the in-memory result, and a vertex on
+// the seam between two patches is in both chunks with the same index and
+// bit for bit the same position.
+class ChunkedSubdivision {
+  public:
+    struct Chunk {
+        std::vector<long long> vertexIds;
+        std::vector<Cvec3> positions;
+        std::vector<long long> faceIds;
+        std::vector<Cvec<long long, 4>> faces; // vertex ids, -1 ends tris
+    };
+
+  private:
+    // Chunk file, in native byte order:
+    //
+    //   header_t
+    //   for each chunk:
+    //     chunk_t
+    //     long long vertex_id[nv]
+    //     double position[nv][3]
+    //     long long face_id[nf]
+    //     long long face[nf][4]
+    struct header_t {
+        char magic_[8];
+        unsigned version_;
+        unsigned byte_order_;
+        unsigned levels_;
+        unsigned num_chunks_;
+        unsigned long long nv_, nf_; // of the whole refined mesh
+    };
+    struct chunk_t {
+        unsigned nv_, nf_;
+        unsigned long long bytes_; // payload size following this struct
+    };
+    enum { VERSION = 1, ENDIAN_MARK = 0x01020304 };
+    static const char *magic__() { return "CS175CHK"; }
+    static_assert(sizeof(Cvec3) == 3 * sizeof(double), "Cvec3 layout");
+    static std::size_t chunk_bytes__(const chunk_t &c) {
+        return (sizeof(long long) + sizeof(double) * 3) * c.nv_ +
+               sizeof(long long) * 5 * c.nf_;
+    }
+
+    MappedFile file_;
+    header_t header_;
+    std::vector<std::size_t> offset_; // of every chunk_t
+
+    static void write_chunk__(std::ofstream &out, const Chunk &c) {
+        chunk_t ch;
+        ch.nv_ = c.vertexIds.size();
+        ch.nf_ = c.faceIds.size();
+        ch.bytes_ = chunk_bytes__(ch);
+        out.write(reinterpret_cast<const char *>(&ch), sizeof(ch));
+        if (ch.nv_) {
+            out.write(reinterpret_cast<const char *>(&c.vertexIds[0]),
+                      sizeof(long long) * ch.nv_);
+            out.write(reinterpret_cast<const char *>(&c.positions[0][0]),
+                      sizeof(double) * 3 * ch.nv_);
+        }
+        if (ch.nf_) {
+            out.write(reinterpret_cast<const char *>(&c.faceIds[0]),
+                      sizeof(long long) * ch.nf_);
+            out.write(reinterpret_cast<const char *>(&c.faces[0][0]),
+                      sizeof(long long) * 4 * ch.nf_);
+        }
+    }
+
+    // Closes the holes of a patch: splits the boundary halfedges bh (a, b)
+    // into simple loops and caps each loop with a fan of triangles around a
+    // new vertex at its centroid. What gets computed near the caps is wrong,
+    // but it never reaches the faces of the patch itself.
+    static void cap_holes__(std::vector<std::pair<int, int>> &bh,
+                            std::vector<Cvec3> &positions,
+                            std::vector<Cvec<int, 4>> &faces) {
+        std::sort(bh.begin(), bh.end());
+        std::vector<char> used(bh.size(), 0);
+        std::vector<int> at(positions.size(), -1); // index on the path
+        std::vector<int> path;
+        const auto next = [&](const int a) {
+            std::vector<std::pair<int, int>>::const_iterator it =
+                std::lower_bound(bh.begin(), bh.end(),
+                                 std::make_pair(a, INT_MIN));
+            for (; it != bh.end() && it->first == a; ++it) {
+                if (!used[it - bh.begin()])
+                    return int(it - bh.begin());
+            }
+            return -1;
+        };
+        for (std::size_t s = 0; s < bh.size(); ++s) {
+            if (used[s])
+                continue;
+            path.assign(1, bh[s].first);
+            at[path[0]] = 0;
+            for (int h = s; h >= 0; h = next(path.back())) {
+                used[h] = true;
+                const int b = bh[h].second;
+                if (at[b] < 0) {
+                    at[b] = path.size();
+                    path.push_back(b);
+                    continue;
+                }
+                // back at b: path[at[b]..] is a simple loop
+                const int c = positions.size(), first = at[b];
+                Cvec3 center;
+                for (std::size_t k = first; k < path.size(); ++k)
+                    center += positions[path[k]];
+                positions.push_back(center / double(path.size() - first));
+                for (std::size_t k = first; k < path.size(); ++k) {
+                    const int u = path[k],
+                              v = k + 1 < path.size() ? path[k + 1] : b;
+                    faces.push_back(Cvec<int, 4>(v, u, c, -1));
+                    if ((int)k > first)
+                        at[u] = -1;
+                }
+                path.resize(first + 1);
+            }
+            if (path.size() != 1)
+                throw std::runtime_error("Patch boundary is not closed.");
+            at[path[0]] = -1;
+        }
+    }
+
+  public:
+    // Subdivides control, which must be closed and manifold, levels times
+    // and writes the result to filename. Patches are sized so that their
+    // refined faces, without the halo, stay below maxPatchFaces.
+    static void write(Mesh &control, const int levels, const char filename[],
+                      const long long maxPatchFaces = 1 << 20) {
+        if (!control.isManifold() || control.hasBoundary())
+            throw std::runtime_error("Out-of-core subdivision needs a closed, "
+                                     "manifold mesh.");
+        const int nv0 = control.getNumVertices(),
+                  ne0 = control.getNumEdges(), nf0 = control.getNumFaces();
+
+        // Element counts of every level, as subdivide() makes them, and the
+        // first level-1 child of every control face
+        std::vector<long long> nv(levels + 1), ne(levels + 1), nf(levels + 1);
+        nv[0] = nv0;
+        ne[0] = ne0;
+        nf[0] = nf0;
+        for (int k = 0; k < levels; ++k) {
+            nv[k + 1] = nv[k] + ne[k] + nf[k];
+            ne[k + 1] = 4 * ne[k];
+            nf[k + 1] = 2 * ne[k];
+        }
+        std::vector<long long> firstChild(nf0);
+        for (long long i = 0, c = 0; i < nf0; ++i) {
+            firstChild[i] = c;
+            c += control.getFace(i).getNumVertices();
+        }
+
+        // Control edges by their endpoints, and faces around every vertex
+        const auto key = [nv0](const int a, const int b) {
+            return (unsigned long long)std::max(a, b) * nv0 + std::min(a, b);
+        };
+        std::unordered_map<unsigned long long, int> edgeOf(2 * ne0);
+        for (int i = 0; i < ne0; ++i) {
+            const Mesh::Edge e = control.getEdge(i);
+            edgeOf[key(e.getVertex(0).getIndex(), e.getVertex(1).getIndex())] =
+                i;
+        }
+        std::vector<int> ringOffset(nv0 + 1, 0), ringFace;
+        for (int i = 0; i < nv0; ++i) {
+            Mesh::VertexIterator it(control.getVertex(i).getIterator()),
+                it0(it);
+            do {
+                ringFace.push_back(it.getFace().f_);
+            } while (++it != it0);
+            ringOffset[i + 1] = ringFace.size();
+        }
+
+        // Patches are runs of faces sorted by their smallest vertex index
+        // along the Morton curve, as reorder() sorts them
+        std::vector<int> order(nf0);
+        {
+            Mesh sorted(control);
+            const std::vector<int> rank = sorted.reorder();
+            std::vector<std::pair<int, int>> k(nf0);
+            for (int i = 0; i < nf0; ++i) {
+                const Mesh::Face f = control.getFace(i);
+                int m = INT_MAX;
+                for (int j = 0; j < f.getNumVertices(); ++j)
+                    m = std::min(m, rank[f.getVertex(j).getIndex()]);
+                k[i] = std::make_pair(m, i);
+            }
+            std::sort(k.begin(), k.end());
+            for (int i = 0; i < nf0; ++i)
+                order[i] = k[i].second;
+        }
+        const long long perFace = 1LL << (2 * levels);
+        const int patchSize =
+            std::max<long long>(1, std::min<long long>(maxPatchFaces / perFace,
+                                                       nf0));
+
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        if (!out)
+            throw std::runtime_error(std::string("Cannot write file ") +
+                                     filename);
+        header_t h;
+        std::memcpy(h.magic_, magic__(), 8);
+        h.version_ = VERSION;
+        h.byte_order_ = ENDIAN_MARK;
+        h.levels_ = levels;
+        h.num_chunks_ = 0;
+        h.nv_ = nv[levels];
+        h.nf_ = nf[levels];
+        out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+
+        std::vector<char> inPatch(nf0, 0), inHalo(nf0, 0);
+        std::vector<int> local(nv0, -1), halo;
+        std::vector<Cvec3> positions;
+        std::vector<Cvec<int, 4>> faces;
+        std::vector<std::pair<int, int>> boundary;
+        // the ids at the current level of the patch elements (-1 for the
+        // caps), and whether a face belongs to the patch proper
+        std::vector<long long> gv, ge, gf, nextE, nextF;
+        std::vector<char> own, nextOwn;
+        Chunk c;
+        for (int p0 = 0; p0 < nf0; p0 += patchSize) {
+            const int p1 = std::min(nf0, p0 + patchSize);
+
+            // the patch, plus every face that shares a vertex with it, in
+            // control order so that iteration orders match the whole mesh
+            halo.clear();
+            for (int i = p0; i < p1; ++i) {
+                inPatch[order[i]] = true;
+                const Mesh::Face f = control.getFace(order[i]);
+                for (int j = 0; j < f.getNumVertices(); ++j) {
+                    const int v = f.getVertex(j).getIndex();
+                    for (int r = ringOffset[v]; r < ringOffset[v + 1]; ++r) {
+                        if (!inHalo[ringFace[r]]) {
+                            inHalo[ringFace[r]] = true;
+                            halo.push_back(ringFace[r]);
+                        }
+                    }
+                }
+            }
+            std::sort(halo.begin(), halo.end());
+            positions.clear();
+            faces.clear();
+            boundary.clear();
+            gv.clear();
+            gf.clear();
+            own.clear();
+            for (std::size_t i = 0; i < halo.size(); ++i) {
+                const Mesh::Face f = control.getFace(halo[i]);
+                const int n = f.getNumVertices();
+                Cvec<int, 4> lf(-1);
+                for (int j = 0; j < n; ++j) {
+                    const int v = f.getVertex(j).getIndex();
+                    if (local[v] < 0) {
+                        local[v] = positions.size();
+                        positions.push_back(f.getVertex(j).getPosition());
+                        gv.push_back(v);
+                    }
+                    lf[j] = local[v];
+                }
+                for (int j = 0; j < n; ++j) {
+                    const int a = f.getVertex(j).getIndex(),
+                              b = f.getVertex((j + 1) % n).getIndex();
+                    const Mesh::Edge e = control.getEdge(edgeOf[key(a, b)]);
+                    const int other = e.getFace(0).f_ == halo[i]
+                                          ? e.getFace(1).f_
+                                          : e.getFace(0).f_;
+                    if (!inHalo[other])
+                        boundary.push_back(
+                            std::make_pair(lf[j], lf[(j + 1) % n]));
+                }
+                faces.push_back(lf);
+                gf.push_back(halo[i]);
+                own.push_back(inPatch[halo[i]]);
+            }
+            cap_holes__(boundary, positions, faces);
+            gv.resize(positions.size(), -1);
+            gf.resize(faces.size(), -1);
+            own.resize(faces.size(), 0);
+
+            Mesh m;
+            m.setParallel(control.isParallel());
+            m.build(positions, faces);
+            if (!m.isManifold() || m.hasBoundary())
+                throw std::runtime_error("Cannot close the halo of a patch.");
+            ge.assign(m.getNumEdges(), -1);
+            for (int i = 0; i < m.getNumEdges(); ++i) {
+                const Mesh::Edge e = m.getEdge(i);
+                const long long a = gv[e.getVertex(0).getIndex()],
+                                b = gv[e.getVertex(1).getIndex()];
+                if (a >= 0 && b >= 0)
+                    ge[i] = edgeOf[key(a, b)];
+            }
+
+            // Follow the ids through the numbering of subdivide(): v-vertices
+            // keep their index, e- and f-vertices come after them, edge e
+            // splits into 4e..4e+3, and face f into one child per corner
+            for (int k = 0; k < levels; ++k) {
+                m.computeCatmullClarkPoints();
+                const int lv = m.getNumVertices(), le = m.getNumEdges(),
+                          lf = m.getNumFaces();
+                gv.resize(lv + le + lf);
+                nextE.resize(4 * le);
+                for (int i = 0; i < le; ++i) {
+                    gv[lv + i] = ge[i] < 0 ? -1 : nv[k] + ge[i];
+                    for (int s = 0; s < 4; ++s)
+                        nextE[4 * i + s] = ge[i] < 0 ? -1 : 4 * ge[i] + s;
+                }
+                nextF.clear();
+                nextOwn.clear();
+                for (int i = 0; i < lf; ++i) {
+                    gv[lv + le + i] = gf[i] < 0 ? -1 : nv[k] + ne[k] + gf[i];
+                    const long long first =
+                        gf[i] < 0 ? -1 : k == 0 ? firstChild[gf[i]] : 4 * gf[i];
+                    for (int j = 0; j < m.getFace(i).getNumVertices(); ++j) {
+                        nextF.push_back(first < 0 ? -1 : first + j);
+                        nextOwn.push_back(own[i]);
+                    }
+                }
+                ge.swap(nextE);
+                gf.swap(nextF);
+                own.swap(nextOwn);
+                m.subdivide();
+            }
+
+            // the patch's own faces and their vertices
+            c.vertexIds.clear();
+            c.positions.clear();
+            c.faceIds.clear();
+            c.faces.clear();
+            std::vector<int> chunkIndex(m.getNumVertices(), -1);
+            for (int i = 0; i < m.getNumFaces(); ++i) {
+                if (!own[i])
+                    continue;
+                const Mesh::Face f = m.getFace(i);
+                Cvec<long long, 4> cf(-1);
+                for (int j = 0; j < f.getNumVertices(); ++j) {
+                    const int v = f.getVertex(j).getIndex();
+                    cf[j] = gv[v];
+                    if (gv[v] < 0 || gf[i] < 0)
+                        throw std::runtime_error(
+                            "Patch face depends on its halo cap.");
+                    if (chunkIndex[v] < 0) {
+                        chunkIndex[v] = c.vertexIds.size();
+                        c.vertexIds.push_back(gv[v]);
+                        c.positions.push_back(f.getVertex(j).getPosition());
+                    }
+                }
+                c.faceIds.push_back(gf[i]);
+                c.faces.push_back(cf);
+            }
+            write_chunk__(out, c);
+            ++h.num_chunks_;
+
+            for (int i = p0; i < p1; ++i)
+                inPatch[order[i]] = false;
+            for (std::size_t i = 0; i < halo.size(); ++i) {
+                inHalo[halo[i]] = false;
+                const Mesh::Face f = control.getFace(halo[i]);
+                for (int j = 0; j < f.getNumVertices(); ++j)
+                    local[f.getVertex(j).getIndex()] = -1;
+            }
+        }
+        out.seekp(0);
+        out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        if (!out)
+            throw std::runtime_error(std::string("Cannot write file ") +
+                                     filename);
+    }
+
+    // Opens a file written by write()
+    explicit ChunkedSubdivision(const char filename[]) : file_(filename) {
+        if (file_.size() < sizeof(header_))
+            throw std::runtime_error(std::string("Truncated chunk file ") +
+                                     filename);
+        std::memcpy(&header_, file_.data(), sizeof(header_));
+        if (!std::equal(header_.magic_, header_.magic_ + 8, magic__()) ||
+            header_.byte_order_ != ENDIAN_MARK || header_.version_ != VERSION)
+            throw std::runtime_error(
+                std::string("Not a chunk file of this version and byte "
+                            "order ") +
+                filename);
+        std::size_t at = sizeof(header_);
+        for (unsigned i = 0; i < header_.num_chunks_; ++i) {
+            chunk_t ch;
+            if (file_.size() < at + sizeof(ch))
+                throw std::runtime_error(
+                    std::string("Truncated chunk file ") + filename);
+            std::memcpy(&ch, file_.data() + at, sizeof(ch));
+            if (ch.bytes_ != chunk_bytes__(ch) ||
+                file_.size() < at + sizeof(ch) + ch.bytes_)
+                throw std::runtime_error(
+                    std::string("Truncated chunk file ") + filename);
+            offset_.push_back(at);
+            at += sizeof(ch) + ch.bytes_;
+        }
+    }
+
+    int getNumChunks() const { return offset_.size(); }
+    int getNumLevels() const { return header_.levels_; }
+    // Of the whole refined mesh
+    long long getNumVertices() const { return header_.nv_; }
+    long long getNumFaces() const { return header_.nf_; }
+
+    void readChunk(const int i, Chunk &c) const {
+        chunk_t ch;
+        const char *p = file_.data() + offset_[i];
+        std::memcpy(&ch, p, sizeof(ch));
+        p += sizeof(ch);
+        c.vertexIds.resize(ch.nv_);
+        c.positions.resize(ch.nv_);
+        c.faceIds.resize(ch.nf_);
+        c.faces.resize(ch.nf_);
+        if (ch.nv_) {
+            std::memcpy(&c.vertexIds[0], p, sizeof(long long) * ch.nv_);
+            p += sizeof(long long) * ch.nv_;
+            std::memcpy(&c.positions[0][0], p, sizeof(double) * 3 * ch.nv_);
+            p += sizeof(double) * 3 * ch.nv_;
+        }
+        if (ch.nf_) {
+            std::memcpy(&c.faceIds[0], p, sizeof(long long) * ch.nf_);
+            p += sizeof(long long) * ch.nf_;
+            std::memcpy(&c.faces[0][0], p, sizeof(long long) * 4 * ch.nf_);
+        }
+    }
+};
+
+#endif
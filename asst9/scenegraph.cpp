@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cmath>
 
 #include "scenegraph.h"
 
@@ -70,3 +71,28 @@ RigTForm getPathAccumRbt(shared_ptr<SgTransformNode> source,
     source->accept(accum);
     return accum.getAccumulatedRbt(offsetFromDestination);
 }
+
+void SgGeometryShapeNode::selectLevelOfDetail(const Matrix4 &MVM,
+                                              double pixelsPerUnit) {
+    if (lodGeometries.empty())
+        return;
+    // Radius of the bounding sphere on screen, in pixels, with the largest
+    // scaling of the model view matrix
+    double scale2 = 0;
+    for (int j = 0; j < 3; ++j) {
+        scale2 = max(scale2, MVM(0, j) * MVM(0, j) + MVM(1, j) * MVM(1, j) +
+                                 MVM(2, j) * MVM(2, j));
+    }
+    const double radius = lodRadius * sqrt(scale2);
+    const double depth = -(MVM * Cvec4(lodCenter, 1))[2];
+    int level = 0;
+    if (depth > radius) {
+        const double pixels = radius * pixelsPerUnit / depth;
+        const double wanted = CS175_PI * pixels * pixels / lodPixelsPerTriangle;
+        level = lodGeometries.size() - 1;
+        while (level > 0 && lodNumTriangles[level] < wanted)
+            --level;
+    }
+    lodLevel = level;
+    geometry = lodGeometries[level];
+}
@@ -60,6 +60,15 @@ class SgShapeNode : public SgNode {
 
     virtual Matrix4 getAffineMatrix() = 0;
     virtual void draw(const Uniforms &uniforms) = 0;
+
+    // Called before draw() with the model view matrix and the number of
+    // pixels a unit length covers at unit distance from the eye, so that
+    // shapes can pick a level of detail by their size on screen
+    virtual void selectLevelOfDetail(const Matrix4 &MVM, double pixelsPerUnit) {}
+
+    // Called before draw() with the model view and projection matrices, so
+    // that shapes can leave out what is out of view
+    virtual void cull(const Matrix4 &MVM, const Matrix4 &projection) {}
 };
 
 // Visitor class for the scene graph nodes. If any of the
@@ -109,6 +118,18 @@ class SgGeometryShapeNode : public SgShapeNode {
     std::shared_ptr<Material> material;
     Matrix4 affineMatrix;
 
+    // Optional levels of detail, finest first, with their triangle counts
+    // and a bounding sphere in the geometry's frame. When there are any,
+    // selectLevelOfDetail() points geometry at the coarsest one that still
+    // has a triangle per lodPixelsPerTriangle pixels of the sphere's screen
+    // area.
+    std::vector<std::shared_ptr<Geometry>> lodGeometries;
+    std::vector<int> lodNumTriangles;
+    Cvec3 lodCenter;
+    double lodRadius;
+    double lodPixelsPerTriangle;
+    int lodLevel; // the level last picked
+
     SgGeometryShapeNode(std::shared_ptr<Geometry> _geometry,
                         std::shared_ptr<Material> _material,
                         const Cvec3 &translation = Cvec3(0, 0, 0),
@@ -119,7 +140,8 @@ class SgGeometryShapeNode : public SgShapeNode {
                        Matrix4::makeXRotation(eulerAngles[0]) *
                        Matrix4::makeYRotation(eulerAngles[1]) *
                        Matrix4::makeZRotation(eulerAngles[2]) *
-                       Matrix4::makeScale(scales)) {}
+                       Matrix4::makeScale(scales)),
+          lodRadius(0), lodPixelsPerTriangle(8), lodLevel(0) {}
 
     virtual Matrix4 getAffineMatrix() { return affineMatrix; }
 
@@ -133,6 +155,27 @@ class SgGeometryShapeNode : public SgShapeNode {
                        Matrix4::makeScale(scales);
     }
 
+    void setLevelsOfDetail(
+        const std::vector<std::shared_ptr<Geometry>> &geometries,
+        const std::vector<int> &numTriangles, const Cvec3 &center,
+        const double radius) {
+        if (geometries.empty() || geometries.size() != numTriangles.size())
+            throw std::runtime_error(
+                "Need one triangle count per level of detail");
+        lodGeometries = geometries;
+        lodNumTriangles = numTriangles;
+        lodCenter = center;
+        lodRadius = radius;
+        lodLevel = 0;
+        geometry = geometries[0];
+    }
+
+    virtual void selectLevelOfDetail(const Matrix4 &MVM, double pixelsPerUnit);
+
+    virtual void cull(const Matrix4 &MVM, const Matrix4 &projection) {
+        geometry->cull(MVM, projection);
+    }
+
     virtual void draw(const Uniforms &uniforms) {
         if (g_overridingMaterial)
             g_overridingMaterial->draw(*geometry, uniforms);
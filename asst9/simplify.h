@@ -0,0 +1,331 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <queue>
+#include <vector>
+
+#include "cvec.h"
+#include "mesh.h"
+
+// Quadric error metric simplification, after Garland and Heckbert,
+// "Surface Simplification Using Quadric Error Metrics", with half-edge
+// collapses: an edge (u, v) is collapsed by moving u onto v, so every
+// vertex of a simplified mesh is one of the original vertices.
+//
+//   MeshSimplifier s(bunny);
+//   s.simplify(1000);    // down to at most 1000 triangles
+//   Mesh lod;
+//   s.getMesh(lod);
+//   s.simplify(250);     // keeps going from where it stopped
+//
+// Quads are split into triangles first. Collapses that would fold a
+// triangle over, or change the topology of the surface, are skipped, so the
+// result stays a manifold and may stop short of the requested budget.
+//
+// The collapses run on a triangle list of the simplifier's own, with the
+// live triangles of every vertex, rather than on the faces and edges of the
+// Mesh: its topology is shared and immutable, with edges and halfedges
+// packed into codes by index, so every collapse would mean renumbering
+// faces and edges. getMesh() builds a Mesh from the live triangles.
+class MeshSimplifier {
+    // Symmetric 4x4 matrix of a sum of squared plane distances, upper
+    // triangle in row-major order
+    struct quadric_t {
+        double q_[10];
+
+        quadric_t() { std::fill(q_, q_ + 10, 0.0); }
+        // Quadric of the plane dot(n, x) + d = 0 with weight w
+        quadric_t(const Cvec3 &n, const double d, const double w) {
+            const double p[4] = {n[0], n[1], n[2], d};
+            for (int i = 0, k = 0; i < 4; ++i) {
+                for (int j = i; j < 4; ++j)
+                    q_[k++] = w * p[i] * p[j];
+            }
+        }
+        quadric_t &operator+=(const quadric_t &b) {
+            for (int i = 0; i < 10; ++i)
+                q_[i] += b.q_[i];
+            return *this;
+        }
+        double error(const Cvec3 &p) const {
+            const double x = p[0], y = p[1], z = p[2];
+            return q_[0] * x * x + 2 * q_[1] * x * y + 2 * q_[2] * x * z +
+                   2 * q_[3] * x + q_[4] * y * y + 2 * q_[5] * y * z +
+                   2 * q_[6] * y + q_[7] * z * z + 2 * q_[8] * z + q_[9];
+        }
+    };
+    // A candidate collapse of u onto v. Entries go stale when either
+    // endpoint changes, which stamp_ tells apart.
+    struct collapse_t {
+        double cost_;
+        int u_, v_;
+        unsigned stamp_u_, stamp_v_;
+
+        bool operator<(const collapse_t &c) const { return cost_ > c.cost_; }
+    };
+
+    std::vector<Cvec3> position_;
+    std::vector<Cvec<int, 3>> tri_;
+    std::vector<char> tri_alive_;
+    std::vector<std::vector<int>> vertex_tris_; // live triangles of a vertex
+    std::vector<quadric_t> quadric_;
+    std::vector<unsigned> stamp_;
+    std::priority_queue<collapse_t> queue_;
+    int num_tris_;
+
+    static Cvec3 tri_normal__(const Cvec3 &a, const Cvec3 &b, const Cvec3 &c) {
+        return cross(b - a, c - a);
+    }
+    // The neighbors of v, unsorted and with repeats
+    void neighbors__(const int v, std::vector<int> &out) const {
+        out.clear();
+        for (std::size_t i = 0; i < vertex_tris_[v].size(); ++i) {
+            const Cvec<int, 3> &t = tri_[vertex_tris_[v][i]];
+            for (int k = 0; k < 3; ++k) {
+                if (t[k] != v)
+                    out.push_back(t[k]);
+            }
+        }
+    }
+    // Whether v has an edge with a single triangle. Around inner vertices
+    // every neighbor shows up in exactly two triangles.
+    bool is_boundary__(const int v) const {
+        std::vector<int> n;
+        neighbors__(v, n);
+        std::sort(n.begin(), n.end());
+        for (std::size_t i = 0; i < n.size(); i += 2) {
+            if (i + 1 == n.size() || n[i] != n[i + 1])
+                return true;
+        }
+        return false;
+    }
+    void push__(const int u, const int v) {
+        quadric_t q = quadric_[u];
+        q += quadric_[v];
+        const collapse_t c = {q.error(position_[v]), u, v, stamp_[u],
+                              stamp_[v]};
+        queue_.push(c);
+    }
+    // Whether u can move onto v: the edge has to be there, the vertices
+    // both triangles of the edge have opposite to it must be the only
+    // neighbors u and v share (the link condition), and no other triangle of
+    // u may flip or collapse
+    bool can_collapse__(const int u, const int v, std::vector<int> &nu,
+                        std::vector<int> &nv) const {
+        std::vector<int> opposite;
+        for (std::size_t i = 0; i < vertex_tris_[u].size(); ++i) {
+            const Cvec<int, 3> &t = tri_[vertex_tris_[u][i]];
+            if (t[0] == v || t[1] == v || t[2] == v) {
+                for (int k = 0; k < 3; ++k) {
+                    if (t[k] != u && t[k] != v)
+                        opposite.push_back(t[k]);
+                }
+            }
+        }
+        if (opposite.empty() || opposite.size() > 2)
+            return false;
+        neighbors__(u, nu);
+        neighbors__(v, nv);
+        std::sort(nu.begin(), nu.end());
+        nu.erase(std::unique(nu.begin(), nu.end()), nu.end());
+        std::sort(nv.begin(), nv.end());
+        nv.erase(std::unique(nv.begin(), nv.end()), nv.end());
+        std::vector<int> shared;
+        std::set_intersection(nu.begin(), nu.end(), nv.begin(), nv.end(),
+                              std::back_inserter(shared));
+        if (shared.size() != opposite.size())
+            return false;
+        // an inner edge between two boundary vertices would pinch the
+        // surface together, and the last edges of a tetrahedron flatten it
+        if (opposite.size() == 2 &&
+            ((is_boundary__(u) && is_boundary__(v)) ||
+             (nu.size() <= 3 && nv.size() <= 3)))
+            return false;
+
+        for (std::size_t i = 0; i < vertex_tris_[u].size(); ++i) {
+            const Cvec<int, 3> &t = tri_[vertex_tris_[u][i]];
+            if (t[0] == v || t[1] == v || t[2] == v)
+                continue;
+            Cvec3 p[3];
+            for (int k = 0; k < 3; ++k)
+                p[k] = position_[t[k] == u ? v : t[k]];
+            const Cvec3 before = tri_normal__(position_[t[0]], position_[t[1]],
+                                              position_[t[2]]),
+                        after = tri_normal__(p[0], p[1], p[2]);
+            // reject flips and slivers
+            if (dot(before, after) <=
+                0.2 * std::sqrt(norm2(before) * norm2(after)))
+                return false;
+        }
+        return true;
+    }
+    void collapse__(const int u, const int v, std::vector<int> &nv) {
+        std::vector<int> &tv = vertex_tris_[v];
+        for (std::size_t i = 0; i < vertex_tris_[u].size(); ++i) {
+            const int ti = vertex_tris_[u][i];
+            Cvec<int, 3> &t = tri_[ti];
+            if (t[0] == v || t[1] == v || t[2] == v) {
+                // the triangle disappears from the lists of all its vertices
+                tri_alive_[ti] = 0;
+                --num_tris_;
+                for (int k = 0; k < 3; ++k) {
+                    if (t[k] != u) {
+                        std::vector<int> &l = vertex_tris_[t[k]];
+                        l.erase(std::find(l.begin(), l.end(), ti));
+                    }
+                }
+            } else {
+                for (int k = 0; k < 3; ++k) {
+                    if (t[k] == u)
+                        t[k] = v;
+                }
+                tv.push_back(ti);
+            }
+        }
+        std::vector<int>().swap(vertex_tris_[u]);
+        quadric_[v] += quadric_[u];
+        ++stamp_[u];
+        ++stamp_[v];
+        // v changed, so every edge around it needs a fresh cost. Entries of
+        // other edges keep their cost, as their quadrics did not change, and
+        // those of u go stale with it.
+        std::vector<int> &n = nv;
+        neighbors__(v, n);
+        std::sort(n.begin(), n.end());
+        n.erase(std::unique(n.begin(), n.end()), n.end());
+        for (std::size_t i = 0; i < n.size(); ++i) {
+            push__(v, n[i]);
+            push__(n[i], v);
+        }
+    }
+
+  public:
+    explicit MeshSimplifier(Mesh &m)
+        : position_(m.getNumVertices()), vertex_tris_(m.getNumVertices()),
+          quadric_(m.getNumVertices()), stamp_(m.getNumVertices(), 0) {
+        for (int i = 0; i < m.getNumVertices(); ++i)
+            position_[i] = m.getVertex(i).getPosition();
+        for (int i = 0; i < m.getNumFaces(); ++i) {
+            const Mesh::Face f = m.getFace(i);
+            for (int j = 1; j + 1 < f.getNumVertices(); ++j) {
+                tri_.push_back(Cvec<int, 3>(f.getVertex(0).getIndex(),
+                                            f.getVertex(j).getIndex(),
+                                            f.getVertex(j + 1).getIndex()));
+            }
+        }
+        num_tris_ = tri_.size();
+        tri_alive_.assign(tri_.size(), 1);
+
+        // Each vertex starts with the area-weighted planes of its triangles
+        for (std::size_t i = 0; i < tri_.size(); ++i) {
+            const Cvec<int, 3> &t = tri_[i];
+            const Cvec3 n = tri_normal__(position_[t[0]], position_[t[1]],
+                                         position_[t[2]]);
+            const double l = std::sqrt(norm2(n));
+            if (l > 0) {
+                const quadric_t q(n / l, -dot(n / l, position_[t[0]]), l / 2);
+                for (int k = 0; k < 3; ++k)
+                    quadric_[t[k]] += q;
+            }
+            for (int k = 0; k < 3; ++k)
+                vertex_tris_[t[k]].push_back(i);
+        }
+        // Boundary edges, which have a single triangle, get a heavy plane
+        // through them perpendicular to the triangle to hold them in place
+        std::vector<int> n;
+        for (std::size_t i = 0; i < tri_.size(); ++i) {
+            const Cvec<int, 3> &t = tri_[i];
+            for (int k = 0; k < 3; ++k) {
+                const int a = t[k], b = t[(k + 1) % 3];
+                int count = 0;
+                for (std::size_t j = 0; j < vertex_tris_[a].size(); ++j) {
+                    const Cvec<int, 3> &s = tri_[vertex_tris_[a][j]];
+                    count += s[0] == b || s[1] == b || s[2] == b;
+                }
+                if (count != 1)
+                    continue;
+                const Cvec3 e = position_[b] - position_[a];
+                Cvec3 p = cross(e, tri_normal__(position_[t[0]],
+                                                position_[t[1]],
+                                                position_[t[2]]));
+                const double l = std::sqrt(norm2(p));
+                if (l == 0)
+                    continue;
+                p /= l;
+                const quadric_t q(p, -dot(p, position_[a]), 1000 * norm2(e));
+                quadric_[a] += q;
+                quadric_[b] += q;
+            }
+        }
+        for (int v = 0; v < (int)position_.size(); ++v) {
+            neighbors__(v, n);
+            std::sort(n.begin(), n.end());
+            n.erase(std::unique(n.begin(), n.end()), n.end());
+            for (std::size_t i = 0; i < n.size(); ++i)
+                push__(v, n[i]);
+        }
+    }
+
+    int getNumTriangles() const { return num_tris_; }
+
+    // Collapses the cheapest edges until at most maxTriangles are left, or
+    // no collapse is allowed anymore. Returns the number of triangles left.
+    int simplify(const int maxTriangles) {
+        std::vector<int> nu, nv;
+        while (num_tris_ > maxTriangles && !queue_.empty()) {
+            const collapse_t c = queue_.top();
+            queue_.pop();
+            if (c.stamp_u_ != stamp_[c.u_] || c.stamp_v_ != stamp_[c.v_] ||
+                vertex_tris_[c.u_].empty())
+                continue;
+            if (can_collapse__(c.u_, c.v_, nu, nv))
+                collapse__(c.u_, c.v_, nv);
+        }
+        return num_tris_;
+    }
+
+    // Builds m from the triangles left, dropping the vertices they no longer
+    // use. Vertices keep their relative order.
+    void getMesh(Mesh &m) const {
+        std::vector<int> index(position_.size(), -1);
+        std::vector<Cvec3> positions;
+        for (std::size_t v = 0; v < position_.size(); ++v) {
+            if (!vertex_tris_[v].empty()) {
+                index[v] = positions.size();
+                positions.push_back(position_[v]);
+            }
+        }
+        std::vector<Cvec<int, 4>> faces;
+        faces.reserve(num_tris_);
+        for (std::size_t i = 0; i < tri_.size(); ++i) {
+            if (tri_alive_[i]) {
+                const Cvec<int, 3> &t = tri_[i];
+                faces.push_back(
+                    Cvec<int, 4>(index[t[0]], index[t[1]], index[t[2]], -1));
+            }
+        }
+        m.build(positions, faces);
+    }
+};
+
+// Simplifies m down to each of the triangle budgets in turn, largest first,
+// and returns the resulting levels of detail, starting with m itself
+inline std::vector<Mesh> makeLodChain(Mesh &m, std::vector<int> budgets) {
+    std::sort(budgets.begin(), budgets.end(), std::greater<int>());
+    std::vector<Mesh> chain(1, m);
+    MeshSimplifier s(m);
+    for (std::size_t i = 0; i < budgets.size(); ++i) {
+        const int before = s.getNumTriangles();
+        if (s.simplify(budgets[i]) == before)
+            continue; // already there, or stuck
+        chain.push_back(Mesh());
+        s.getMesh(chain.back());
+    }
+    return chain;
+}
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef STENCILS_H
+#define STENCILS_H
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "cvec.h"
+#include "mesh.h"
+#include "threadpool.h"
+
+// Catmull-Clark subdivision of a fixed topology as a precomputed sparse
+// linear map. Every vertex of the level-N mesh is a weighted sum (a stencil)
+// of control mesh vertices, so when only the control positions change, e.g.
+// in an animation, refining them again is a single sparse matrix-vector
+// product instead of N rounds of subdivide().
+//
+//   Mesh refined;
+//   SubdivisionStencils stencils(control, 3, refined, true);
+//   ...  // move control vertices
+//   stencils.refine(control, refined);      // level 3 positions
+//   stencils.limit(control, refined);       // or limit positions + normals
+//
+// Optionally the table also holds the stencils of the Catmull-Clark limit
+// surface at the level-N vertices: the limit position and two tangents,
+// whose cross product gives the limit normal.
+class SubdivisionStencils {
+    // A sparse matrix in compressed-sparse-row layout: row i is the weighted
+    // sum of the control vertices index_[j] for j in [offset_[i],
+    // offset_[i + 1]), with index_ increasing within each row
+    template <typename T> struct table_t {
+        std::vector<int> offset_;
+        std::vector<int> index_;
+        std::vector<T> weight_;
+
+        table_t() : offset_(1, 0) {}
+        int rows() const { return offset_.size() - 1; }
+    };
+    // Stencils are built in double precision and stored as floats, which
+    // halves the memory traffic of the per-frame products
+    typedef table_t<double> build_table;
+    typedef table_t<float> table;
+
+    // Sums weighted rows of tables into one new row, with a dense scratch
+    // array over the control vertices
+    struct accumulator_t {
+        std::vector<double> value_;
+        std::vector<char> used_;
+        std::vector<int> touched_;
+
+        explicit accumulator_t(const int n) : value_(n, 0), used_(n, 0) {}
+        void add(const build_table &t, const int row, const double w) {
+            for (int j = t.offset_[row]; j < t.offset_[row + 1]; ++j) {
+                const int c = t.index_[j];
+                if (!used_[c]) {
+                    used_[c] = 1;
+                    touched_.push_back(c);
+                }
+                value_[c] += w * t.weight_[j];
+            }
+        }
+        template <typename T> void flush(table_t<T> &t) {
+            std::sort(touched_.begin(), touched_.end());
+            for (std::size_t i = 0; i < touched_.size(); ++i) {
+                const int c = touched_[i];
+                t.index_.push_back(c);
+                t.weight_.push_back(T(value_[c]));
+                value_[c] = 0;
+                used_[c] = 0;
+            }
+            touched_.clear();
+            t.offset_.push_back(t.index_.size());
+        }
+    };
+
+    int num_control_;
+    int levels_;
+    table refine_;
+    table limit_, tangent0_, tangent1_; // empty unless built with limits
+
+    static void check_topology__(const Mesh &m) {
+        if (!m.isManifold())
+            throw std::runtime_error(
+                "Subdivision stencils do not support non manifold mesh.");
+        if (m.hasBoundary())
+            throw std::runtime_error(
+                "Subdivision stencils do not support mesh with boundaries.");
+    }
+    static build_table identity__(const int n) {
+        build_table t;
+        for (int i = 0; i < n; ++i) {
+            t.index_.push_back(i);
+            t.weight_.push_back(1);
+            t.offset_.push_back(i + 1);
+        }
+        return t;
+    }
+    // Stencils of the next level of m, whose current vertices have stencils
+    // t, in the order subdivide() numbers the new vertices: v-vertices, then
+    // e-vertices, then f-vertices
+    static build_table next_level__(Mesh &m, const build_table &t,
+                                    accumulator_t &acc) {
+        build_table f;
+        for (int i = 0; i < m.getNumFaces(); ++i) {
+            const Mesh::Face face = m.getFace(i);
+            const int n = face.getNumVertices();
+            for (int j = 0; j < n; ++j)
+                acc.add(t, face.getVertex(j).getIndex(), 1.0 / n);
+            acc.flush(f);
+        }
+        build_table next;
+        for (int i = 0; i < m.getNumVertices(); ++i) {
+            const Mesh::Vertex v = m.getVertex(i);
+            int n = 0;
+            Mesh::VertexIterator it(v.getIterator()), it0(it);
+            do {
+                ++n;
+            } while (++it != it0);
+            acc.add(t, i, (n - 2.0) / n);
+            do {
+                acc.add(t, it.getVertex().getIndex(), 1.0 / (n * n));
+                acc.add(f, it.getFace().f_, 1.0 / (n * n));
+            } while (++it != it0);
+            acc.flush(next);
+        }
+        for (int i = 0; i < m.getNumEdges(); ++i) {
+            const Mesh::Edge e = m.getEdge(i);
+            acc.add(t, e.getVertex(0).getIndex(), 0.25);
+            acc.add(t, e.getVertex(1).getIndex(), 0.25);
+            acc.add(f, e.getFace(0).f_, 0.25);
+            acc.add(f, e.getFace(1).f_, 0.25);
+            acc.flush(next);
+        }
+        for (int i = 0; i < f.rows(); ++i) {
+            acc.add(f, i, 1);
+            acc.flush(next);
+        }
+        return next;
+    }
+    // Limit position and tangent stencils at the vertices of the all-quad
+    // mesh m, following Halstead et al., "Efficient, Fair Interpolation using
+    // Catmull-Clark Surfaces". Around a vertex of valence n, e_i are the edge
+    // neighbors and q_i the opposite corners of the quads between e_i and
+    // e_(i+1), in VertexIterator order.
+    void init_limit__(Mesh &m, const build_table &t, accumulator_t &acc) {
+        const double PI = 3.14159265358979323846;
+        std::vector<int> e, q;
+        for (int i = 0; i < m.getNumVertices(); ++i) {
+            const Mesh::Vertex v = m.getVertex(i);
+            e.clear();
+            q.clear();
+            Mesh::VertexIterator it(v.getIterator()), it0(it);
+            do {
+                const Mesh::Face face = it.getFace();
+                if (face.getNumVertices() != 4)
+                    throw std::runtime_error(
+                        "Limit stencils need an all-quad mesh; subdivide it "
+                        "at least once.");
+                int c = 0;
+                while (face.getVertex(c).getIndex() != i)
+                    ++c;
+                e.push_back(it.getVertex().getIndex());
+                q.push_back(face.getVertex((c + 2) % 4).getIndex());
+            } while (++it != it0);
+            const int n = e.size();
+
+            // (n^2 v + 4 sum e_i + sum q_i) / (n (n + 5))
+            const double s = 1.0 / (n * (n + 5));
+            acc.add(t, i, n * n * s);
+            for (int j = 0; j < n; ++j) {
+                acc.add(t, e[j], 4 * s);
+                acc.add(t, q[j], s);
+            }
+            acc.flush(limit_);
+
+            // Tangents toward e_0 and toward e_1
+            const double a = 1 + std::cos(2 * PI / n) +
+                             std::cos(PI / n) *
+                                 std::sqrt(2 * (9 + std::cos(2 * PI / n)));
+            for (int k = 0; k < 2; ++k) {
+                for (int j = 0; j < n; ++j) {
+                    const double c0 = std::cos(2 * PI * (j - k) / n),
+                                 c1 = std::cos(2 * PI * (j + 1 - k) / n);
+                    acc.add(t, e[j], a * c0);
+                    acc.add(t, q[j], c0 + c1);
+                }
+                acc.flush(k == 0 ? tangent0_ : tangent1_);
+            }
+        }
+    }
+    static void store__(const build_table &t, table &out) {
+        out.offset_ = t.offset_;
+        out.index_ = t.index_;
+        out.weight_.assign(t.weight_.begin(), t.weight_.end());
+    }
+
+    static Cvec3 apply_row__(const table &t, const int row,
+                             const Cvec3 control[]) {
+        Cvec3 p;
+        for (int j = t.offset_[row], e = t.offset_[row + 1]; j < e; ++j)
+            p += control[t.index_[j]] * double(t.weight_[j]);
+        return p;
+    }
+    template <typename F>
+    static void for_rows__(const int n, F fn, const bool parallel) {
+        if (parallel)
+            ThreadPool::shared().parallelFor(0, n, fn, 256);
+        else
+            fn(0, n);
+    }
+    static std::vector<Cvec3> positions__(Mesh &m) {
+        std::vector<Cvec3> p(m.getNumVertices());
+        for (int i = 0; i < m.getNumVertices(); ++i)
+            p[i] = m.getVertex(i).getPosition();
+        return p;
+    }
+
+  public:
+    // Builds the stencils of levels levels of subdivision of control, which
+    // must be closed and manifold, and sets refined to the subdivided mesh
+    // (with the positions of the control mesh). withLimit also builds the
+    // limit stencils, which needs levels >= 1 unless control is all quads.
+    SubdivisionStencils(Mesh &control, const int levels, Mesh &refined,
+                        const bool withLimit = false)
+        : num_control_(control.getNumVertices()), levels_(levels) {
+        check_topology__(control);
+        refined = control;
+        accumulator_t acc(num_control_);
+        build_table t = identity__(num_control_);
+        for (int level = 0; level < levels; ++level) {
+            build_table next = next_level__(refined, t, acc);
+            t.offset_.swap(next.offset_);
+            t.index_.swap(next.index_);
+            t.weight_.swap(next.weight_);
+            refined.subdivide();
+        }
+        if (withLimit)
+            init_limit__(refined, t, acc);
+        store__(t, refine_);
+        refine(control, refined);
+    }
+
+    int getNumLevels() const { return levels_; }
+    int getNumControlVertices() const { return num_control_; }
+    int getNumVertices() const { return refine_.rows(); }
+    bool hasLimit() const { return limit_.rows() > 0; }
+    // Total number of weights, over all the tables
+    long getNumWeights() const {
+        return long(refine_.index_.size()) + limit_.index_.size() +
+               tangent0_.index_.size() + tangent1_.index_.size();
+    }
+
+    // out[i] = level-N position of vertex i, for getNumControlVertices()
+    // control positions and getNumVertices() outputs
+    void refine(const Cvec3 control[], Cvec3 out[],
+                const bool parallel = false) const {
+        for_rows__(getNumVertices(), [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i)
+                out[i] = apply_row__(refine_, i, control);
+        }, parallel);
+    }
+    // Limit surface positions and unit normals at the level-N vertices
+    void limit(const Cvec3 control[], Cvec3 positions[], Cvec3 normals[],
+               const bool parallel = false) const {
+        if (!hasLimit())
+            throw std::runtime_error("Limit stencils were not built.");
+        for_rows__(getNumVertices(), [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i) {
+                positions[i] = apply_row__(limit_, i, control);
+                normals[i] = normalize(cross(apply_row__(tangent0_, i, control),
+                                             apply_row__(tangent1_, i, control)));
+            }
+        }, parallel);
+    }
+
+    // Same as above, reading the control positions from the control mesh and
+    // writing the positions (and normals) of the refined mesh. Both run on
+    // the thread pool when refined is in parallel mode. Every vertex moves,
+    // so dirty tracking is held off while the rows are written (it is not
+    // thread safe) and the positions count as replaced as a whole.
+    void refine(Mesh &control, Mesh &refined) const {
+        const std::vector<Cvec3> c = positions__(control);
+        const bool tracking = refined.isTrackingDirtyVertices();
+        refined.trackDirtyVertices(false);
+        for_rows__(getNumVertices(), [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i)
+                refined.getVertex(i).setPosition(apply_row__(refine_, i, &c[0]));
+        }, refined.isParallel());
+        refined.trackDirtyVertices(tracking);
+    }
+    void limit(Mesh &control, Mesh &refined) const {
+        if (!hasLimit())
+            throw std::runtime_error("Limit stencils were not built.");
+        const std::vector<Cvec3> c = positions__(control);
+        const bool tracking = refined.isTrackingDirtyVertices();
+        refined.trackDirtyVertices(false);
+        for_rows__(getNumVertices(), [&](const int lo, const int hi) {
+            for (int i = lo; i < hi; ++i) {
+                const Mesh::Vertex v = refined.getVertex(i);
+                v.setPosition(apply_row__(limit_, i, &c[0]));
+                v.setNormal(normalize(cross(apply_row__(tangent0_, i, &c[0]),
+                                            apply_row__(tangent1_, i, &c[0]))));
+            }
+        }, refined.isParallel());
+        refined.trackDirtyVertices(tracking);
+    }
+};
+
+#endif
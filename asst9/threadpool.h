@@ -0,0 +1,129 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small persistent pool of worker threads for data-parallel loops.
+//
+// parallelFor(begin, end, fn) splits [begin, end) into contiguous chunks and
+// calls fn(lo, hi) on each of them, with the calling thread pitching in as
+// one of the workers. It returns once every chunk is done, so each call is a
+// full barrier. Calls are not reentrant: fn must not call parallelFor on the
+// same pool. fn must not throw either; record errors and report them after
+// parallelFor returns.
+class ThreadPool {
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_, done_;
+
+    // current job, guarded by mutex_ (except for the atomic counters)
+    std::function<void(int, int)> job_;
+    int begin_, end_, grain_;
+    std::atomic<int> next_;   // next chunk to hand out
+    int busy_;                // workers still inside the current job
+    unsigned generation_;     // bumped for every job
+    bool quit_;
+
+    void run_chunks__() {
+        for (;;) {
+            const int lo = begin_ + grain_ * next_.fetch_add(1);
+            if (lo >= end_)
+                return;
+            job_(lo, std::min(lo + grain_, end_));
+        }
+    }
+    void worker__() {
+        unsigned seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock,
+                           [&] { return quit_ || generation_ != seen; });
+                if (quit_)
+                    return;
+                seen = generation_;
+            }
+            run_chunks__();
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--busy_ == 0)
+                done_.notify_one();
+        }
+    }
+
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+  public:
+    // numThreads counts the calling thread; 0 means one per hardware thread
+    explicit ThreadPool(int numThreads = 0)
+        : begin_(0), end_(0), grain_(1), next_(0), busy_(0), generation_(0),
+          quit_(false) {
+        if (numThreads <= 0)
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 1; i < numThreads; ++i)
+            workers_.push_back(std::thread(&ThreadPool::worker__, this));
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        wake_.notify_all();
+        for (std::size_t i = 0; i < workers_.size(); ++i)
+            workers_[i].join();
+    }
+
+    int getNumThreads() const { return workers_.size() + 1; }
+
+    // Calls fn(lo, hi) over chunks of [begin, end), no smaller than minGrain
+    // elements, and waits for all of them to finish
+    template <typename F>
+    void parallelFor(const int begin, const int end, F fn,
+                     const int minGrain = 1024) {
+        if (end <= begin)
+            return;
+        const int n = end - begin;
+        // about four chunks per thread to even out the load
+        const int grain =
+            std::max(minGrain, (n + 4 * getNumThreads() - 1) /
+                                   (4 * getNumThreads()));
+        if (workers_.empty() || n <= grain) {
+            fn(begin, end);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = fn;
+            begin_ = begin;
+            end_ = end;
+            grain_ = grain;
+            next_ = 0;
+            busy_ = workers_.size();
+            ++generation_;
+        }
+        wake_.notify_all();
+        run_chunks__();
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&] { return busy_ == 0; });
+        job_ = std::function<void(int, int)>();
+    }
+
+    // Process-wide pool, created on first use. Sized to the machine unless
+    // the CS175_NUM_THREADS environment variable says otherwise.
+    static ThreadPool &shared() {
+        static ThreadPool pool(std::getenv("CS175_NUM_THREADS")
+                                   ? std::atoi(std::getenv("CS175_NUM_THREADS"))
+                                   : 0);
+        return pool;
+    }
+};
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef VERTEXCACHE_H
+#define VERTEXCACHE_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "mesh.h"
+
+//--------------------------------------------------------------------------------
+// Helpers for turning a Mesh into indexed triangles that are friendly to the
+// GPU's post-transform vertex cache
+//--------------------------------------------------------------------------------
+
+// Appends the triangles of m to indices, as three mesh vertex indices each.
+// Quads are split along their 0-2 diagonal.
+inline void getMeshTriangles(Mesh &m, std::vector<unsigned> &indices) {
+    indices.reserve(indices.size() + 3 * 2 * m.getNumFaces());
+    for (int i = 0; i < m.getNumFaces(); ++i) {
+        const Mesh::Face f = m.getFace(i);
+        const int v0 = f.getVertex(0).getIndex();
+        for (int j = 1; j + 1 < f.getNumVertices(); ++j) {
+            indices.push_back(v0);
+            indices.push_back(f.getVertex(j).getIndex());
+            indices.push_back(f.getVertex(j + 1).getIndex());
+        }
+    }
+}
+
+// Number of triangles getMeshTriangles() gives for m
+inline int getNumMeshTriangles(Mesh &m) {
+    int n = 0;
+    for (int i = 0; i < m.getNumFaces(); ++i)
+        n += m.getFace(i).getNumVertices() - 2;
+    return n;
+}
+
+// Average cache miss ratio: vertex shader invocations per triangle when
+// drawing the triangle list through a FIFO cache of cacheSize entries. Lies
+// between 0.5 and 3; lower is better.
+inline double computeAcmr(const std::vector<unsigned> &indices,
+                          const int numVertices, const int cacheSize = 32) {
+    if (indices.empty())
+        return 0;
+    // stamp[v] is the miss count at which v entered the cache, so v is still
+    // cached as long as fewer than cacheSize misses happened since
+    std::vector<long> stamp(numVertices, -cacheSize - 1);
+    long misses = 0;
+    for (std::size_t i = 0; i < indices.size(); ++i) {
+        if (misses - stamp[indices[i]] > cacheSize) {
+            stamp[indices[i]] = misses;
+            ++misses;
+        }
+    }
+    return double(misses) / (indices.size() / 3);
+}
+
+// Reorders the triangles of an indexed triangle list for the post-transform
+// vertex cache, following Tom Forsyth's "Linear-Speed Vertex Cache
+// Optimisation". Triangles are emitted greedily by score, where a vertex
+// scores for being recently used and for having few triangles left.
+inline void optimizeVertexCache(std::vector<unsigned> &indices,
+                                const int numVertices) {
+    const int CACHE_SIZE = 32;
+    const double CACHE_DECAY_POWER = 1.5, LAST_TRI_SCORE = 0.75,
+                 VALENCE_BOOST_SCALE = 2.0, VALENCE_BOOST_POWER = 0.5;
+    const int numTris = indices.size() / 3;
+    if (numTris == 0)
+        return;
+
+    // vertex -> triangles, in compressed-sparse-row layout
+    std::vector<int> triOffset(numVertices + 1, 0), tris(3 * numTris);
+    for (int i = 0; i < 3 * numTris; ++i)
+        ++triOffset[indices[i] + 1];
+    for (int v = 0; v < numVertices; ++v)
+        triOffset[v + 1] += triOffset[v];
+    std::vector<int> remaining(numVertices, 0); // triangles not yet emitted
+    for (int i = 0; i < 3 * numTris; ++i) {
+        const int v = indices[i];
+        tris[triOffset[v] + remaining[v]++] = i / 3;
+    }
+
+    std::vector<int> cachePos(numVertices, -1);
+    std::vector<double> vertexScore(numVertices), triScore(numTris, 0);
+    std::vector<char> emitted(numTris, 0);
+    // the score terms only depend on small integers, so tabulate them
+    const int MAX_VALENCE = 32;
+    double cacheScore[CACHE_SIZE], valenceScore[MAX_VALENCE];
+    for (int p = 0; p < CACHE_SIZE; ++p) {
+        cacheScore[p] = p < 3 ? LAST_TRI_SCORE
+                              : std::pow(1.0 - double(p - 3) / (CACHE_SIZE - 3),
+                                         CACHE_DECAY_POWER);
+    }
+    for (int n = 1; n < MAX_VALENCE; ++n)
+        valenceScore[n] = VALENCE_BOOST_SCALE * std::pow(n, -VALENCE_BOOST_POWER);
+    const auto score = [&](const int v) {
+        const int n = remaining[v];
+        if (n == 0)
+            return -1.0;
+        return (cachePos[v] >= 0 ? cacheScore[cachePos[v]] : 0.0) +
+               (n < MAX_VALENCE
+                    ? valenceScore[n]
+                    : VALENCE_BOOST_SCALE * std::pow(n, -VALENCE_BOOST_POWER));
+    };
+    for (int v = 0; v < numVertices; ++v)
+        vertexScore[v] = score(v);
+    int best = 0;
+    for (int t = 0; t < numTris; ++t) {
+        for (int k = 0; k < 3; ++k)
+            triScore[t] += vertexScore[indices[3 * t + k]];
+        if (triScore[t] > triScore[best])
+            best = t;
+    }
+
+    std::vector<unsigned> out;
+    out.reserve(3 * numTris);
+    std::vector<int> cache, nextCache;
+    cache.reserve(CACHE_SIZE + 3);
+    nextCache.reserve(CACHE_SIZE + 3);
+    int scan = 0; // all triangles before scan are emitted
+    for (int n = 0; n < numTris; ++n) {
+        if (best < 0) {
+            // nothing in the cache has triangles left; take the next one
+            while (emitted[scan])
+                ++scan;
+            best = scan;
+        }
+        emitted[best] = true;
+        nextCache.clear();
+        for (int k = 0; k < 3; ++k) {
+            const int v = indices[3 * best + k];
+            out.push_back(v);
+            nextCache.push_back(v);
+            // drop best from v's triangle list
+            int *b = &tris[triOffset[v]], *e = b + remaining[v];
+            std::swap(*std::find(b, e, best), e[-1]);
+            --remaining[v];
+        }
+        for (std::size_t i = 0; i < cache.size(); ++i) {
+            if (std::find(nextCache.begin(), nextCache.begin() + 3,
+                          cache[i]) == nextCache.begin() + 3)
+                nextCache.push_back(cache[i]);
+        }
+        // rescore everything that was in the cache, including what fell out
+        for (std::size_t i = 0; i < nextCache.size(); ++i)
+            cachePos[nextCache[i]] = i < (std::size_t)CACHE_SIZE ? i : -1;
+        best = -1;
+        double bestScore = -1;
+        for (std::size_t i = 0; i < nextCache.size(); ++i) {
+            const int v = nextCache[i];
+            const double d = score(v) - vertexScore[v];
+            vertexScore[v] += d;
+            for (int j = triOffset[v], e = j + remaining[v]; j < e; ++j) {
+                const int t = tris[j];
+                triScore[t] += d;
+            }
+        }
+        for (std::size_t i = 0;
+             i < nextCache.size() && i < (std::size_t)CACHE_SIZE; ++i) {
+            const int v = nextCache[i];
+            for (int j = triOffset[v], e = j + remaining[v]; j < e; ++j) {
+                if (triScore[tris[j]] > bestScore) {
+                    bestScore = triScore[tris[j]];
+                    best = tris[j];
+                }
+            }
+        }
+        if (nextCache.size() > (std::size_t)CACHE_SIZE)
+            nextCache.resize(CACHE_SIZE);
+        cache.swap(nextCache);
+    }
+    indices.swap(out);
+}
+
+#endif